@@ -18,6 +18,7 @@ ADDRESS_SANITIZER ?= false
 CMAKE_BUILD_TYPE ?= Release
 CMAKE_BASE_DIR = cmake-build-$(shell echo $(CMAKE_BUILD_TYPE) | tr A-Z a-z)-$(HOST_ARCH)
 TRACE_SINSP_EVENTS ?= false
+USE_FLAT_HASH_MAP ?= false
 DISABLE_PROFILING ?= false
 BPF_DEBUG_MODE ?= false
 
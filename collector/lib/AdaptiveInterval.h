@@ -0,0 +1,76 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+
+namespace collector {
+
+// AdaptiveInterval adapts the time between two scrapes to the activity they observe, within bounds:
+//  - after consecutive scrapes without any change, the interval doubles, so that idle nodes are scraped less often,
+//  - when the activity spikes well over its recent average, the interval halves, for faster feedback,
+//  - otherwise, it gets back to the base interval.
+// Activity is the number of changes reported plus the number of new connections tracked, per base interval, such that
+// it does not depend on the current interval. With equal bounds, the interval stays fixed.
+//
+// Update() must only be called from one thread, but interval() can be called from any.
+class AdaptiveInterval {
+ public:
+  using Duration = std::chrono::milliseconds;
+
+  // Number of consecutive scrapes without changes after which the interval starts growing.
+  static constexpr size_t kIdleScrapes = 2;
+  // Activity is a spike when it is this many times over its average...
+  static constexpr double kSpikeFactor = 2.0;
+  // ... and at least this high, such that going from one to three connections is not one.
+  static constexpr double kMinSpikeActivity = 100;
+  // Weight of the last scrape in the average activity.
+  static constexpr double kAverageWeight = 0.25;
+
+  AdaptiveInterval(Duration base, Duration min, Duration max)
+      : min_(std::min(min, base)), max_(std::max(max, base)), base_(base), interval_(base.count()) {}
+
+  // Updates the interval given the number of changes reported by the last scrape, and the number of connections newly
+  // tracked since the previous one, be it from events or from the scrape, and returns the new interval.
+  Duration Update(size_t num_changes, size_t num_new_connections) {
+    Duration interval = this->interval();
+    double activity = static_cast<double>(num_changes + num_new_connections) * base_.count() /
+                      std::max(interval.count(), Duration::rep(1));
+
+    if (num_changes == 0) {
+      idle_scrapes_++;
+    } else {
+      idle_scrapes_ = 0;
+    }
+
+    if (idle_scrapes_ >= kIdleScrapes) {
+      interval = std::min(interval * 2, max_);
+    } else if (has_average_ && activity >= kMinSpikeActivity && activity > kSpikeFactor * average_activity_) {
+      interval = std::max(std::min(interval, base_) / 2, min_);
+    } else if (num_changes > 0) {
+      // Get back to the base interval at once after idling, but gradually after a spike, in case it goes on.
+      interval = interval > base_ ? base_ : std::min(interval * 2, base_);
+    }
+
+    average_activity_ = has_average_ ? kAverageWeight * activity + (1 - kAverageWeight) * average_activity_ : activity;
+    has_average_ = true;
+
+    interval_.store(interval.count(), std::memory_order_relaxed);
+    return interval;
+  }
+
+  Duration interval() const { return Duration(interval_.load(std::memory_order_relaxed)); }
+
+ private:
+  const Duration min_;
+  const Duration max_;
+  const Duration base_;
+  std::atomic<Duration::rep> interval_;
+
+  size_t idle_scrapes_ = 0;
+  double average_activity_ = 0;
+  bool has_average_ = false;
+};
+
+}  // namespace collector
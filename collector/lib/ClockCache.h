@@ -0,0 +1,94 @@
+#pragma once
+
+#include <utility>
+#include <vector>
+
+#include "Hash.h"
+
+namespace collector {
+
+// ClockCache is a fixed capacity map, which evicts entries that were not used recently when full. It uses the CLOCK
+// approximation of LRU: entries are kept in a circular buffer with a "referenced" flag, set when they are found. To
+// make room, a hand sweeps the buffer, clearing the flags it passes, and evicts the first entry without one.
+// It is not thread safe.
+template <typename K, typename V>
+class ClockCache {
+ public:
+  explicit ClockCache(size_t capacity) : capacity_(capacity) {}
+
+  // Returns the value cached for the key, or null if there is none. The pointer is valid until the next call to a
+  // non-const member function.
+  V* Find(const K& key) {
+    auto it = index_.find(key);
+    if (it == index_.end()) {
+      return nullptr;
+    }
+    Entry& entry = entries_[it->second];
+    entry.referenced = true;
+    return &entry.value;
+  }
+
+  // Caches a value for a key which is not cached yet, evicting another entry if the cache is full.
+  void Insert(const K& key, V value) {
+    if (capacity_ == 0) {
+      return;
+    }
+    if (entries_.size() < capacity_) {
+      index_.emplace(key, entries_.size());
+      entries_.push_back({key, std::move(value), false});
+      return;
+    }
+
+    while (entries_[hand_].referenced) {
+      entries_[hand_].referenced = false;
+      hand_ = (hand_ + 1) % entries_.size();
+    }
+    Entry& entry = entries_[hand_];
+    index_.erase(entry.key);
+    index_.emplace(key, hand_);
+    entry = {key, std::move(value), false};
+    hand_ = (hand_ + 1) % entries_.size();
+  }
+
+  // Removes the entries whose key matches the predicate, keeping the others and their flags.
+  template <typename Pred>
+  void EraseIf(const Pred& pred) {
+    size_t kept = 0;
+    for (size_t i = 0; i < entries_.size(); i++) {
+      if (pred(entries_[i].key)) {
+        index_.erase(entries_[i].key);
+        continue;
+      }
+      if (kept != i) {
+        entries_[kept] = std::move(entries_[i]);
+        index_[entries_[kept].key] = kept;
+      }
+      kept++;
+    }
+    entries_.erase(entries_.begin() + kept, entries_.end());
+    hand_ = kept == 0 ? 0 : hand_ % kept;
+  }
+
+  void Clear() {
+    entries_.clear();
+    index_.clear();
+    hand_ = 0;
+  }
+
+  size_t size() const { return entries_.size(); }
+  size_t capacity() const { return capacity_; }
+
+ private:
+  struct Entry {
+    K key;
+    V value;
+    bool referenced;
+  };
+
+  size_t capacity_;
+  std::vector<Entry> entries_;
+  UnorderedMap<K, size_t> index_;
+  size_t hand_ = 0;
+};
+
+}  // namespace collector
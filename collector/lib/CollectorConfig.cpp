@@ -54,6 +54,12 @@ BoolEnvVar collect_connection_status("ROX_COLLECT_CONNECTION_STATUS", true);
 
 BoolEnvVar enable_external_ips("ROX_COLLECTOR_EXTERNAL_IPS_ENABLE", false);
 
+// When external IPs are enabled, external addresses are aggregated into subnets of the given lengths once the
+// connections to a subnet span more than this number of addresses, 0 meaning no aggregation.
+IntEnvVar external_ips_aggregation_threshold("ROX_COLLECTOR_EXTERNAL_IPS_AGGREGATION_THRESHOLD", 0);
+IntEnvVar external_ipv4_aggregation_bits("ROX_COLLECTOR_EXTERNAL_IPV4_AGGREGATION_BITS", 24);
+IntEnvVar external_ipv6_aggregation_bits("ROX_COLLECTOR_EXTERNAL_IPV6_AGGREGATION_BITS", 48);
+
 BoolEnvVar enable_connection_stats("ROX_COLLECTOR_ENABLE_CONNECTION_STATS", true);
 
 BoolEnvVar enable_detailed_metrics("ROX_COLLECTOR_ENABLE_DETAILED_METRICS", true);
@@ -67,9 +73,36 @@ BoolEnvVar enable_introspection("ROX_COLLECTOR_INTROSPECTION_ENABLE", false);
 
 BoolEnvVar track_send_recv("ROX_COLLECTOR_TRACK_SEND_RECV", false);
 
+// Maximum number of connections tracked between two scrapes, 0 meaning no limit. Each tracked connection takes about
+// 100 bytes, so this bounds the memory used by the connection tracker under a flood of new connections.
+IntEnvVar max_tracked_connections("ROX_COLLECTOR_MAX_TRACKED_CONNECTIONS", 0);
+
+// Estimated memory the tracked connections may take, in bytes, 0 meaning no limit. When both this and the number of
+// connections are bounded, the lowest limit applies.
+IntEnvVar max_tracked_connection_bytes("ROX_COLLECTOR_MAX_TRACKED_CONNECTION_BYTES", 0);
+
+// Maximum number of connections tracked for a single container, 0 meaning no limit. New connections of a container
+// over this limit are dropped before reaching the connection tracker's state.
+IntEnvVar max_tracked_connections_per_container("ROX_COLLECTOR_MAX_TRACKED_CONNECTIONS_PER_CONTAINER", 0);
+
+// Maximum number of connections and endpoints, and of their serialized bytes, in a network status message, 0 meaning no
+// limit. Deltas over these limits are split into several messages sent back to back, which bounds the size of the
+// messages and of the arena they are built in, e.g. after a restart or a reconnection to Sensor. The default size
+// stays well below gRPC's default maximum message size.
+IntEnvVar network_message_max_entries("ROX_COLLECTOR_NETWORK_MESSAGE_MAX_ENTRIES", CollectorConfig::kNetworkMessageMaxEntries);
+IntEnvVar network_message_max_bytes("ROX_COLLECTOR_NETWORK_MESSAGE_MAX_BYTES", CollectorConfig::kNetworkMessageMaxBytes);
+
+// If true, container IDs and process strings repeated in the network status messages of a stream are sent once, then
+// referenced by index, see StringDictionary.h. Sensor is told through the stream's capabilities, and must support it.
+BoolEnvVar network_string_dictionary("ROX_COLLECTOR_NETWORK_STRING_DICTIONARY", false);
+
 // Collector arguments alternatives
 StringEnvVar log_level("ROX_COLLECTOR_LOG_LEVEL");
 IntEnvVar scrape_interval("ROX_COLLECTOR_SCRAPE_INTERVAL");
+// Bounds of the scrape interval, in seconds, 0 meaning the scrape interval itself. Within them, the interval grows while
+// scrapes report no change, and shrinks when churn spikes.
+IntEnvVar scrape_interval_min("ROX_COLLECTOR_SCRAPE_INTERVAL_MIN", 0);
+IntEnvVar scrape_interval_max("ROX_COLLECTOR_SCRAPE_INTERVAL_MAX", 0);
 BoolEnvVar scrape_off("ROX_COLLECTOR_SCRAPE_DISABLED");
 StringEnvVar grpc_server("GRPC_SERVER");
 StringEnvVar collector_config("COLLECTOR_CONFIG");
@@ -105,6 +138,9 @@ void CollectorConfig::InitCollectorConfig(CollectorArgs* args) {
   import_users_ = set_import_users.value();
   collect_connection_status_ = collect_connection_status.value();
   enable_external_ips_ = enable_external_ips.value();
+  external_ips_aggregation_threshold_ = std::max(external_ips_aggregation_threshold.value(), 0);
+  external_ipv4_aggregation_bits_ = std::clamp(external_ipv4_aggregation_bits.value(), 0, 32);
+  external_ipv6_aggregation_bits_ = std::clamp(external_ipv6_aggregation_bits.value(), 0, 128);
   enable_connection_stats_ = enable_connection_stats.value();
   enable_detailed_metrics_ = enable_detailed_metrics.value();
   enable_runtime_config_ = enable_runtime_config.value();
@@ -112,6 +148,14 @@ void CollectorConfig::InitCollectorConfig(CollectorArgs* args) {
   use_podman_ce_ = use_podman_ce.value();
   enable_introspection_ = enable_introspection.value();
   track_send_recv_ = track_send_recv.value();
+  max_tracked_connections_ = std::max(max_tracked_connections.value(), 0);
+  max_tracked_connection_bytes_ = std::max(max_tracked_connection_bytes.value(), 0);
+  max_tracked_connections_per_container_ = std::max(max_tracked_connections_per_container.value(), 0);
+  network_message_max_entries_ = std::max(network_message_max_entries.value(), 0);
+  network_message_max_bytes_ = std::max(network_message_max_bytes.value(), 0);
+  network_string_dictionary_ = network_string_dictionary.value();
+  scrape_interval_min_ = std::max(scrape_interval_min.value(), 0);
+  scrape_interval_max_ = std::max(scrape_interval_max.value(), 0);
   disable_process_arguments_ = disable_process_arguments.value();
 
   for (const auto& syscall : kSyscalls) {
@@ -432,6 +476,7 @@ std::ostream& operator<<(std::ostream& os, const CollectorConfig& c) {
   return os
          << "collection_method:" << c.GetCollectionMethod()
          << ", scrape_interval:" << c.ScrapeInterval()
+         << ", scrape_interval_bounds:[" << c.ScrapeIntervalMin() << ", " << c.ScrapeIntervalMax() << "]"
          << ", turn_off_scrape:" << c.TurnOffScrape()
          << ", hostname:" << HostInfo::GetHostname()
          << ", processesListeningOnPorts:" << c.IsProcessesListeningOnPortsEnabled()
@@ -440,6 +485,7 @@ std::ostream& operator<<(std::ostream& os, const CollectorConfig& c) {
          << ", collect_connection_status:" << c.CollectConnectionStatus()
          << ", enable_detailed_metrics:" << c.EnableDetailedMetrics()
          << ", enable_external_ips:" << c.EnableExternalIPs()
+         << ", external_ips_aggregation_threshold:" << c.ExternalIPsAggregationThreshold()
          << ", track_send_recv:" << c.TrackingSendRecv();
 }
 
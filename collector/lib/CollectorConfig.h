@@ -1,5 +1,7 @@
 #pragma once
 
+#include <algorithm>
+#include <chrono>
 #include <filesystem>
 #include <optional>
 #include <ostream>
@@ -30,6 +32,8 @@ class CollectorConfig {
   static constexpr bool kTurnOffScrape = false;
   static constexpr int kScrapeInterval = 30;
   static constexpr int64_t kMaxConnectionsPerMinute = 2048;
+  static constexpr int kNetworkMessageMaxEntries = 10000;
+  static constexpr int kNetworkMessageMaxBytes = 2 * 1024 * 1024;
   static constexpr CollectionMethod kCollectionMethod = CollectionMethod::CORE_BPF;
   static constexpr const char* kSyscalls[] = {
       "accept",
@@ -78,6 +82,9 @@ class CollectorConfig {
   bool TurnOffScrape() const;
   bool ScrapeListenEndpoints() const { return scrape_listen_endpoints_; }
   int ScrapeInterval() const;
+  // Bounds of the scrape interval, in seconds, which adapts to the observed churn between them.
+  int ScrapeIntervalMin() const { return scrape_interval_min_ > 0 ? std::min(scrape_interval_min_, scrape_interval_) : scrape_interval_; }
+  int ScrapeIntervalMax() const { return std::max(scrape_interval_max_, scrape_interval_); }
   const std::filesystem::path& HostProc() const;
   CollectionMethod GetCollectionMethod() const;
   std::vector<std::string> Syscalls() const;
@@ -129,9 +136,13 @@ class CollectorConfig {
   }
 
   int64_t PerContainerRateLimit() const {
+    return PerContainerRateLimit(std::chrono::seconds(scrape_interval_));
+  }
+
+  int64_t PerContainerRateLimit(std::chrono::milliseconds interval) const {
     int64_t max_connections_per_minute = MaxConnectionsPerMinute();
     // Converts from max connections per minute to connections per scrape interval.
-    return int64_t(std::round(float(max_connections_per_minute) * float(scrape_interval_) / 60.0));
+    return int64_t(std::round(float(max_connections_per_minute) * float(interval.count()) / 60000.0));
   }
 
   std::string GetRuntimeConfigStr() {
@@ -156,6 +167,15 @@ class CollectorConfig {
   bool UsePodmanCe() const { return use_podman_ce_; }
   bool IsIntrospectionEnabled() const { return enable_introspection_; }
   bool TrackingSendRecv() const { return track_send_recv_; }
+  size_t MaxTrackedConnections() const { return max_tracked_connections_; }
+  size_t MaxTrackedConnectionBytes() const { return max_tracked_connection_bytes_; }
+  size_t MaxTrackedConnectionsPerContainer() const { return max_tracked_connections_per_container_; }
+  size_t NetworkMessageMaxEntries() const { return network_message_max_entries_; }
+  size_t NetworkMessageMaxBytes() const { return network_message_max_bytes_; }
+  bool NetworkStringDictionary() const { return network_string_dictionary_; }
+  size_t ExternalIPsAggregationThreshold() const { return external_ips_aggregation_threshold_; }
+  size_t ExternalIPv4AggregationBits() const { return external_ipv4_aggregation_bits_; }
+  size_t ExternalIPv6AggregationBits() const { return external_ipv6_aggregation_bits_; }
   const std::vector<double>& GetConnectionStatsQuantiles() const { return connection_stats_quantiles_; }
   double GetConnectionStatsError() const { return connection_stats_error_; }
   unsigned int GetConnectionStatsWindow() const { return connection_stats_window_; }
@@ -195,6 +215,8 @@ class CollectorConfig {
 
  protected:
   int scrape_interval_;
+  int scrape_interval_min_ = 0;
+  int scrape_interval_max_ = 0;
   CollectionMethod collection_method_;
   bool turn_off_scrape_;
   std::vector<std::string> syscalls_;
@@ -213,6 +235,9 @@ class CollectorConfig {
   bool import_users_;
   bool collect_connection_status_;
   bool enable_external_ips_ = false;
+  size_t external_ips_aggregation_threshold_ = 0;
+  size_t external_ipv4_aggregation_bits_ = 24;
+  size_t external_ipv6_aggregation_bits_ = 48;
   bool enable_connection_stats_;
   bool enable_detailed_metrics_;
   bool enable_runtime_config_;
@@ -220,6 +245,12 @@ class CollectorConfig {
   bool use_podman_ce_;
   bool enable_introspection_;
   bool track_send_recv_;
+  size_t max_tracked_connections_ = 0;
+  size_t max_tracked_connection_bytes_ = 0;
+  size_t max_tracked_connections_per_container_ = 0;
+  size_t network_message_max_entries_ = kNetworkMessageMaxEntries;
+  size_t network_message_max_bytes_ = kNetworkMessageMaxBytes;
+  bool network_string_dictionary_ = false;
   std::vector<double> connection_stats_quantiles_;
   double connection_stats_error_;
   unsigned int connection_stats_window_;
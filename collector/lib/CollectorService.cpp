@@ -46,6 +46,10 @@ CollectorService::CollectorService(CollectorConfig& config, std::atomic<ControlV
     conn_tracker_->UpdateIgnoredL4ProtoPortPairs(std::move(ignored_l4proto_port_pairs));
     conn_tracker_->UpdateIgnoredNetworks(config_.IgnoredNetworks());
     conn_tracker_->UpdateNonAggregatedNetworks(config_.NonAggregatedNetworks());
+    conn_tracker_->SetMaxConnections(config_.MaxTrackedConnections());
+    conn_tracker_->SetMaxConnectionBytes(config_.MaxTrackedConnectionBytes());
+    conn_tracker_->SetMaxConnectionsPerContainer(config_.MaxTrackedConnectionsPerContainer());
+    conn_tracker_->SetExternalIPsAggregation(config_.ExternalIPsAggregationThreshold(), config_.ExternalIPv4AggregationBits(), config_.ExternalIPv6AggregationBits());
 
     net_status_notifier_ = std::make_unique<NetworkStatusNotifier>(
         conn_tracker_,
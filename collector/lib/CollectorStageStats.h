@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "prometheus/histogram.h"
+#include "prometheus/registry.h"
+
+namespace collector {
+
+// CollectorStageStats keeps a latency histogram for each stage of a pipeline, all in the same family, labeled by stage.
+// It can be given to a ScopedTimer (see CollectorStats.h) to time a stage.
+class CollectorStageStats {
+ public:
+  CollectorStageStats(
+      prometheus::Registry* registry,
+      const std::string& name,
+      const std::string& help,
+      const std::vector<std::string>& stages,
+      const std::vector<double>& buckets) {
+    auto& family = prometheus::BuildHistogram()
+                       .Name(name)
+                       .Help(help)
+                       .Register(*registry);
+    for (const auto& stage : stages) {
+      histograms_.push_back(&family.Add({{"stage", stage}}, buckets));
+    }
+  }
+
+  void EndTimerAt(size_t stage, int64_t duration_us) {
+    histograms_[stage]->Observe(static_cast<double>(duration_us) / 1e6);
+  }
+
+ private:
+  // Owned by the prometheus::Registry, see CollectorConnectionStats.
+  std::vector<prometheus::Histogram*> histograms_;
+};
+
+}  // namespace collector
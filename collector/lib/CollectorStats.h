@@ -21,11 +21,20 @@
   X(net_conn_deltas)                        \
   X(net_conn_inactive)                      \
   X(net_conn_rate_limited)                  \
+  X(net_conn_address_cache_hit)             \
+  X(net_conn_address_cache_miss)            \
+  X(net_conn_evicted_inactive)              \
+  X(net_conn_evicted_active)                \
+  X(net_conn_container_limited)             \
   X(net_cep_updates)                        \
   X(net_cep_deltas)                         \
   X(net_cep_inactive)                       \
   X(net_known_ip_networks)                  \
   X(net_known_public_ips)                   \
+  X(net_aggregated_external_subnets)        \
+  X(net_proto_cache_hit)                    \
+  X(net_proto_cache_miss)                   \
+  X(net_scrape_interval_ms)                 \
   X(process_lineage_counts)                 \
   X(process_lineage_total)                  \
   X(process_lineage_sqr_total)              \
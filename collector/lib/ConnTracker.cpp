@@ -1,10 +1,13 @@
 #include "ConnTracker.h"
 
+#include <algorithm>
+#include <optional>
 #include <utility>
 
 #include "CollectorStats.h"
 #include "Containers.h"
 #include "Logging.h"
+#include "TimeUtil.h"
 #include "Utility.h"
 
 namespace collector {
@@ -13,7 +16,17 @@ namespace {
 
 static const Address canonical_external_ipv4_addr(255, 255, 255, 255);
 static const Address canonical_external_ipv6_addr(0xffffffffffffffffULL, 0xffffffffffffffffULL);
-static const NRadixTree private_networks_tree(PrivateNetworks());
+
+// Returns the network of the given length containing the address, with the address bits past the prefix cleared.
+IPNet SubnetOf(const Address& address, size_t bits) {
+  std::array<uint64_t, Address::kU64MaxLen> data = address.array();
+  for (size_t i = 0; i < data.size(); i++) {
+    size_t word_bits = bits > 64 * i ? std::min<size_t>(bits - 64 * i, 64) : 0;
+    uint64_t mask = word_bits == 64 ? ~static_cast<uint64_t>(0) : ~(~static_cast<uint64_t>(0) >> word_bits);
+    data[i] &= htonll(mask);
+  }
+  return IPNet(Address(address.family(), data), bits);
+}
 
 }  // namespace
 
@@ -33,62 +46,119 @@ bool AdvertisedEndpointEquality::operator()(const ContainerEndpoint& lhs, const
     }
   }
 
-  return lhs.container() == rhs.container() && lhs.endpoint() == rhs.endpoint() && lhs.l4proto() == rhs.l4proto();
+  return lhs.container_id() == rhs.container_id() && lhs.endpoint() == rhs.endpoint() && lhs.l4proto() == rhs.l4proto();
 }
 
-bool ContainsPrivateNetwork(Address::Family family, NRadixTree tree) {
-  return tree.IsAnyIPNetSubset(family, private_networks_tree) || private_networks_tree.IsAnyIPNetSubset(family, tree);
+bool ContainsPrivateNetwork(Address::Family family, const NRadixTree& tree) {
+  // Either a network of the tree contains a private network, or it is contained in one.
+  for (const auto& network : PrivateNetworks(family)) {
+    if (!tree.Find(network).IsNull()) {
+      return true;
+    }
+  }
+  for (const auto& network : tree.GetAll()) {
+    if (network.family() == family && IsPrivateNetwork(network)) {
+      return true;
+    }
+  }
+  return false;
 }
 
 void ConnectionTracker::UpdateConnection(const Connection& conn, int64_t timestamp, bool added) {
-  WITH_LOCK(mutex_) {
-    EmplaceOrUpdateNoLock(conn, ConnStatus(timestamp, added));
+  UpdateConnections({{conn, timestamp, added}});
+}
+
+void ConnectionTracker::UpdateConnections(const std::vector<ConnectionUpdate>& updates) {
+  // Partitioning preserves the order of the updates of each connection, which matters for updates with equal
+  // timestamps.
+  std::array<std::vector<const ConnectionUpdate*>, kNumShards> updates_by_shard;
+  for (const auto& update : updates) {
+    updates_by_shard[ShardIndex(update.conn)].push_back(&update);
   }
+
+  // Only new connections need the tables, so updates of tracked ones never load them.
+  std::shared_ptr<const NetworkTables> tables;
+  for (size_t i = 0; i < kNumShards; i++) {
+    if (updates_by_shard[i].empty()) {
+      continue;
+    }
+    Shard& shard = shards_[i];
+    WITH_LOCK(shard.mutex) {
+      for (const auto* update : updates_by_shard[i]) {
+        EmplaceOrUpdateNoLock(&tables, &shard, update->conn, ConnStatus(update->timestamp, update->added));
+      }
+    }
+  }
+  EnforceConnectionLimit();
 }
 
 void ConnectionTracker::Update(
     const std::vector<Connection>& all_conns,
     const std::vector<ContainerEndpoint>& all_listen_endpoints,
     int64_t timestamp) {
-  WITH_LOCK(mutex_) {
-    // Mark all existing connections and listen endpoints as inactive
-    for (auto& prev_conn : conn_state_) {
-      prev_conn.second.SetActive(false);
-    }
-    for (auto& prev_endpoint : endpoint_state_) {
-      prev_endpoint.second.SetActive(false);
-    }
+  // Partition the input by shard before taking any lock, such that each shard is only locked once.
+  std::array<std::vector<const Connection*>, kNumShards> conns_by_shard;
+  std::array<std::vector<const ContainerEndpoint*>, kNumShards> endpoints_by_shard;
+  for (const auto& curr_conn : all_conns) {
+    conns_by_shard[ShardIndex(curr_conn)].push_back(&curr_conn);
+  }
+  for (const auto& curr_endpoint : all_listen_endpoints) {
+    endpoints_by_shard[ShardIndex(curr_endpoint)].push_back(&curr_endpoint);
+  }
 
-    ConnStatus new_status(timestamp, true);
+  ConnStatus new_status(timestamp, true);
+  scrapes_started_++;
 
-    // Insert (or mark as active) all current connections and listen endpoints.
-    for (const auto& curr_conn : all_conns) {
-      EmplaceOrUpdateNoLock(curr_conn, new_status);
-    }
-    for (const auto& curr_endpoint : all_listen_endpoints) {
-      EmplaceOrUpdateNoLock(curr_endpoint, new_status);
+  std::shared_ptr<const NetworkTables> tables;
+  for (size_t i = 0; i < kNumShards; i++) {
+    Shard& shard = shards_[i];
+    WITH_LOCK(shard.mutex) {
+      // Mark all existing connections and listen endpoints as inactive
+      for (auto& prev_conn : shard.conn_state) {
+        prev_conn.second.SetActive(false);
+      }
+      for (auto& prev_endpoint : shard.endpoint_state) {
+        prev_endpoint.second.SetActive(false);
+      }
+
+      // Insert (or mark as active) all current connections and listen endpoints.
+      for (const auto* curr_conn : conns_by_shard[i]) {
+        EmplaceOrUpdateNoLock(&tables, &shard, *curr_conn, new_status);
+      }
+      for (const auto* curr_endpoint : endpoints_by_shard[i]) {
+        EmplaceOrUpdateNoLock(&shard, *curr_endpoint, new_status);
+      }
+
+      // Connections which were reported as active are only known to have changed once all of them are updated.
+      if (!changes_unknown_) {
+        for (auto& prev_conn : shard.conn_state) {
+          MarkDirtyNoLock(&shard, prev_conn.first, &prev_conn.second);
+        }
+      }
     }
   }
+  scrapes_completed_++;
+  EnforceConnectionLimit();
 }
 
-IPNet ConnectionTracker::NormalizeAddressNoLock(const Address& address, bool enable_external_ips) const {
+IPNet ConnectionTracker::NormalizeAddressNoLock(const NetworkTables& tables, const Address& address, AddressClass address_class, bool enable_external_ips) {
   if (address.IsNull()) {
     return {};
   }
 
-  bool private_addr = !address.IsPublic();
-  bool do_not_aggregate_addr = !non_aggregated_networks_.Find(address).IsNull();
+  bool private_addr = address_class == AddressClass::PRIVATE;
+  bool do_not_aggregate_addr = !tables.non_aggregated_networks.Find(address).IsNull();
 
   // We want to keep private addresses and explicitely requested ones.
   bool keep_addr = private_addr || do_not_aggregate_addr;
 
-  const bool* known_private_networks_exists = Lookup(known_private_networks_exists_, address.family());
+  const bool* known_private_networks_exists = Lookup(tables.known_private_networks_exists, address.family());
   if (keep_addr && (known_private_networks_exists && !*known_private_networks_exists)) {
     return IPNet(address, 0, true);
   }
 
-  const auto& network = known_ip_networks_.Find(address);
-  if (keep_addr || Contains(known_public_ips_, address)) {
+  const auto& network = tables.known_ip_networks.Find(address);
+  if (keep_addr || Contains(tables.known_public_ips, address)) {
     return IPNet(address, network.bits(), true);
   }
 
@@ -97,6 +167,10 @@ IPNet ConnectionTracker::NormalizeAddressNoLock(const Address& address, bool ena
   }
 
   if (enable_external_ips) {
+    const auto& subnet = tables.aggregated_external_subnets.Find(address);
+    if (!subnet.IsNull()) {
+      return subnet;
+    }
     return IPNet(address, address.length() * 8);
   }
 
@@ -112,8 +186,12 @@ IPNet ConnectionTracker::NormalizeAddressNoLock(const Address& address, bool ena
 }
 
 bool ConnectionTracker::ShouldNormalizeConnection(const Connection* conn) const {
+  return ShouldNormalizeConnection(*GetNetworkTables(), conn);
+}
+
+bool ConnectionTracker::ShouldNormalizeConnection(const NetworkTables& tables, const Connection* conn) {
   Endpoint local, remote = conn->remote();
-  IPNet ipnet = NormalizeAddressNoLock(remote.address(), false);
+  IPNet ipnet = NormalizeAddressNoLock(tables, remote.address(), ClassifyAddress(remote.address()), false);
 
   return Address::IsCanonicalExternalIp(ipnet.address());
 }
@@ -150,8 +228,9 @@ void ConnectionTracker::CloseNormalizedConnections(ConnMap* old_conn_state, Conn
  * IP address if external IPs was enabled
  */
 void ConnectionTracker::CloseExternalUnnormalizedConnections(ConnMap* old_conn_state, ConnMap* delta_conn) {
-  CloseConnections(old_conn_state, delta_conn, [this](const Connection* conn) {
-    return ShouldNormalizeConnection(conn) && !Address::IsCanonicalExternalIp(conn->remote().address());
+  auto tables = GetNetworkTables();
+  CloseConnections(old_conn_state, delta_conn, [&tables](const Connection* conn) {
+    return ShouldNormalizeConnection(*tables, conn) && !Address::IsCanonicalExternalIp(conn->remote().address());
   });
 }
 
@@ -163,7 +242,7 @@ void ConnectionTracker::CloseConnectionsOnRuntimeConfigChange(ConnMap* old_conn_
   }
 }
 
-Connection ConnectionTracker::NormalizeConnectionNoLock(const Connection& conn) const {
+Connection ConnectionTracker::NormalizeConnectionNoLock(const Connection& conn, const IPNet& remote_network) {
   bool is_server = conn.is_server();
   if (conn.l4proto() == L4Proto::UDP) {
     // Inference of server role is unreliable for UDP, so go by port.
@@ -175,40 +254,341 @@ Connection ConnectionTracker::NormalizeConnectionNoLock(const Connection& conn)
   if (is_server) {
     // If this is the server, only the local port is relevant, while the remote port does not matter.
     local = Endpoint(IPNet(Address()), conn.local().port());
-    remote = Endpoint(NormalizeAddressNoLock(conn.remote().address(), enable_external_ips_), 0);
+    remote = Endpoint(remote_network, 0);
   } else {
     // If this is the client, the local port and address are not relevant.
     local = Endpoint();
-    remote = Endpoint(NormalizeAddressNoLock(remote.address(), enable_external_ips_), remote.port());
+    remote = Endpoint(remote_network, remote.port());
   }
 
-  return Connection(conn.container(), local, remote, conn.l4proto(), is_server);
+  return Connection(conn.container_id(), local, remote, conn.l4proto(), is_server);
+}
+
+Connection ConnectionTracker::NormalizeConnectionCachedNoLock(const NetworkTables& tables, Shard* shard, const Connection& conn) {
+  return NormalizeConnectionNoLock(conn, NormalizeAddressCachedNoLock(tables, shard, conn.remote().address()));
+}
+
+IPNet ConnectionTracker::NormalizeAddressCachedNoLock(const NetworkTables& tables, Shard* shard, const Address& address) {
+  if (tables.generation < shard->cache_tables_generation) {
+    return NormalizeAddressNoLock(tables, address, ClassifyAddress(address), tables.enable_external_ips);
+  }
+  if (const IPNet* network = shard->normalized_addresses.Find(address)) {
+    COUNTER_INC(CollectorStats::net_conn_address_cache_hit);
+    return *network;
+  }
+  COUNTER_INC(CollectorStats::net_conn_address_cache_miss);
+  IPNet network = NormalizeAddressNoLock(tables, address, ClassifyAddress(address), tables.enable_external_ips);
+  shard->normalized_addresses.Insert(address, network);
+  return network;
 }
 
 namespace {
 
+// Replaces a stored status with a more recent one, keeping the bookkeeping flags of the tracker.
+void UpdateStatus(ConnStatus* stored_status, ConnStatus status) {
+  if (status.LastActiveTime() > stored_status->LastActiveTime()) {
+    status.SetReportedActive(stored_status->WasReportedActive());
+    status.SetDirty(stored_status->IsDirty());
+    *stored_status = status;
+  }
+}
+
 /* return: true if the element has been added */
 template <typename T>
 bool EmplaceOrUpdate(UnorderedMap<T, ConnStatus>* m, const T& obj, ConnStatus status) {
   auto emplace_res = m->emplace(obj, status);
-  if (!emplace_res.second && status.LastActiveTime() > emplace_res.first->second.LastActiveTime()) {
-    emplace_res.first->second = status;
+  if (!emplace_res.second) {
+    UpdateStatus(&emplace_res.first->second, status);
   }
   return emplace_res.second;
 }
 
 }  // namespace
 
-void ConnectionTracker::EmplaceOrUpdateNoLock(const Connection& conn, ConnStatus status) {
+void ConnectionTracker::EmplaceOrUpdateNoLock(std::shared_ptr<const NetworkTables>* tables, Shard* shard, const Connection& conn, ConnStatus status) {
   COUNTER_INC(CollectorStats::net_conn_updates);
-  if (EmplaceOrUpdate(&conn_state_, conn, status)) {
-    IncrementConnectionStats(conn, inserted_connections_counters_);
+  auto it = shard->conn_state.find(conn);
+  if (it != shard->conn_state.end()) {
+    UpdateStatus(&it->second, status);
+    MarkDirtyNoLock(shard, it->first, &it->second);
+    return;
   }
+  if (!AddContainerConnection(conn.container_id())) {
+    COUNTER_INC(CollectorStats::net_conn_container_limited);
+    CLOG_THROTTLED(WARNING, std::chrono::seconds(60))
+        << "Container " << conn.container() << " has too many connections, new ones are not tracked";
+    return;
+  }
+  num_connections_.fetch_add(1, std::memory_order_relaxed);
+  it = shard->conn_state.emplace(conn, status).first;
+  MarkDirtyNoLock(shard, it->first, &it->second);
+  if (!*tables) {
+    *tables = GetNetworkTables();
+  }
+  IncrementConnectionStats(**tables, conn, shard->inserted_connections_counters);
 }
 
-void ConnectionTracker::EmplaceOrUpdateNoLock(const ContainerEndpoint& ep, ConnStatus status) {
+void ConnectionTracker::MarkDirtyNoLock(Shard* shard, const Connection& conn, ConnStatus* status) {
+  if (status->IsDirty() || (status->IsActive() && status->WasReportedActive()) || changes_unknown_) {
+    return;
+  }
+  status->SetDirty(true);
+  shard->dirty_conns.push_back(conn);
+
+  // Connections removed while listed are only dropped from the list by the next change-tracking fetch, and listed
+  // again if they come back. Once these outnumber the connections of the shard, the list is rebuilt from the flags,
+  // so that it stays bounded by twice their number whatever the churn in between fetches.
+  if (shard->dirty_conns.size() > 2 * shard->conn_state.size() + kMinDirtyConnsCompaction) {
+    shard->dirty_conns.clear();
+    for (const auto& entry : shard->conn_state) {
+      if (entry.second.IsDirty()) {
+        shard->dirty_conns.push_back(entry.first);
+      }
+    }
+  }
+}
+
+void ConnectionTracker::MarkRemovedNoLock(Shard* shard, const Connection& conn, ConnStatus status) {
+  // Only connections reported as active contribute to the normalized state. Since the flag is only ever set by
+  // change-tracking fetches, which drain this list, it holds at most as many connections as were active then.
+  if (status.WasReportedActive() && !changes_unknown_) {
+    shard->removed_conns.emplace_back(conn, status);
+  }
+}
+
+void ConnectionTracker::EmplaceOrUpdateNoLock(Shard* shard, const ContainerEndpoint& ep, ConnStatus status) {
   COUNTER_INC(CollectorStats::net_cep_updates);
-  EmplaceOrUpdate(&endpoint_state_, ep, status);
+  EmplaceOrUpdate(&shard->endpoint_state, ep, status);
+}
+
+void ConnectionTracker::EmplaceOrUpdateNoLock(const Connection& conn, ConnStatus status) {
+  Shard& shard = ShardFor(conn);
+  std::shared_ptr<const NetworkTables> tables;
+  EmplaceOrUpdateNoLock(&tables, &shard, conn, status);
+}
+
+bool ConnectionTracker::AddContainerConnection(const ContainerId& container) {
+  size_t max_connections = max_connections_per_container_;
+  auto add = [max_connections](std::atomic<size_t>* count) {
+    // Concurrent additions for the same container must not overshoot the limit.
+    size_t current = count->load(std::memory_order_relaxed);
+    do {
+      if (max_connections != 0 && current >= max_connections) {
+        return false;
+      }
+    } while (!count->compare_exchange_weak(current, current + 1, std::memory_order_relaxed));
+    return true;
+  };
+
+  {
+    std::shared_lock<std::shared_mutex> lock(container_counts_mutex_);
+    auto it = container_counts_.find(container);
+    if (it != container_counts_.end()) {
+      return add(it->second.get());
+    }
+  }
+
+  std::unique_lock<std::shared_mutex> lock(container_counts_mutex_);
+  auto& count = container_counts_[container];
+  if (!count) {
+    count = std::make_unique<std::atomic<size_t>>(0);
+  }
+  return add(count.get());
+}
+
+void ConnectionTracker::RemoveContainerConnections(const UnorderedMap<ContainerId, size_t>& removed) {
+  std::shared_lock<std::shared_mutex> lock(container_counts_mutex_);
+  for (const auto& [container, count] : removed) {
+    num_connections_.fetch_sub(count, std::memory_order_relaxed);
+    auto it = container_counts_.find(container);
+    if (it != container_counts_.end()) {
+      it->second->fetch_sub(count, std::memory_order_relaxed);
+    }
+  }
+}
+
+void ConnectionTracker::PruneContainerCounts() {
+  std::unique_lock<std::shared_mutex> lock(container_counts_mutex_);
+  for (auto it = container_counts_.begin(); it != container_counts_.end();) {
+    if (*it->second == 0) {
+      it = container_counts_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+size_t ConnectionTracker::MaxConnections() const {
+  size_t max_connections = max_connections_;
+  size_t max_bytes = max_connection_bytes_;
+  if (max_bytes != 0) {
+    size_t max_by_bytes = std::max<size_t>(max_bytes / kBytesPerConnection, 1);
+    if (max_connections == 0 || max_by_bytes < max_connections) {
+      max_connections = max_by_bytes;
+    }
+  }
+  return max_connections;
+}
+
+void ConnectionTracker::EnforceConnectionLimit() {
+  size_t max_connections = MaxConnections();
+  if (max_connections == 0 || num_connections_.load(std::memory_order_relaxed) <= max_connections) {
+    return;
+  }
+
+  // A thread already evicting brings the count below the limit for everyone.
+  std::unique_lock<std::mutex> lock(eviction_mutex_, std::try_to_lock);
+  if (!lock.owns_lock()) {
+    return;
+  }
+  size_t num_connections = num_connections_;
+  if (num_connections <= max_connections) {
+    return;
+  }
+
+  // Evict down to a lower watermark, such that the cost of looking for connections to evict is amortized over many
+  // insertions.
+  size_t target = max_connections - max_connections / 8;
+  size_t to_evict = num_connections - target;
+
+  // Oldest inactive connections go first, over all shards.
+  std::vector<int64_t> inactive_times;
+  for (auto& shard : shards_) {
+    WITH_LOCK(shard.mutex) {
+      for (const auto& entry : shard.conn_state) {
+        if (!entry.second.IsActive()) {
+          inactive_times.push_back(entry.second.LastActiveTime());
+        }
+      }
+    }
+  }
+  if (!inactive_times.empty()) {
+    size_t n = std::min(to_evict, inactive_times.size());
+    std::nth_element(inactive_times.begin(), inactive_times.begin() + (n - 1), inactive_times.end());
+    size_t evicted = EvictInactiveConnections(inactive_times[n - 1], n);
+    COUNTER_ADD(CollectorStats::net_conn_evicted_inactive, evicted);
+    to_evict -= std::min(to_evict, evicted);
+    if (evicted < inactive_times.size()) {
+      // Some inactive connections are left, active ones are not evicted yet.
+      return;
+    }
+  }
+  if (to_evict == 0) {
+    return;
+  }
+
+  // Then active connections, from the containers with the most connections, such that every container keeps at least
+  // a fair share of the remaining budget. The oldest connections of a container go first.
+  std::vector<std::pair<ContainerId, size_t>> container_counts;
+  {
+    std::shared_lock<std::shared_mutex> counts_lock(container_counts_mutex_);
+    container_counts.reserve(container_counts_.size());
+    for (const auto& [container, count] : container_counts_) {
+      container_counts.emplace_back(container, count->load(std::memory_order_relaxed));
+    }
+  }
+  std::sort(container_counts.begin(), container_counts.end(),
+            [](const auto& lhs, const auto& rhs) { return lhs.second < rhs.second; });
+
+  // Find the largest share such that keeping at most `share` connections per container fits in the target.
+  size_t share = 0, kept = 0;
+  for (size_t i = 0; i < container_counts.size(); i++) {
+    size_t remaining_containers = container_counts.size() - i;
+    if (kept + container_counts[i].second * remaining_containers > target) {
+      share = (target - kept) / remaining_containers;
+      break;
+    }
+    kept += container_counts[i].second;
+    share = container_counts[i].second;
+  }
+
+  UnorderedMap<ContainerId, size_t> max_evicted;
+  UnorderedMap<ContainerId, std::vector<int64_t>> times;
+  for (const auto& [container, count] : container_counts) {
+    if (count > share) {
+      max_evicted[container] = count - share;
+      times[container];
+    }
+  }
+  if (max_evicted.empty()) {
+    return;
+  }
+  for (auto& shard : shards_) {
+    WITH_LOCK(shard.mutex) {
+      for (const auto& entry : shard.conn_state) {
+        auto* container_times = Lookup(times, entry.first.container_id());
+        if (container_times) {
+          container_times->push_back(entry.second.LastActiveTime());
+        }
+      }
+    }
+  }
+
+  UnorderedMap<ContainerId, int64_t> cutoff;
+  for (auto& [container, container_times] : times) {
+    size_t& n = max_evicted[container];
+    n = std::min(n, container_times.size());
+    if (n == 0) {
+      continue;
+    }
+    std::nth_element(container_times.begin(), container_times.begin() + (n - 1), container_times.end());
+    cutoff[container] = container_times[n - 1];
+  }
+  COUNTER_ADD(CollectorStats::net_conn_evicted_active, EvictActiveConnections(cutoff, std::move(max_evicted)));
+}
+
+size_t ConnectionTracker::EvictInactiveConnections(int64_t cutoff, size_t max_evicted) {
+  UnorderedMap<ContainerId, size_t> removed;
+  size_t evicted = 0;
+  for (auto& shard : shards_) {
+    if (evicted == max_evicted) {
+      break;
+    }
+    WITH_LOCK(shard.mutex) {
+      for (auto it = shard.conn_state.begin(); it != shard.conn_state.end() && evicted < max_evicted;) {
+        if (it->second.IsActive() || it->second.LastActiveTime() > cutoff) {
+          ++it;
+          continue;
+        }
+        MarkRemovedNoLock(&shard, it->first, it->second);
+        removed[it->first.container_id()]++;
+        it = shard.conn_state.erase(it);
+        evicted++;
+      }
+    }
+  }
+  RemoveContainerConnections(removed);
+  PruneContainerCounts();
+  return evicted;
+}
+
+size_t ConnectionTracker::EvictActiveConnections(const UnorderedMap<ContainerId, int64_t>& cutoff, UnorderedMap<ContainerId, size_t> max_evicted) {
+  UnorderedMap<ContainerId, size_t> removed;
+  size_t evicted = 0;
+  for (auto& shard : shards_) {
+    WITH_LOCK(shard.mutex) {
+      for (auto it = shard.conn_state.begin(); it != shard.conn_state.end();) {
+        const auto& container = it->first.container_id();
+        const int64_t* container_cutoff = Lookup(cutoff, container);
+        if (!container_cutoff || it->second.LastActiveTime() > *container_cutoff || max_evicted[container] == 0) {
+          ++it;
+          continue;
+        }
+        max_evicted[container]--;
+        MarkRemovedNoLock(&shard, it->first, it->second);
+        removed[container]++;
+        it = shard.conn_state.erase(it);
+        evicted++;
+      }
+    }
+  }
+  RemoveContainerConnections(removed);
+  PruneContainerCounts();
+  return evicted;
+}
+
+void ConnectionTracker::EmplaceOrUpdateNoLock(const ContainerEndpoint& ep, ConnStatus status) {
+  EmplaceOrUpdateNoLock(&ShardFor(ep), ep, status);
 }
 
 namespace {
@@ -227,121 +607,607 @@ struct dont_filter {
   }
 };
 
-template <typename T, typename ProcessFn, typename FilterFn, typename E = std::equal_to<T>>
-UnorderedMap<T, ConnStatus, E> FetchState(UnorderedMap<T, ConnStatus>* state, bool clear_inactive,
-                                          const ProcessFn& process_fn, const FilterFn& filter_fn) {
+struct dont_count {
+  template <typename... T>
+  inline void operator()(T&&... args) const {}
+};
+
+// FetchState merges the contents of `state` into `fetched_state`, removing all inactive entries from `state` if requested,
+// after passing them to `erase_fn`.
+template <typename T, typename ProcessFn, typename FilterFn, typename EraseFn, typename E = std::equal_to<T>>
+void FetchState(UnorderedMap<T, ConnStatus>* state, UnorderedMap<T, ConnStatus, E>* fetched_state, bool clear_inactive,
+                const ProcessFn& process_fn, const FilterFn& filter_fn, const EraseFn& erase_fn) {
   constexpr bool normalize = !std::is_same<ProcessFn, dont_normalize>::value;
   constexpr bool filter = !std::is_same<FilterFn, dont_filter>::value;
 
-  UnorderedMap<T, ConnStatus, E> fetched_state;
-
   for (auto it = state->begin(); it != state->end();) {
-    const auto& entry = *it;
+    auto& entry = *it;
+    ConnStatus status = entry.second.WithoutBookkeeping();
 
-    if (!filter || filter_fn(entry.first)) {
+    bool fetched = !filter || filter_fn(entry.first);
+    if (fetched) {
       if (normalize) {
-        auto emplace_res = fetched_state.emplace(process_fn(entry.first), entry.second);
+        auto emplace_res = fetched_state->emplace(process_fn(entry.first), status);
         if (!emplace_res.second) {
-          emplace_res.first->second.MergeFrom(entry.second);
+          emplace_res.first->second.MergeFrom(status);
         }
       } else {
-        fetched_state.insert(entry);
+        auto emplace_res = fetched_state->emplace(entry.first, status);
+        if (!emplace_res.second) {
+          emplace_res.first->second.MergeFrom(status);
+        }
       }
     }
 
     if (clear_inactive && !entry.second.IsActive()) {
+      erase_fn(entry.first, entry.second);
       it = state->erase(it);
     } else {
       ++it;
     }
   }
-
-  return fetched_state;
 }
 
 }  // namespace
 
+void ConnectionTracker::RegisterUpdateBuffer(ConnectionUpdateBuffer* buffer) {
+  WITH_LOCK(update_buffers_mutex_) {
+    update_buffers_.push_back(buffer);
+  }
+}
+
+void ConnectionTracker::UnregisterUpdateBuffer(ConnectionUpdateBuffer* buffer) {
+  WITH_LOCK(update_buffers_mutex_) {
+    update_buffers_.erase(std::remove(update_buffers_.begin(), update_buffers_.end(), buffer), update_buffers_.end());
+  }
+}
+
+void ConnectionTracker::FlushUpdateBuffers() {
+  WITH_LOCK(update_buffers_mutex_) {
+    for (auto* buffer : update_buffers_) {
+      buffer->Flush();
+    }
+  }
+}
+
 ConnMap ConnectionTracker::FetchConnState(bool normalize, bool clear_inactive) {
+  FlushUpdateBuffers();
   ConnMap cm;
-  size_t state_size;
-  WITH_LOCK(mutex_) {
-    state_size = conn_state_.size();
-    if (HasConnectionFilters()) {
+  if (clear_inactive) {
+    snapshot_epoch_++;
+  }
+  auto tables = GetNetworkTables();
+  FetchConnStateNoLock(*tables, &cm, normalize, clear_inactive);
+  return cm;
+}
+
+void ConnectionTracker::PrepareNormalizationNoLock(const NetworkTables& tables, Shard* shard) {
+  if (shard->normalization_generation != tables.normalization_generation) {
+    shard->normalized_addresses.Clear();
+    shard->normalization_generation = tables.normalization_generation;
+  }
+}
+
+void ConnectionTracker::FetchConnStateNoLock(const NetworkTables& tables, ConnMap* cm, bool normalize, bool clear_inactive) {
+  const bool has_filters = HasConnectionFilters(tables);
+  auto filter_fn = [&tables](const Connection& conn) { return ShouldFetchConnection(tables, conn); };
+  UnorderedMap<ContainerId, size_t> removed;
+
+  for (auto& shard : shards_) {
+    auto normalize_fn = [&tables, &shard](const Connection& conn) { return NormalizeConnectionCachedNoLock(tables, &shard, conn); };
+    auto erase_fn = [this, &shard, &removed](const Connection& conn, ConnStatus status) {
+      removed[conn.container_id()]++;
+      MarkRemovedNoLock(&shard, conn, status);
+    };
+
+    WITH_LOCK(shard.mutex) {
+      size_t state_size = shard.conn_state.size();
       if (normalize) {
-        cm = FetchState(
-            &conn_state_, clear_inactive,
-            [this](const Connection& conn) { return this->NormalizeConnectionNoLock(conn); },
-            [this](const Connection& conn) { return this->ShouldFetchConnection(conn); });
+        PrepareNormalizationNoLock(tables, &shard);
+      }
+      if (has_filters) {
+        if (normalize) {
+          FetchState(&shard.conn_state, cm, clear_inactive, normalize_fn, filter_fn, erase_fn);
+        } else {
+          FetchState(&shard.conn_state, cm, clear_inactive, dont_normalize(), filter_fn, erase_fn);
+        }
       } else {
-        cm = FetchState(&conn_state_, clear_inactive, dont_normalize(),
-                        [this](const Connection& conn) { return this->ShouldFetchConnection(conn); });
+        if (normalize) {
+          FetchState(&shard.conn_state, cm, clear_inactive, normalize_fn, dont_filter(), erase_fn);
+        } else {
+          FetchState(&shard.conn_state, cm, clear_inactive, dont_normalize(), dont_filter(), erase_fn);
+        }
       }
+      COUNTER_ADD(CollectorStats::net_conn_inactive, (state_size - shard.conn_state.size()));
+    }
+  }
+
+  if (!removed.empty()) {
+    RemoveContainerConnections(removed);
+    PruneContainerCounts();
+  }
+}
+
+bool ConnectionTracker::FetchConnStateWithChanges(ConnMap* state) {
+  FlushUpdateBuffers();
+  snapshot_epoch_++;
+  auto tables = GetNetworkTables();
+
+  bool changes_known = false;
+  WITH_LOCK(changes_mutex_) {
+    // The connections normalize or filter differently if the network tables changed since the previous fetch.
+    changes_known = !changes_unknown_.exchange(false);
+    changes_known = tracked_tables_generation_.exchange(tables->generation) == tables->generation && changes_known;
+    if (changes_known) {
+      FetchDirtyChangesNoLock(*tables, state);
     } else {
-      if (normalize) {
-        cm = FetchState(
-            &conn_state_, clear_inactive,
-            [this](const Connection& conn) { return this->NormalizeConnectionNoLock(conn); },
-            dont_filter());
-      } else {
-        cm = FetchState(&conn_state_, clear_inactive, dont_normalize(), dont_filter());
+      FetchAllChangesNoLock(*tables, state);
+    }
+    UpdateAggregatedExternalSubnetsNoLock(*tables, state);
+  }
+  return changes_known;
+}
+
+void ConnectionTracker::ResetChangeTracking() {
+  WITH_LOCK(changes_mutex_) {
+    changes_unknown_ = true;
+  }
+}
+
+void ConnectionTracker::FetchAllChangesNoLock(const NetworkTables& tables, ConnMap* cm) {
+  const bool has_filters = HasConnectionFilters(tables);
+  UnorderedMap<ContainerId, size_t> removed;
+  active_normalized_conns_.clear();
+  pinned_normalized_conns_.clear();
+  external_address_conns_.clear();
+  external_subnet_addresses_.clear();
+
+  for (auto& shard : shards_) {
+    WITH_LOCK(shard.mutex) {
+      size_t state_size = shard.conn_state.size();
+      PrepareNormalizationNoLock(tables, &shard);
+      shard.dirty_conns.clear();
+      shard.removed_conns.clear();
+
+      for (auto it = shard.conn_state.begin(); it != shard.conn_state.end();) {
+        ConnStatus& status = it->second;
+        status.SetDirty(false);
+        if (!has_filters || ShouldFetchConnection(tables, it->first)) {
+          Connection normalized = NormalizeConnectionCachedNoLock(tables, &shard, it->first);
+          CountExternalAddressNoLock(tables, it->first.remote().address(), normalized.remote().network(), status.IsActive() ? 1 : 0);
+          if (status.IsActive()) {
+            active_normalized_conns_[normalized]++;
+          }
+          auto emplace_res = cm->emplace(std::move(normalized), status.WithoutBookkeeping());
+          if (!emplace_res.second) {
+            emplace_res.first->second.MergeFrom(status.WithoutBookkeeping());
+          }
+        }
+
+        if (status.IsActive()) {
+          status.SetReportedActive(true);
+          ++it;
+        } else {
+          removed[it->first.container_id()]++;
+          it = shard.conn_state.erase(it);
+        }
       }
+      COUNTER_ADD(CollectorStats::net_conn_inactive, (state_size - shard.conn_state.size()));
     }
-    COUNTER_ADD(CollectorStats::net_conn_inactive, (state_size - conn_state_.size()));
   }
-  return cm;
+
+  if (!removed.empty()) {
+    RemoveContainerConnections(removed);
+    PruneContainerCounts();
+  }
 }
 
-AdvertisedEndpointMap ConnectionTracker::FetchEndpointState(bool normalize, bool clear_inactive) {
-  AdvertisedEndpointMap cem;
-  size_t state_size;
-  WITH_LOCK(mutex_) {
-    state_size = conn_state_.size();
-    if (HasConnectionFilters()) {
-      if (normalize) {
-        cem = FetchState<ContainerEndpoint, std::function<ContainerEndpoint(const ContainerEndpoint&)>, std::function<bool(const ContainerEndpoint&)>, AdvertisedEndpointEquality>(
-            &endpoint_state_, clear_inactive,
-            [this](const ContainerEndpoint& cep) { return this->NormalizeContainerEndpoint(cep); },
-            [this](const ContainerEndpoint& cep) { return this->ShouldFetchContainerEndpoint(cep); });
-      } else {
-        cem = FetchState<ContainerEndpoint, dont_normalize, std::function<bool(const ContainerEndpoint&)>, AdvertisedEndpointEquality>(
-            &endpoint_state_, clear_inactive,
-            dont_normalize(),
-            [this](const ContainerEndpoint& cep) { return this->ShouldFetchContainerEndpoint(cep); });
+void ConnectionTracker::FetchDirtyChangesNoLock(const NetworkTables& tables, ConnMap* cm) {
+  // What is known about a normalized connection the dirty connections contributed to.
+  struct NormalizedChange {
+    size_t active_before = 0;
+    int64_t active_time = 0;
+    bool inactive = false;
+    int64_t inactive_time = 0;
+  };
+  UnorderedMap<Connection, NormalizedChange> changes;
+
+  // A tracked connection contributes to its normalized connection if it is fetched, which it is as long as it is
+  // tracked, the last time as an inactive one. Connections reported as active are counted as such until then.
+  auto contribute = [this, &changes](const Connection& normalized, ConnStatus status, bool reported_active) {
+    auto emplace_res = changes.emplace(normalized, NormalizedChange());
+    NormalizedChange& change = emplace_res.first->second;
+    auto active_it = active_normalized_conns_.find(normalized);
+    if (emplace_res.second && active_it != active_normalized_conns_.end()) {
+      change.active_before = active_it->second;
+    }
+
+    if (status.IsActive()) {
+      change.active_time = std::max(change.active_time, status.LastActiveTime());
+      if (!reported_active) {
+        // A connection tracked again after having been evicted takes over the count it left behind.
+        auto pinned_it = pinned_normalized_conns_.find(normalized);
+        if (pinned_it == pinned_normalized_conns_.end()) {
+          active_normalized_conns_[normalized]++;
+        } else if (--pinned_it->second.count == 0) {
+          pinned_normalized_conns_.erase(pinned_it);
+        }
       }
     } else {
-      if (normalize) {
-        cem = FetchState<ContainerEndpoint, std::function<ContainerEndpoint(const ContainerEndpoint&)>, dont_filter, AdvertisedEndpointEquality>(
-            &endpoint_state_, clear_inactive,
-            [this](const ContainerEndpoint& cep) { return this->NormalizeContainerEndpoint(cep); },
-            dont_filter());
+      change.inactive = true;
+      change.inactive_time = std::max(change.inactive_time, status.LastActiveTime());
+      if (reported_active && active_it != active_normalized_conns_.end() && --active_it->second == 0) {
+        active_normalized_conns_.erase(active_it);
+      }
+    }
+  };
+
+  const bool has_filters = HasConnectionFilters(tables);
+  UnorderedMap<ContainerId, size_t> removed;
+
+  // Scrapes completed by now are done updating the shards drained below, and those started by now were not when the
+  // connections evicted so far were.
+  const uint64_t scrapes_started = scrapes_started_;
+  const uint64_t scrapes_completed = scrapes_completed_;
+
+  for (auto& shard : shards_) {
+    WITH_LOCK(shard.mutex) {
+      if (shard.dirty_conns.empty() && shard.removed_conns.empty()) {
+        continue;
+      }
+      size_t state_size = shard.conn_state.size();
+      PrepareNormalizationNoLock(tables, &shard);
+
+      for (const auto& removed_conn : shard.removed_conns) {
+        if (has_filters && !ShouldFetchConnection(tables, removed_conn.first)) {
+          continue;
+        }
+        Connection normalized = NormalizeConnectionCachedNoLock(tables, &shard, removed_conn.first);
+        CountExternalAddressNoLock(tables, removed_conn.first.remote().address(), normalized.remote().network(), -1);
+        if (removed_conn.second.IsActive()) {
+          // Evicted while active: whether it is still open is only known after the next scrape.
+          auto& pinned = pinned_normalized_conns_[normalized];
+          pinned.count++;
+          pinned.last_active_time = std::max(pinned.last_active_time, removed_conn.second.LastActiveTime());
+          pinned.scrape = scrapes_started;
+        } else {
+          contribute(normalized, removed_conn.second, true);
+        }
+      }
+      shard.removed_conns.clear();
+
+      for (const auto& conn : shard.dirty_conns) {
+        auto it = shard.conn_state.find(conn);
+        if (it == shard.conn_state.end() || !it->second.IsDirty()) {
+          continue;
+        }
+        ConnStatus& status = it->second;
+        status.SetDirty(false);
+
+        // Connections which went inactive and active again in between fetches contribute the same as before.
+        bool fetched = !has_filters || ShouldFetchConnection(tables, conn);
+        if (fetched && !(status.IsActive() && status.WasReportedActive())) {
+          Connection normalized = NormalizeConnectionCachedNoLock(tables, &shard, conn);
+          CountExternalAddressNoLock(tables, conn.remote().address(), normalized.remote().network(), status.IsActive() ? 1 : (status.WasReportedActive() ? -1 : 0));
+          contribute(normalized, status, status.WasReportedActive());
+        }
+
+        if (status.IsActive()) {
+          status.SetReportedActive(true);
+        } else {
+          removed[conn.container_id()]++;
+          shard.conn_state.erase(it);
+        }
+      }
+      shard.dirty_conns.clear();
+      COUNTER_ADD(CollectorStats::net_conn_inactive, (state_size - shard.conn_state.size()));
+    }
+  }
+
+  if (!removed.empty()) {
+    RemoveContainerConnections(removed);
+    PruneContainerCounts();
+  }
+
+  // Evicted connections not tracked again by a scrape started after their eviction are closed. Without scrapes, there
+  // is no telling, and they are closed right away.
+  for (auto it = pinned_normalized_conns_.begin(); it != pinned_normalized_conns_.end();) {
+    if (scrapes_started != 0 && scrapes_completed <= it->second.scrape) {
+      ++it;
+      continue;
+    }
+    for (size_t i = 0; i < it->second.count; i++) {
+      contribute(it->first, ConnStatus(it->second.last_active_time, false), true);
+    }
+    it = pinned_normalized_conns_.erase(it);
+  }
+
+  // Normalized connections which stay active do not change in a way that matters for delta computation, whatever
+  // their timestamps. Others are part of the fetched state if still active, or if seen inactive.
+  for (const auto& entry : changes) {
+    const NormalizedChange& change = entry.second;
+    bool active = Contains(active_normalized_conns_, entry.first);
+    if (active && change.active_before == 0) {
+      cm->emplace(entry.first, ConnStatus(change.active_time, true));
+    } else if (!active && (change.active_before != 0 || change.inactive)) {
+      cm->emplace(entry.first, ConnStatus(change.inactive_time, false));
+    }
+  }
+}
+
+void ConnectionTracker::CountExternalAddressNoLock(const NetworkTables& tables, const Address& address, const IPNet& remote, int delta) {
+  // External addresses are those normalized to a network which is not a known one, i.e. to themselves or to their
+  // aggregated subnet.
+  if (!tables.enable_external_ips || tables.external_ips_aggregation_threshold == 0 || remote.IsAddress() || remote.IsNull()) {
+    return;
+  }
+  size_t bits = address.family() == Address::Family::IPV4 ? tables.external_ipv4_aggregation_bits : tables.external_ipv6_aggregation_bits;
+  if (bits == 0 || !tables.known_ip_networks.Find(address).IsNull()) {
+    return;
+  }
+
+  if (delta <= 0) {
+    fetched_external_addresses_.insert(address);
+  }
+  if (delta > 0) {
+    if (external_address_conns_[address]++ == 0) {
+      external_subnet_addresses_[SubnetOf(address, bits)]++;
+    }
+  } else if (delta < 0) {
+    auto it = external_address_conns_.find(address);
+    if (it == external_address_conns_.end() || --it->second != 0) {
+      return;
+    }
+    external_address_conns_.erase(it);
+    auto subnet_it = external_subnet_addresses_.find(SubnetOf(address, bits));
+    if (subnet_it != external_subnet_addresses_.end() && --subnet_it->second == 0) {
+      external_subnet_addresses_.erase(subnet_it);
+    }
+  }
+}
+
+void ConnectionTracker::UpdateAggregatedExternalSubnetsNoLock(const NetworkTables& tables, ConnMap* cm) {
+  if (!tables.enable_external_ips || tables.external_ips_aggregation_threshold == 0) {
+    fetched_external_addresses_.clear();
+    idle_aggregated_subnets_.clear();
+    return;
+  }
+
+  // Addresses of the connections which were only fetched as inactive count as well, once.
+  UnorderedMap<IPNet, size_t> subnet_addresses = external_subnet_addresses_;
+  for (const auto& address : fetched_external_addresses_) {
+    if (!Contains(external_address_conns_, address)) {
+      size_t bits = address.family() == Address::Family::IPV4 ? tables.external_ipv4_aggregation_bits : tables.external_ipv6_aggregation_bits;
+      subnet_addresses[SubnetOf(address, bits)]++;
+    }
+  }
+  fetched_external_addresses_.clear();
+
+  std::vector<IPNet> added, removed;
+  for (const auto& [subnet, count] : subnet_addresses) {
+    // Aggregated subnets of a family all have the same length, so they never contain one another.
+    if (count > tables.external_ips_aggregation_threshold && tables.aggregated_external_subnets.Find(subnet).IsNull()) {
+      added.push_back(subnet);
+    }
+  }
+  for (const auto& subnet : tables.aggregated_external_subnets.GetAll()) {
+    if (Contains(subnet_addresses, subnet)) {
+      idle_aggregated_subnets_.erase(subnet);
+    } else if (++idle_aggregated_subnets_[subnet] >= kAggregatedSubnetMaxIdleFetches) {
+      idle_aggregated_subnets_.erase(subnet);
+      removed.push_back(subnet);
+    }
+  }
+  if (added.empty() && removed.empty()) {
+    return;
+  }
+
+  NRadixTree removed_subnets(removed);
+  uint64_t generation = UpdateNetworkTables(false, [&tables, &added, &removed_subnets](NetworkTables* new_tables) {
+    // The settings may have changed since the state was fetched.
+    if (new_tables->external_ips_aggregation_threshold != tables.external_ips_aggregation_threshold ||
+        new_tables->external_ipv4_aggregation_bits != tables.external_ipv4_aggregation_bits ||
+        new_tables->external_ipv6_aggregation_bits != tables.external_ipv6_aggregation_bits) {
+      return false;
+    }
+    std::vector<IPNet> subnets = added;
+    for (const auto& subnet : new_tables->aggregated_external_subnets.GetAll()) {
+      if (removed_subnets.Find(subnet).IsNull()) {
+        subnets.push_back(subnet);
+      }
+    }
+    new_tables->aggregated_external_subnets = NRadixTree(subnets);
+    COUNTER_SET(CollectorStats::net_aggregated_external_subnets, new_tables->aggregated_external_subnets.size());
+    return true;
+  });
+  if (generation == 0) {
+    return;
+  }
+  // The next change-tracking fetch remains incremental, unless the tables were also changed otherwise in between.
+  if (generation == tables.generation + 1) {
+    tracked_tables_generation_ = generation;
+  }
+
+  // Only the cached addresses of the subnets which changed normalize differently.
+  NRadixTree changed_subnets(added);
+  for (const auto& subnet : removed) {
+    changed_subnets.Insert(subnet);
+  }
+  for (auto& shard : shards_) {
+    WITH_LOCK(shard.mutex) {
+      shard.normalized_addresses.EraseIf([&changed_subnets](const Address& address) { return !changed_subnets.Find(address).IsNull(); });
+      shard.cache_tables_generation = generation;
+    }
+  }
+
+  // Active normalized connections to newly aggregated addresses are closed, and replaced by their subnet. Connections
+  // to subnets no longer aggregated are not renamed: none of them is tracked anymore, only pinned ones may remain.
+  NRadixTree added_subnets(added);
+  auto aggregated = [&tables, &added_subnets](const Connection& normalized) -> std::optional<Connection> {
+    IPNet remote = normalized.remote().network();
+    if (remote.IsAddress() || remote.bits() != 8 * remote.address().length() || !tables.known_ip_networks.Find(remote.address()).IsNull()) {
+      return std::nullopt;
+    }
+    IPNet subnet = added_subnets.Find(remote.address());
+    if (subnet.IsNull()) {
+      return std::nullopt;
+    }
+    return Connection(normalized.container_id(), normalized.local(), Endpoint(subnet, normalized.remote().port()), normalized.l4proto(), normalized.is_server());
+  };
+
+  std::vector<std::pair<Connection, Connection>> renamed;
+  for (const auto& entry : active_normalized_conns_) {
+    if (auto subnet_conn = aggregated(entry.first)) {
+      renamed.emplace_back(entry.first, std::move(*subnet_conn));
+    }
+  }
+  int64_t now = NowMicros();
+  for (const auto& [conn, subnet_conn] : renamed) {
+    // A connection which was not reported yet is never reported.
+    ConnStatus status(now, true);
+    auto it = cm->find(conn);
+    if (it != cm->end() && it->second.IsActive()) {
+      status = it->second;
+      cm->erase(it);
+    } else {
+      (*cm)[conn] = ConnStatus(now, false);
+    }
+
+    // Entries are moved by key, as inserting into the maps may invalidate their iterators.
+    auto count_it = active_normalized_conns_.find(conn);
+    size_t count = count_it->second;
+    active_normalized_conns_.erase(count_it);
+    auto emplace_res = active_normalized_conns_.emplace(subnet_conn, 0);
+    emplace_res.first->second += count;
+
+    auto subnet_it = cm->find(subnet_conn);
+    if (subnet_it != cm->end() && subnet_it->second.IsActive()) {
+      subnet_it->second.MergeFrom(status);
+    } else if (emplace_res.second) {
+      (*cm)[subnet_conn] = status;
+    }
+
+    auto pinned_it = pinned_normalized_conns_.find(conn);
+    if (pinned_it != pinned_normalized_conns_.end()) {
+      PinnedConnections renamed_pinned = pinned_it->second;
+      pinned_normalized_conns_.erase(pinned_it);
+      auto& pinned = pinned_normalized_conns_[subnet_conn];
+      pinned.count += renamed_pinned.count;
+      pinned.last_active_time = std::max(pinned.last_active_time, renamed_pinned.last_active_time);
+      pinned.scrape = std::max(pinned.scrape, renamed_pinned.scrape);
+    }
+  }
+}
+
+AdvertisedEndpointMap ConnectionTracker::FetchEndpointState(bool normalize, bool clear_inactive) {
+  AdvertisedEndpointMap cem;
+  if (clear_inactive) {
+    snapshot_epoch_++;
+  }
+  auto tables = GetNetworkTables();
+  const bool has_filters = HasConnectionFilters(*tables);
+  auto normalize_fn = [this](const ContainerEndpoint& cep) { return this->NormalizeContainerEndpoint(cep); };
+  auto filter_fn = [&tables](const ContainerEndpoint& cep) { return ShouldFetchContainerEndpoint(*tables, cep); };
+
+  for (auto& shard : shards_) {
+    WITH_LOCK(shard.mutex) {
+      size_t state_size = shard.endpoint_state.size();
+      if (has_filters) {
+        if (normalize) {
+          FetchState(&shard.endpoint_state, &cem, clear_inactive, normalize_fn, filter_fn, dont_count());
+        } else {
+          FetchState(&shard.endpoint_state, &cem, clear_inactive, dont_normalize(), filter_fn, dont_count());
+        }
       } else {
-        cem = FetchState<ContainerEndpoint, dont_normalize, dont_filter, AdvertisedEndpointEquality>(
-            &endpoint_state_, clear_inactive,
-            dont_normalize(),
-            dont_filter());
+        if (normalize) {
+          FetchState(&shard.endpoint_state, &cem, clear_inactive, normalize_fn, dont_filter(), dont_count());
+        } else {
+          FetchState(&shard.endpoint_state, &cem, clear_inactive, dont_normalize(), dont_filter(), dont_count());
+        }
       }
+      COUNTER_ADD(CollectorStats::net_cep_inactive, (state_size - shard.endpoint_state.size()));
     }
-    COUNTER_ADD(CollectorStats::net_cep_inactive, (state_size - endpoint_state_.size()));
   }
   return cem;
 }
 
+template <typename Map, typename FetchFn>
+std::shared_ptr<const Map> ConnectionTracker::GetSnapshot(std::shared_ptr<const Snapshot<Map>>* snapshot, const FetchFn& fetch_fn) {
+  auto is_valid = [this](const std::shared_ptr<const Snapshot<Map>>& snap) {
+    return snap && snap->epoch == snapshot_epoch_ && NowMicros() - snap->time_micros < snapshot_max_age_micros_;
+  };
+  // The returned pointer shares ownership of the whole snapshot, so it stays valid after the snapshot is replaced.
+  auto to_state = [](std::shared_ptr<const Snapshot<Map>> snap) {
+    const Map* state = &snap->state;
+    return std::shared_ptr<const Map>(std::move(snap), state);
+  };
+
+  auto snap = std::atomic_load(snapshot);
+  if (is_valid(snap)) {
+    return to_state(std::move(snap));
+  }
+
+  WITH_LOCK(snapshot_mutex_) {
+    // Another caller may have rebuilt the snapshot in the meantime.
+    snap = std::atomic_load(snapshot);
+    if (is_valid(snap)) {
+      return to_state(std::move(snap));
+    }
+
+    // The epoch is read first, such that a concurrent invalidation is never missed.
+    uint64_t epoch = snapshot_epoch_;
+    int64_t time_micros = NowMicros();
+    snap = std::make_shared<const Snapshot<Map>>(Snapshot<Map>{fetch_fn(), time_micros, epoch});
+    std::atomic_store(snapshot, snap);
+  }
+  return to_state(std::move(snap));
+}
+
+std::shared_ptr<const ConnMap> ConnectionTracker::GetConnStateSnapshot(bool normalize) {
+  return GetSnapshot(&conn_snapshots_[normalize], [this, normalize]() { return FetchConnState(normalize, false); });
+}
+
+std::shared_ptr<const AdvertisedEndpointMap> ConnectionTracker::GetEndpointStateSnapshot(bool normalize) {
+  return GetSnapshot(&endpoint_snapshots_[normalize], [this, normalize]() { return FetchEndpointState(normalize, false); });
+}
+
+template <typename UpdateFn>
+uint64_t ConnectionTracker::UpdateNetworkTables(bool affects_normalization, const UpdateFn& update_fn) {
+  WITH_LOCK(network_tables_mutex_) {
+    auto tables = std::make_shared<NetworkTables>(*GetNetworkTables());
+    if (!update_fn(tables.get())) {
+      return 0;
+    }
+    uint64_t generation = ++tables->generation;
+    if (affects_normalization) {
+      tables->normalization_generation++;
+    }
+    std::atomic_store(&network_tables_, std::shared_ptr<const NetworkTables>(std::move(tables)));
+    snapshot_epoch_++;
+    return generation;
+  }
+  return 0;
+}
+
 void ConnectionTracker::UpdateKnownPublicIPs(collector::UnorderedSet<collector::Address>&& known_public_ips) {
   COUNTER_SET(CollectorStats::net_known_public_ips, known_public_ips.size());
-  WITH_LOCK(mutex_) {
-    known_public_ips_ = std::move(known_public_ips);
-    if (CLOG_ENABLED(DEBUG)) {
-      CLOG(DEBUG) << "known public ips:";
-      for (const auto& public_ip : known_public_ips_) {
-        CLOG(DEBUG) << " - " << public_ip;
-      }
+  if (CLOG_ENABLED(DEBUG)) {
+    CLOG(DEBUG) << "known public ips:";
+    for (const auto& public_ip : known_public_ips) {
+      CLOG(DEBUG) << " - " << public_ip;
     }
   }
+  UpdateNetworkTables(true, [&known_public_ips](NetworkTables* tables) {
+    tables->known_public_ips = std::move(known_public_ips);
+    return true;
+  });
 }
 
 void ConnectionTracker::UpdateKnownIPNetworks(UnorderedMap<Address::Family, std::vector<IPNet>>&& known_ip_networks) {
   NRadixTree tree;
+  std::vector<Address::Family> families;
   for (const auto& network_pair : known_ip_networks) {
+    families.push_back(network_pair.first);
     for (const auto& network : network_pair.second) {
       if (!tree.Insert(network)) {
         // Log error and continue inserting rest of networks.
@@ -349,55 +1215,90 @@ void ConnectionTracker::UpdateKnownIPNetworks(UnorderedMap<Address::Family, std:
       }
     }
   }
+  UpdateKnownIPNetworks(std::move(tree), families);
+}
 
+void ConnectionTracker::UpdateKnownIPNetworks(NRadixTree&& tree, const std::vector<Address::Family>& families) {
   UnorderedMap<Address::Family, bool> known_private_networks_exists;
-  COUNTER_ZERO(CollectorStats::net_known_ip_networks);
-  for (const auto& network_pair : known_ip_networks) {
-    COUNTER_ADD(CollectorStats::net_known_ip_networks, network_pair.second.size());
-    known_private_networks_exists[network_pair.first] = ContainsPrivateNetwork(network_pair.first, tree);
+  for (Address::Family family : families) {
+    known_private_networks_exists[family] = ContainsPrivateNetwork(family, tree);
   }
+  COUNTER_SET(CollectorStats::net_known_ip_networks, tree.size());
 
-  WITH_LOCK(mutex_) {
-    known_ip_networks_ = tree;
-    known_private_networks_exists_ = std::move(known_private_networks_exists);
-    if (CLOG_ENABLED(DEBUG)) {
-      CLOG(DEBUG) << "known ip networks:";
-      for (auto network : known_ip_networks_.GetAll()) {
-        CLOG(DEBUG) << " - " << network;
-      }
+  if (CLOG_ENABLED(DEBUG)) {
+    CLOG(DEBUG) << "known ip networks:";
+    for (auto network : tree.GetAll()) {
+      CLOG(DEBUG) << " - " << network;
     }
   }
+  UpdateNetworkTables(true, [&tree, &known_private_networks_exists](NetworkTables* tables) {
+    tables->known_ip_networks = std::move(tree);
+    tables->known_private_networks_exists = std::move(known_private_networks_exists);
+    return true;
+  });
+}
+
+void ConnectionTracker::EnableExternalIPs(bool enable) {
+  UpdateNetworkTables(true, [enable](NetworkTables* tables) {
+    if (tables->enable_external_ips == enable) {
+      return false;
+    }
+    tables->enable_external_ips = enable;
+    return true;
+  });
+}
+
+void ConnectionTracker::SetExternalIPsAggregation(size_t threshold, size_t ipv4_bits, size_t ipv6_bits) {
+  ipv4_bits = std::min<size_t>(ipv4_bits, 32);
+  ipv6_bits = std::min<size_t>(ipv6_bits, 128);
+  UpdateNetworkTables(true, [threshold, ipv4_bits, ipv6_bits](NetworkTables* tables) {
+    if (tables->external_ips_aggregation_threshold == threshold && tables->external_ipv4_aggregation_bits == ipv4_bits &&
+        tables->external_ipv6_aggregation_bits == ipv6_bits) {
+      return false;
+    }
+    tables->external_ips_aggregation_threshold = threshold;
+    tables->external_ipv4_aggregation_bits = ipv4_bits;
+    tables->external_ipv6_aggregation_bits = ipv6_bits;
+    tables->aggregated_external_subnets = NRadixTree();
+    COUNTER_ZERO(CollectorStats::net_aggregated_external_subnets);
+    return true;
+  });
 }
 
 void ConnectionTracker::UpdateIgnoredL4ProtoPortPairs(UnorderedSet<L4ProtoPortPair>&& ignored_l4proto_port_pairs) {
-  WITH_LOCK(mutex_) {
-    ignored_l4proto_port_pairs_ = std::move(ignored_l4proto_port_pairs);
-    if (CLOG_ENABLED(DEBUG)) {
-      CLOG(DEBUG) << "ignored l4 protocol and port pairs";
-      for (const auto& proto_port_pair : ignored_l4proto_port_pairs_) {
-        CLOG(DEBUG) << proto_port_pair.first << "/" << proto_port_pair.second;
-      }
+  if (CLOG_ENABLED(DEBUG)) {
+    CLOG(DEBUG) << "ignored l4 protocol and port pairs";
+    for (const auto& proto_port_pair : ignored_l4proto_port_pairs) {
+      CLOG(DEBUG) << proto_port_pair.first << "/" << proto_port_pair.second;
     }
   }
+  UpdateNetworkTables(false, [&ignored_l4proto_port_pairs](NetworkTables* tables) {
+    tables->ignored_l4proto_port_pairs = std::move(ignored_l4proto_port_pairs);
+    return true;
+  });
 }
 
 void ConnectionTracker::UpdateIgnoredNetworks(const std::vector<IPNet>& network_list) {
-  WITH_LOCK(mutex_) {
-    ignored_networks_ = NRadixTree(network_list);
-  }
+  NRadixTree tree(network_list);
+  UpdateNetworkTables(false, [&tree](NetworkTables* tables) {
+    tables->ignored_networks = std::move(tree);
+    return true;
+  });
 }
 
 void ConnectionTracker::UpdateNonAggregatedNetworks(const std::vector<IPNet>& network_list) {
-  WITH_LOCK(mutex_) {
-    non_aggregated_networks_ = NRadixTree(network_list);
-  }
+  NRadixTree tree(network_list);
+  UpdateNetworkTables(true, [&tree](NetworkTables* tables) {
+    tables->non_aggregated_networks = std::move(tree);
+    return true;
+  });
 }
 
 // Increment the stat counter matching the connection's characteristics
-inline void ConnectionTracker::IncrementConnectionStats(Connection conn, ConnectionTracker::Stats& stats) const {
+inline void ConnectionTracker::IncrementConnectionStats(const NetworkTables& tables, Connection conn, ConnectionTracker::Stats& stats) {
   auto& direction = conn.is_server() ? stats.inbound : stats.outbound;
 
-  if (!ShouldFetchConnection(conn)) {
+  if (!ShouldFetchConnection(tables, conn)) {
     // This connection will not be sent, so don't count it.
     return;
   }
@@ -413,9 +1314,12 @@ inline void ConnectionTracker::IncrementConnectionStats(Connection conn, Connect
 ConnectionTracker::Stats ConnectionTracker::GetConnectionStats_StoredConnections() {
   ConnectionTracker::Stats stats = {};
 
-  WITH_LOCK(mutex_) {
-    for (auto& conn : conn_state_) {
-      IncrementConnectionStats(conn.first, stats);
+  auto tables = GetNetworkTables();
+  for (auto& shard : shards_) {
+    WITH_LOCK(shard.mutex) {
+      for (auto& conn : shard.conn_state) {
+        IncrementConnectionStats(*tables, conn.first, stats);
+      }
     }
   }
 
@@ -424,11 +1328,148 @@ ConnectionTracker::Stats ConnectionTracker::GetConnectionStats_StoredConnections
 
 // Retrieve the value of the ever-increasing counters of new connection insertion, indexed by in/out and public/private nature.
 ConnectionTracker::Stats ConnectionTracker::GetConnectionStats_NewConnectionCounters() {
-  ConnectionTracker::Stats stats;
+  ConnectionTracker::Stats stats = {};
 
-  WITH_LOCK(mutex_) {
-    stats = inserted_connections_counters_;
+  for (auto& shard : shards_) {
+    WITH_LOCK(shard.mutex) {
+      const auto& counters = shard.inserted_connections_counters;
+      stats.inbound.public_ += counters.inbound.public_;
+      stats.inbound.private_ += counters.inbound.private_;
+      stats.outbound.public_ += counters.outbound.public_;
+      stats.outbound.private_ += counters.outbound.private_;
+    }
   }
   return stats;
 }
+
+ConnectionUpdateBuffer::ConnectionUpdateBuffer(std::shared_ptr<ConnectionTracker> tracker, size_t max_size, int64_t max_delay_micros)
+    : tracker_(std::move(tracker)), max_size_(max_size), max_delay_micros_(max_delay_micros) {
+  updates_.reserve(max_size_);
+  tracker_->RegisterUpdateBuffer(this);
+}
+
+ConnectionUpdateBuffer::~ConnectionUpdateBuffer() {
+  tracker_->UnregisterUpdateBuffer(this);
+  Flush();
+}
+
+void ConnectionUpdateBuffer::UpdateConnection(const Connection& conn, int64_t timestamp, bool added) {
+  WITH_LOCK(mutex_) {
+    if (updates_.empty()) {
+      oldest_timestamp_ = timestamp;
+    }
+    updates_.push_back({conn, timestamp, added});
+    if (updates_.size() >= max_size_ || timestamp - oldest_timestamp_ >= max_delay_micros_) {
+      FlushNoLock();
+    }
+  }
+}
+
+void ConnectionUpdateBuffer::Flush() {
+  WITH_LOCK(mutex_) {
+    FlushNoLock();
+  }
+}
+
+void ConnectionUpdateBuffer::FlushNoLock() {
+  if (updates_.empty()) {
+    return;
+  }
+  tracker_->UpdateConnections(updates_);
+  updates_.clear();
+}
+
+size_t ConnectionUpdateBuffer::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return updates_.size();
+}
+
+const ConnStatus* ReportedConnState::Lookup(const Connection& conn) const {
+  auto it = state_.find(conn);
+  if (it != state_.end()) {
+    return &it->second;
+  }
+  it = afterglow_state_.find(conn);
+  if (it != afterglow_state_.end()) {
+    return &it->second;
+  }
+  return nullptr;
+}
+
+void ReportedConnState::ComputeDeltaAfterglow(const ConnMap& changes, ConnMap* delta, int64_t time_micros,
+                                              int64_t time_at_last_scrape, int64_t afterglow_period_micros) {
+  using CT = ConnectionTracker;
+
+  // The connections of the new state that were not active in the old state, or are not active anymore.
+  for (const auto& change : changes) {
+    if (const ConnStatus* old_status = Lookup(change.first)) {
+      CT::ComputeDeltaForAConnectionInOldAndNewStates(change, *old_status, *delta, time_micros, time_at_last_scrape, afterglow_period_micros);
+    } else {
+      CT::ComputeDeltaForAConnectionInNewState(change, *delta, time_micros, afterglow_period_micros);
+    }
+  }
+
+  // Connections of the old state that are missing from the new state can only be inactive ones, unless they came
+  // back, or ones that were already retained for afterglow only.
+  ConnMap afterglow_state;
+  auto handle_missing = [&](const Connection& conn, const ConnStatus& status) {
+    if (changes.find(conn) != changes.end()) {
+      return;
+    }
+    if (CT::CheckIfOldConnShouldBeInactiveInDelta(conn, status, changes, time_micros, time_at_last_scrape, afterglow_period_micros)) {
+      delta->insert(std::make_pair(conn, ConnStatus(status.LastActiveTime(), false)));
+    }
+    if (status.IsInAfterglowPeriod(time_micros, afterglow_period_micros)) {
+      afterglow_state.emplace(conn, status);
+    }
+  };
+
+  for (const auto& conn : inactive_) {
+    auto it = state_.find(conn);
+    if (it != state_.end()) {
+      handle_missing(it->first, it->second);
+      state_.erase(it);
+    }
+  }
+  for (const auto& entry : afterglow_state_) {
+    handle_missing(entry.first, entry.second);
+  }
+
+  inactive_.clear();
+  for (const auto& change : changes) {
+    state_[change.first] = change.second;
+    if (!change.second.IsActive()) {
+      inactive_.push_back(change.first);
+    }
+  }
+  afterglow_state_ = std::move(afterglow_state);
+}
+
+ConnMap ReportedConnState::Release() {
+  ConnMap old_state = std::move(state_);
+  for (const auto& entry : afterglow_state_) {
+    old_state.insert(entry);
+  }
+  state_.clear();
+  afterglow_state_.clear();
+  inactive_.clear();
+  return old_state;
+}
+
+void ReportedConnState::Reset(ConnMap&& old_state, ConnMap&& new_state) {
+  afterglow_state_.clear();
+  for (const auto& entry : old_state) {
+    if (new_state.find(entry.first) == new_state.end()) {
+      afterglow_state_.insert(entry);
+    }
+  }
+  inactive_.clear();
+  for (const auto& entry : new_state) {
+    if (!entry.second.IsActive()) {
+      inactive_.push_back(entry.first);
+    }
+  }
+  state_ = std::move(new_state);
+}
+
 }  // namespace collector
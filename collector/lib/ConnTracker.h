@@ -1,8 +1,13 @@
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <memory>
 #include <mutex>
+#include <shared_mutex>
 #include <vector>
 
+#include "ClockCache.h"
 #include "Containers.h"
 #include "Hash.h"
 #include "NRadix.h"
@@ -15,6 +20,10 @@ namespace collector {
 class ConnStatus {
  private:
   static constexpr uint64_t kActiveFlag = 1UL << 63;
+  // Bookkeeping of the ConnectionTracker for incremental delta computation, see WasReportedActive() and IsDirty().
+  static constexpr uint64_t kReportedActiveFlag = 1UL << 62;
+  static constexpr uint64_t kDirtyFlag = 1UL << 61;
+  static constexpr uint64_t kBookkeepingFlags = kReportedActiveFlag | kDirtyFlag;
 
   static inline uint64_t MakeActive(uint64_t data, bool active) {
     return active ? (data | kActiveFlag) : (data & ~kActiveFlag);
@@ -24,15 +33,36 @@ class ConnStatus {
   ConnStatus() : data_(0UL) {}
   ConnStatus(int64_t microtimestamp, bool active) : data_(MakeActive(static_cast<uint64_t>(microtimestamp), active)) {}
 
-  int64_t LastActiveTime() const { return static_cast<int64_t>(data_ & ~kActiveFlag); }
+  int64_t LastActiveTime() const { return static_cast<int64_t>(data_ & ~(kActiveFlag | kBookkeepingFlags)); }
   bool IsActive() const { return (data_ & kActiveFlag) != 0; }
 
   void SetActive(bool active) {
     data_ = MakeActive(data_, active);
   }
 
+  // Tells whether the connection was active as of the previous change-tracking fetch of the ConnectionTracker.
+  bool WasReportedActive() const { return (data_ & kReportedActiveFlag) != 0; }
+
+  void SetReportedActive(bool reported_active) {
+    data_ = reported_active ? (data_ | kReportedActiveFlag) : (data_ & ~kReportedActiveFlag);
+  }
+
+  // Tells whether the connection is listed for the next change-tracking fetch of the ConnectionTracker to look at.
+  bool IsDirty() const { return (data_ & kDirtyFlag) != 0; }
+
+  void SetDirty(bool dirty) {
+    data_ = dirty ? (data_ | kDirtyFlag) : (data_ & ~kDirtyFlag);
+  }
+
+  // Returns the status without the bookkeeping flags of the tracker. These flags are never set on fetched states,
+  // and are ignored when comparing statuses.
+  ConnStatus WithoutBookkeeping() const {
+    return ConnStatus(data_ & ~kBookkeepingFlags);
+  }
+
+  // Merges the other status into this one, keeping the most recent activity. The bookkeeping flags are or'ed.
   void MergeFrom(const ConnStatus& other) {
-    data_ = std::max(data_, other.data_);
+    data_ = std::max(data_ & ~kBookkeepingFlags, other.data_ & ~kBookkeepingFlags) | ((data_ | other.data_) & kBookkeepingFlags);
   }
 
   ConnStatus WithStatus(bool active) const {
@@ -40,7 +70,7 @@ class ConnStatus {
   }
 
   bool operator==(const ConnStatus& other) const {
-    return data_ == other.data_;
+    return ((data_ ^ other.data_) & ~kBookkeepingFlags) == 0;
   }
 
   bool operator!=(const ConnStatus& other) const {
@@ -80,10 +110,22 @@ using ContainerEndpointMap = UnorderedMap<ContainerEndpoint, ConnStatus>;
 using AdvertisedEndpointMap = UnorderedMap<ContainerEndpoint, ConnStatus, AdvertisedEndpointEquality>;
 
 class CollectorStats;
+class ConnectionUpdateBuffer;
 
 class ConnectionTracker {
  public:
+  struct ConnectionUpdate {
+    Connection conn;
+    int64_t timestamp;
+    bool added;
+  };
+
+  // Applies a single connection update. Frequent updates, e.g. from events, should rather be batched through a
+  // ConnectionUpdateBuffer.
   void UpdateConnection(const Connection& conn, int64_t timestamp, bool added);
+  // Applies a batch of connection updates, with the same result as calling UpdateConnection for each of them in
+  // order, but locking each shard at most once, and looking up the network tables at most once for the whole batch.
+  void UpdateConnections(const std::vector<ConnectionUpdate>& updates);
   void AddConnection(const Connection& conn, int64_t timestamp) {
     UpdateConnection(conn, timestamp, true);
   }
@@ -95,8 +137,37 @@ class ConnectionTracker {
 
   // Atomically fetch a snapshot of the current state, removing all inactive connections if requested.
   ConnMap FetchConnState(bool normalize = false, bool clear_inactive = true);
+  // Fetches the normalized state, removing all inactive connections, like FetchConnState(true, true), but only as far
+  // as it changed since the previous call. When true is returned, `state` only holds the normalized connections which
+  // became active, became inactive, or were seen inactive again since then, leaving out the ones which stayed active
+  // whatever their timestamps. Only the connections updated since the previous call are looked at and normalized.
+  // When false is returned, on the first call or after a change of the network configuration, `state` holds the full
+  // state.
+  bool FetchConnStateWithChanges(ConnMap* state);
+  // Makes the next call to FetchConnStateWithChanges fetch the full state, for a receiver which knows none of the
+  // connections fetched before, like a new stream to Sensor.
+  void ResetChangeTracking();
   AdvertisedEndpointMap FetchEndpointState(bool normalize = false, bool clear_inactive = true);
 
+  // Return the state as FetchConnState(normalize, false) and FetchEndpointState(normalize, false) would. Snapshots are
+  // shared between callers and reused until they are older than the snapshot max age, or until the configuration
+  // changes or inactive entries are removed, so that frequent readers do not rebuild the state every time.
+  std::shared_ptr<const ConnMap> GetConnStateSnapshot(bool normalize);
+  std::shared_ptr<const AdvertisedEndpointMap> GetEndpointStateSnapshot(bool normalize);
+  void SetSnapshotMaxAge(int64_t max_age_micros) { snapshot_max_age_micros_ = max_age_micros; }
+
+  // Bounds the number of tracked connections, 0 meaning no limit. Once the tracker goes over the limit, its oldest
+  // inactive connections are evicted first. Active connections are only evicted when no inactive one is left, the
+  // oldest ones of the containers having the most connections first. Evicted active connections are still reported
+  // as active by change-tracking fetches, until a scrape tells whether they are.
+  void SetMaxConnections(size_t max_connections) { max_connections_ = max_connections; }
+  // Same as SetMaxConnections, as an estimate of the memory used by the tracked connections, 0 meaning no limit. The
+  // lowest of both limits applies.
+  void SetMaxConnectionBytes(size_t max_bytes) { max_connection_bytes_ = max_bytes; }
+  // Bounds the number of connections tracked for each container, 0 meaning no limit. Once a container reaches its
+  // limit, updates of connections it does not already have are dropped, until some of its connections are removed.
+  void SetMaxConnectionsPerContainer(size_t max_connections) { max_connections_per_container_ = max_connections; }
+
   template <typename T>
   static void UpdateOldState(UnorderedMap<T, ConnStatus>* old_state, const UnorderedMap<T, ConnStatus>& new_state, int64_t time_micros, int64_t afterglow_period_micros);
 
@@ -131,17 +202,28 @@ class ConnectionTracker {
 
   void UpdateKnownPublicIPs(UnorderedSet<Address>&& known_public_ips);
   void UpdateKnownIPNetworks(UnorderedMap<Address::Family, std::vector<IPNet>>&& known_ip_networks);
-  void EnableExternalIPs(bool enable) { enable_external_ips_ = enable; }
+  // Same as above, with the networks of the given families already in a tree. Families without networks in the tree
+  // but listed in `families` are known to have none.
+  void UpdateKnownIPNetworks(NRadixTree&& known_ip_networks, const std::vector<Address::Family>& families);
+  void EnableExternalIPs(bool enable);
+  // Aggregates external addresses into subnets of the given lengths when external IPs are enabled. A threshold of 0
+  // disables aggregation, as does a length of 0 for the addresses of a family. A subnet is aggregated by the first
+  // change-tracking fetch finding connections to more than `threshold` different addresses in it, and remains so
+  // until no connection to it was seen for kAggregatedSubnetMaxIdleFetches fetches, or the aggregation settings
+  // change. Sparse external destinations thus keep their own addresses, while the number of connections to large
+  // address ranges, e.g. CDNs, stays bounded.
+  void SetExternalIPsAggregation(size_t threshold, size_t ipv4_bits, size_t ipv6_bits);
   void UpdateIgnoredL4ProtoPortPairs(UnorderedSet<L4ProtoPortPair>&& ignored_l4proto_port_pairs);
   void UpdateIgnoredNetworks(const std::vector<IPNet>& network_list);
   void UpdateNonAggregatedNetworks(const std::vector<IPNet>& network_list);
 
   // Emplace a connection into the state ConnMap, or update its timestamp if the supplied timestamp is more recent
-  // than the stored one.
+  // than the stored one. No lock is taken, so this must not race with any other access to the tracker. The connection
+  // limit is not enforced either, which is left to the next update taking the locks.
   void EmplaceOrUpdateNoLock(const Connection& conn, ConnStatus status);
 
   // Emplace a listen endpoint into the state ContainerEndpointMap, or update its timestamp if the supplied timestamp is more
-  // recent than the stored one.
+  // recent than the stored one. No lock is taken, so this must not race with any other access to the tracker.
   void EmplaceOrUpdateNoLock(const ContainerEndpoint& ep, ConnStatus status);
 
   //
@@ -162,53 +244,322 @@ class ConnectionTracker {
   bool ShouldNormalizeConnection(const Connection* conn) const;
 
  private:
-  // NormalizeConnection transforms a connection into a normalized form.
-  Connection NormalizeConnectionNoLock(const Connection& conn) const;
-  IPNet NormalizeAddressNoLock(const Address& address, bool enable_external_ips) const;
+  // Connections and endpoints are partitioned by hash into independently locked shards, such that updates coming
+  // from the event thread only ever contend with a fetch that is currently walking the very same shard.
+  static constexpr size_t kShardBits = 5;
+  static constexpr size_t kNumShards = 1UL << kShardBits;
+  static constexpr size_t kAddressCacheCapacityPerShard = 512;
+  // Dirty connection lists are not compacted below this size, see MarkDirtyNoLock.
+  static constexpr size_t kMinDirtyConnsCompaction = 1024;
+  // Number of consecutive change-tracking fetches without any connection to an aggregated subnet after which it is
+  // no longer aggregated.
+  static constexpr size_t kAggregatedSubnetMaxIdleFetches = 10;
+  // Estimated memory used by a tracked connection: the map entry, and the node and bucket pointers around it.
+  static constexpr size_t kBytesPerConnection = sizeof(ConnMap::value_type) + 4 * sizeof(void*);
+
+  // Network configuration looked up when tracking and fetching connections. Published tables are never modified:
+  // updates build new ones and swap them in atomically, such that lookups never wait for an update, nor the other
+  // way around.
+  struct NetworkTables {
+    UnorderedSet<Address> known_public_ips;
+    NRadixTree known_ip_networks;
+    bool enable_external_ips = false;
+    UnorderedMap<Address::Family, bool> known_private_networks_exists;
+    UnorderedSet<L4ProtoPortPair> ignored_l4proto_port_pairs;
+    NRadixTree ignored_networks;
+    NRadixTree non_aggregated_networks;
+    // External address aggregation settings, see SetExternalIPsAggregation.
+    size_t external_ips_aggregation_threshold = 0;
+    size_t external_ipv4_aggregation_bits = 24;
+    size_t external_ipv6_aggregation_bits = 48;
+    // The external subnets which are aggregated, all of the above lengths.
+    NRadixTree aggregated_external_subnets;
+    // Incremented with every update.
+    uint64_t generation = 0;
+    // Incremented with every update affecting connection normalization.
+    uint64_t normalization_generation = 0;
+  };
+
+  // Loading the tables is not free, as atomic shared pointer accesses take a lock. They are thus loaded once per batch
+  // of updates or per fetch, and passed down from there, never loaded per connection.
+  std::shared_ptr<const NetworkTables> GetNetworkTables() const { return std::atomic_load(&network_tables_); }
+  // Publishes a modified copy of the current tables. `update_fn` modifies the copy and returns whether anything
+  // changed; nothing is published otherwise. Returns the generation of the published tables, or 0 if none was.
+  template <typename UpdateFn>
+  uint64_t UpdateNetworkTables(bool affects_normalization, const UpdateFn& update_fn);
+  // Accounts for a tracked connection to `address`, whose normalized remote network is `remote`, in the external
+  // subnet aggregation state, if the address is external: `delta` is 1 when the connection gets reported as active,
+  // -1 when it no longer is, and 0 when it is fetched as inactive without ever having been reported as active.
+  void CountExternalAddressNoLock(const NetworkTables& tables, const Address& address, const IPNet& remote, int delta);
+  // Aggregates the external subnets with more different addresses than the threshold, and stops aggregating those
+  // idle for too long, given the connections counted by the current change-tracking fetch. Active normalized
+  // connections to newly aggregated addresses are renamed after their subnet, and `cm` updated accordingly. Only the
+  // cached normalized addresses of the subnets which changed are invalidated, and the following change-tracking fetch
+  // remains incremental.
+  void UpdateAggregatedExternalSubnetsNoLock(const NetworkTables& tables, ConnMap* cm);
+
+  struct alignas(64) Shard {
+    std::mutex mutex;
+    ConnMap conn_state;
+    ContainerEndpointMap endpoint_state;
+    Stats inserted_connections_counters = {};
+    // Connections whose contribution to the normalized state may have changed since the previous change-tracking
+    // fetch, each of them listed once unless removed in the meantime. See MarkDirtyNoLock.
+    std::vector<Connection> dirty_conns;
+    // Connections removed other than by a change-tracking fetch while they were reported as active, with their last
+    // status, such that the next change-tracking fetch can take them out of the normalized state.
+    std::vector<std::pair<Connection, ConnStatus>> removed_conns;
+    // Normalized form of the remote addresses seen recently, valid for the network tables normalization generation
+    // `normalization_generation`. Normalizing a connection only takes resolving its remote address, and the same remote
+    // addresses keep coming back (load balancers, DNS servers, registries...), so these are kept across fetches in a
+    // bounded cache, instead of a normalized copy of every connection.
+    ClockCache<Address, IPNet> normalized_addresses{kAddressCacheCapacityPerShard};
+    uint64_t normalization_generation = 0;
+    // Aggregated subnets change without a new normalization generation, only invalidating the addresses they contain,
+    // so fetches with tables older than this generation do not use the cache.
+    uint64_t cache_tables_generation = 0;
+  };
+
+  // Returns the index of the shard responsible for the given key. The hash is scrambled and its top bits are used,
+  // so that the shard choice is independent from the bucket choice of the per-shard maps.
+  template <typename T>
+  static inline size_t ShardIndex(const T& key) {
+    return static_cast<size_t>((static_cast<uint64_t>(Hasher()(key)) * 0x9e3779b97f4a7c15ULL) >> (64 - kShardBits));
+  }
+
+  template <typename T>
+  inline Shard& ShardFor(const T& key) {
+    return shards_[ShardIndex(key)];
+  }
+
+  // `tables` is loaded on first use, if the connection is new and needs to be accounted for in the statistics.
+  void EmplaceOrUpdateNoLock(std::shared_ptr<const NetworkTables>* tables, Shard* shard, const Connection& conn, ConnStatus status);
+  void EmplaceOrUpdateNoLock(Shard* shard, const ContainerEndpoint& ep, ConnStatus status);
+
+  void FetchConnStateNoLock(const NetworkTables& tables, ConnMap* cm, bool normalize, bool clear_inactive);
+  // Fetches the full normalized state, and starts tracking changes from there on.
+  void FetchAllChangesNoLock(const NetworkTables& tables, ConnMap* cm);
+  // Fetches the changes of the normalized state since the previous change-tracking fetch, from the connections listed
+  // as dirty or removed.
+  void FetchDirtyChangesNoLock(const NetworkTables& tables, ConnMap* cm);
+  // Clears the address cache of the shard if the tables normalize differently than when it was filled.
+  static void PrepareNormalizationNoLock(const NetworkTables& tables, Shard* shard);
+
+  // Lists the connection for the next change-tracking fetch if its contribution to the normalized state may have
+  // changed since the previous one, that is, unless it is active and was reported as such.
+  void MarkDirtyNoLock(Shard* shard, const Connection& conn, ConnStatus* status);
+  // Keeps track of a connection removed other than by a change-tracking fetch, if it was reported as active.
+  void MarkRemovedNoLock(Shard* shard, const Connection& conn, ConnStatus status);
+
+  // Returns the number of connections that can be tracked, given both limits, 0 meaning no limit.
+  size_t MaxConnections() const;
+  // Evicts connections if there are more than the limit. Must be called without holding any tracker lock.
+  void EnforceConnectionLimit();
+  // Evicts up to `max_evicted` inactive connections last active at or before `cutoff`, or up to `max_evicted[c]`
+  // active connections of each container c, last active at or before `cutoff[c]`. Returns the number of evicted
+  // connections.
+  size_t EvictInactiveConnections(int64_t cutoff, size_t max_evicted);
+  size_t EvictActiveConnections(const UnorderedMap<ContainerId, int64_t>& cutoff, UnorderedMap<ContainerId, size_t> max_evicted);
+
+  // Accounts for a new connection of `container`, unless the container already has as many connections as the
+  // per-container limit allows, in which case false is returned.
+  bool AddContainerConnection(const ContainerId& container);
+  // Accounts for the removal of connections, given the number of connections removed for each container.
+  void RemoveContainerConnections(const UnorderedMap<ContainerId, size_t>& removed);
+  // Forgets the containers left without any connection.
+  void PruneContainerCounts();
+
+  friend class ConnectionUpdateBuffer;
+  void RegisterUpdateBuffer(ConnectionUpdateBuffer* buffer);
+  void UnregisterUpdateBuffer(ConnectionUpdateBuffer* buffer);
+  // Applies the pending updates of all registered buffers. Must be called without holding any tracker lock.
+  void FlushUpdateBuffers();
+
+  // NormalizeConnection transforms a connection into a normalized form, given the normalized form of its remote address.
+  static Connection NormalizeConnectionNoLock(const Connection& conn, const IPNet& remote_network);
+  // Same as NormalizeConnectionNoLock, resolving the remote address through the address cache of the shard holding
+  // `conn`. The caller must hold the shard lock.
+  static Connection NormalizeConnectionCachedNoLock(const NetworkTables& tables, Shard* shard, const Connection& conn);
+  static IPNet NormalizeAddressNoLock(const NetworkTables& tables, const Address& address, AddressClass address_class, bool enable_external_ips);
+  // Same as NormalizeAddressNoLock with the external IPs setting of the tables, using and filling the address cache of
+  // the shard. The address is only classified on a cache miss. The caller must hold the shard lock.
+  static IPNet NormalizeAddressCachedNoLock(const NetworkTables& tables, Shard* shard, const Address& address);
+  static bool ShouldNormalizeConnection(const NetworkTables& tables, const Connection* conn);
 
   // Returns true if any connection filters are found.
-  inline bool HasConnectionFilters() const {
-    return !ignored_l4proto_port_pairs_.empty() || !ignored_networks_.IsEmpty();
+  static inline bool HasConnectionFilters(const NetworkTables& tables) {
+    return !tables.ignored_l4proto_port_pairs.empty() || !tables.ignored_networks.IsEmpty();
   }
 
   // Determine if a protocol port combination from a connection or endpoint should be ignored
-  inline bool IsIgnoredL4ProtoPortPair(const L4ProtoPortPair& p) const {
-    return Contains(ignored_l4proto_port_pairs_, p);
+  static inline bool IsIgnoredL4ProtoPortPair(const NetworkTables& tables, const L4ProtoPortPair& p) {
+    return Contains(tables.ignored_l4proto_port_pairs, p);
   }
 
   // NormalizeContainerEndpoint transforms a container endpoint into a normalized form.
   inline ContainerEndpoint NormalizeContainerEndpoint(const ContainerEndpoint& cep) const {
     const auto& ep = cep.endpoint();
-    return ContainerEndpoint(cep.container(), Endpoint(Address(ep.address().family()), ep.port()), cep.l4proto(), cep.originator());
+    return ContainerEndpoint(cep.container_id(), Endpoint(Address(ep.address().family()), ep.port()), cep.l4proto(), cep.originator());
   }
 
   // Determine if a connection should be ignored
-  inline bool ShouldFetchConnection(const Connection& conn) const {
-    return !IsIgnoredL4ProtoPortPair(L4ProtoPortPair(conn.l4proto(), conn.local().port())) &&
-           !IsIgnoredL4ProtoPortPair(L4ProtoPortPair(conn.l4proto(), conn.remote().port())) &&
-           ignored_networks_.Find(conn.remote().address()).IsNull();
+  static inline bool ShouldFetchConnection(const NetworkTables& tables, const Connection& conn) {
+    return !IsIgnoredL4ProtoPortPair(tables, L4ProtoPortPair(conn.l4proto(), conn.local().port())) &&
+           !IsIgnoredL4ProtoPortPair(tables, L4ProtoPortPair(conn.l4proto(), conn.remote().port())) &&
+           tables.ignored_networks.Find(conn.remote().address()).IsNull();
   }
 
   // Determine if a container endpoint should be ignored
-  inline bool ShouldFetchContainerEndpoint(const ContainerEndpoint& cep) const {
-    return !IsIgnoredL4ProtoPortPair(L4ProtoPortPair(cep.l4proto(), cep.endpoint().port()));
+  static inline bool ShouldFetchContainerEndpoint(const NetworkTables& tables, const ContainerEndpoint& cep) {
+    return !IsIgnoredL4ProtoPortPair(tables, L4ProtoPortPair(cep.l4proto(), cep.endpoint().port()));
   }
 
-  inline void IncrementConnectionStats(Connection conn, ConnectionTracker::Stats& stats) const;
+  static inline void IncrementConnectionStats(const NetworkTables& tables, Connection conn, ConnectionTracker::Stats& stats);
+
+  std::array<Shard, kNumShards> shards_;
+
+  // Read and replaced atomically. network_tables_mutex_ serializes updates, such that none of them is lost.
+  std::shared_ptr<const NetworkTables> network_tables_ = std::make_shared<const NetworkTables>();
+  std::mutex network_tables_mutex_;
+  // Generation of the network tables used by the previous change-tracking fetch.
+  std::atomic<uint64_t> tracked_tables_generation_ = 0;
+  // Serializes change-tracking fetches, and protects the state they keep.
+  std::mutex changes_mutex_;
+  // Number of tracked connections reported as active for each normalized connection, as of the previous
+  // change-tracking fetch. Normalized connections which are not active are left out.
+  UnorderedMap<Connection, size_t> active_normalized_conns_;
+  // Evicted connections which were reported as active, by normalized connection. They are still counted as active,
+  // such that the eviction of a connection which is still open does not report it as closed, until either the same
+  // normalized connection is tracked again, or a scrape started after the eviction completes without it.
+  struct PinnedConnections {
+    size_t count = 0;
+    int64_t last_active_time = 0;
+    uint64_t scrape = 0;
+  };
+  UnorderedMap<Connection, PinnedConnections> pinned_normalized_conns_;
+
+  // External subnet aggregation state, see SetExternalIPsAggregation: the number of tracked connections reported as
+  // active for each external remote address, the number of such addresses in each subnet of the aggregation length,
+  // the external addresses of the connections fetched as inactive by the current fetch, and the number of fetches each
+  // aggregated subnet has been idle for.
+  UnorderedMap<Address, size_t> external_address_conns_;
+  UnorderedMap<IPNet, size_t> external_subnet_addresses_;
+  UnorderedSet<Address> fetched_external_addresses_;
+  UnorderedMap<IPNet, size_t> idle_aggregated_subnets_;
+
+  // Number of scrapes, i.e. calls to Update, started and completed.
+  std::atomic<uint64_t> scrapes_started_ = 0;
+  std::atomic<uint64_t> scrapes_completed_ = 0;
+
+  // Number of tracked connections of each container, over all shards. Counts are looked up under the shared lock and
+  // updated atomically, such that the exclusive lock is only taken to add containers, or to drop the ones left without
+  // connections. It is always acquired after shard locks.
+  std::shared_mutex container_counts_mutex_;
+  UnorderedMap<ContainerId, std::unique_ptr<std::atomic<size_t>>> container_counts_;
+
+  template <typename Map>
+  struct Snapshot {
+    Map state;
+    int64_t time_micros;
+    uint64_t epoch;
+  };
+
+  template <typename Map, typename FetchFn>
+  std::shared_ptr<const Map> GetSnapshot(std::shared_ptr<const Snapshot<Map>>* snapshot, const FetchFn& fetch_fn);
+
+  // Published snapshots, indexed by whether they are normalized. They are read and replaced atomically, while
+  // snapshot_mutex_ ensures that only one caller rebuilds an outdated snapshot.
+  std::mutex snapshot_mutex_;
+  std::array<std::shared_ptr<const Snapshot<ConnMap>>, 2> conn_snapshots_;
+  std::array<std::shared_ptr<const Snapshot<AdvertisedEndpointMap>>, 2> endpoint_snapshots_;
+  // Incremented whenever published snapshots become outdated regardless of their age.
+  std::atomic<uint64_t> snapshot_epoch_ = 0;
+  std::atomic<int64_t> snapshot_max_age_micros_ = 1000000;
+
+  std::atomic<size_t> max_connections_ = 0;
+  std::atomic<size_t> max_connection_bytes_ = 0;
+  // Number of tracked connections, over all shards.
+  std::atomic<size_t> num_connections_ = 0;
+  // Held while evicting connections, such that only one thread does it at a time.
+  std::mutex eviction_mutex_;
+  std::atomic<size_t> max_connections_per_container_ = 0;
+
+  std::mutex update_buffers_mutex_;
+  std::vector<ConnectionUpdateBuffer*> update_buffers_;
+
+  // Set whenever the next change-tracking fetch cannot tell which connections changed, in which case connections are
+  // not marked as dirty or removed anymore, until it fetches the full state.
+  std::atomic<bool> changes_unknown_ = true;
+};
+
+// ConnectionUpdateBuffer stages connection updates from a single producer, and applies them to the tracker in
+// batches, once enough of them are pending or the oldest of them is old enough. Pending updates are always applied
+// before the tracker state is fetched, so that batching never delays them past the next fetch.
+class ConnectionUpdateBuffer {
+ public:
+  static constexpr size_t kDefaultMaxSize = 1024;
+  static constexpr int64_t kDefaultMaxDelayMicros = 100000;
 
-  std::mutex mutex_;
-  ConnMap conn_state_;
-  ContainerEndpointMap endpoint_state_;
+  explicit ConnectionUpdateBuffer(std::shared_ptr<ConnectionTracker> tracker, size_t max_size = kDefaultMaxSize,
+                                  int64_t max_delay_micros = kDefaultMaxDelayMicros);
+  ~ConnectionUpdateBuffer();
 
-  UnorderedSet<Address> known_public_ips_;
-  NRadixTree known_ip_networks_;
-  bool enable_external_ips_ = false;
-  UnorderedMap<Address::Family, bool> known_private_networks_exists_;
-  UnorderedSet<L4ProtoPortPair> ignored_l4proto_port_pairs_;
-  NRadixTree ignored_networks_;
-  NRadixTree non_aggregated_networks_;
+  ConnectionUpdateBuffer(const ConnectionUpdateBuffer&) = delete;
+  ConnectionUpdateBuffer& operator=(const ConnectionUpdateBuffer&) = delete;
+
+  void UpdateConnection(const Connection& conn, int64_t timestamp, bool added);
+  // Applies all pending updates to the tracker.
+  void Flush();
+
+  size_t size() const;
+
+ private:
+  friend class ConnectionTracker;
 
-  Stats inserted_connections_counters_ = {};
+  void FlushNoLock();
+
+  std::shared_ptr<ConnectionTracker> tracker_;
+  const size_t max_size_;
+  const int64_t max_delay_micros_;
+
+  // Held while updates are applied, so that a fetch cannot happen between their removal from the buffer and their
+  // insertion in the tracker.
+  mutable std::mutex mutex_;
+  std::vector<ConnectionTracker::ConnectionUpdate> updates_;
+  int64_t oldest_timestamp_ = 0;
+};
+
+// ReportedConnState holds the connection state last reported when afterglow is enabled, i.e., the old state passed
+// to ConnectionTracker::ComputeDeltaAfterglow. It allows computing the next delta and updating the old state at a
+// cost that depends on the number of connections that changed, rather than on the total number of connections.
+class ReportedConnState {
+ public:
+  // Computes the delta between the reported state and the new state into `delta`, then makes the new state the
+  // reported state, given the changes returned by ConnectionTracker::FetchConnStateWithChanges. This is equivalent to
+  // ComputeDeltaAfterglow followed by UpdateOldState on the full states, except that connections which stay active
+  // keep the status they were first reported with, since their timestamps are not part of the changes.
+  void ComputeDeltaAfterglow(const ConnMap& changes, ConnMap* delta, int64_t time_micros, int64_t time_at_last_scrape,
+                             int64_t afterglow_period_micros);
+
+  // Returns the reported state as a single map, leaving this object empty. This is meant to be used along with the
+  // full-state ComputeDeltaAfterglow and UpdateOldState functions, followed by a call to Reset.
+  ConnMap Release();
+
+  // Replaces the reported state with `old_state`, which must have been updated with `new_state` by UpdateOldState.
+  void Reset(ConnMap&& old_state, ConnMap&& new_state);
+
+  size_t size() const { return state_.size() + afterglow_state_.size(); }
+
+ private:
+  const ConnStatus* Lookup(const Connection& conn) const;
+
+  // The previously fetched state, with the statuses of connections which stayed active as of when they became so.
+  ConnMap state_;
+  // Connections which are not part of `state_` anymore, but are retained during their afterglow period.
+  ConnMap afterglow_state_;
+  // The inactive connections of `state_`. They are removed from the tracker, and therefore will not be part of the
+  // next fetched state unless they come back.
+  std::vector<Connection> inactive_;
 };
 
 /* static */
@@ -0,0 +1,115 @@
+#include "ContainerId.h"
+
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+
+namespace collector {
+
+namespace {
+
+// InternTable owns the interned entries. Lookups of already known IDs, which are by far the most common case, only
+// take a shared lock.
+//
+// An entry is only erased under the exclusive lock, once its last handle is released. Since new handles on an entry
+// are either copies of a live handle, or taken under the lock by Intern(), a count that drops to zero under the
+// exclusive lock cannot be raised anymore.
+class InternTable {
+ public:
+  using Entry = internal::ContainerIdEntry;
+
+  // Returns the entry for `id`, with a reference taken on it.
+  const Entry* Intern(std::string_view id) {
+    {
+      std::shared_lock<std::shared_mutex> lock(mutex_);
+      auto it = entries_.find(id);
+      if (it != entries_.end()) {
+        return Retain(it->second.get());
+      }
+    }
+
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    auto it = entries_.find(id);
+    if (it != entries_.end()) {
+      return Retain(it->second.get());
+    }
+    auto entry = std::make_unique<Entry>();
+    entry->str = std::string(id);
+    entry->hash = std::hash<std::string_view>()(id);
+    // The key views the string owned by the entry, which never moves.
+    std::string_view key(entry->str);
+    return Retain(entries_.emplace(key, std::move(entry)).first->second.get());
+  }
+
+  // Interns `id` for the lifetime of the process. Must be called before any other handle on `id` is taken.
+  const Entry* InternImmortal(std::string_view id) {
+    auto* entry = const_cast<Entry*>(Intern(id));
+    entry->immortal = true;
+    return entry;
+  }
+
+  void Release(const Entry* entry) {
+    // Dropping any reference but the last one does not need the lock.
+    size_t refs = entry->refs.load(std::memory_order_relaxed);
+    while (refs > 1) {
+      if (entry->refs.compare_exchange_weak(refs, refs - 1, std::memory_order_release, std::memory_order_relaxed)) {
+        return;
+      }
+    }
+
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    if (entry->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      entries_.erase(std::string_view(entry->str));
+    }
+  }
+
+  size_t Size() const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return entries_.size();
+  }
+
+ private:
+  static const Entry* Retain(const Entry* entry) {
+    entry->refs.fetch_add(1, std::memory_order_relaxed);
+    return entry;
+  }
+
+  mutable std::shared_mutex mutex_;
+  std::unordered_map<std::string_view, std::unique_ptr<Entry>> entries_;
+};
+
+// The table is deliberately leaked, such that handles held by static objects remain valid during shutdown.
+InternTable& GetInternTable() {
+  static auto* table = new InternTable();
+  return *table;
+}
+
+}  // namespace
+
+namespace internal {
+
+void ReleaseContainerIdEntry(const ContainerIdEntry* entry) {
+  GetInternTable().Release(entry);
+}
+
+}  // namespace internal
+
+const internal::ContainerIdEntry* ContainerId::EmptyEntry() {
+  static const internal::ContainerIdEntry* empty_entry = GetInternTable().InternImmortal("");
+  return empty_entry;
+}
+
+ContainerId::ContainerId() : entry_(EmptyEntry()) {}
+
+ContainerId::ContainerId(std::string_view id) : entry_(id.empty() ? EmptyEntry() : GetInternTable().Intern(id)) {}
+
+size_t ContainerId::InternedCount() {
+  return GetInternTable().Size();
+}
+
+std::ostream& operator<<(std::ostream& os, const ContainerId& container_id) {
+  return os << container_id.str();
+}
+
+}  // namespace collector
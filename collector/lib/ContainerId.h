@@ -0,0 +1,93 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+namespace collector {
+
+namespace internal {
+
+struct ContainerIdEntry {
+  std::string str;
+  size_t hash;
+  // Number of live handles on the entry. The entry of the empty ID is never released and not counted.
+  mutable std::atomic<size_t> refs{0};
+  bool immortal = false;
+};
+
+// Drops a reference on `entry`, and removes it from the intern table if it was the last one.
+void ReleaseContainerIdEntry(const ContainerIdEntry* entry);
+
+}  // namespace internal
+
+// ContainerId is a lightweight handle on an interned container ID string.
+//
+// All handles referring to the same ID point to the same entry of a process-wide intern table, so that copying,
+// comparing and hashing a ContainerId are single-word operations, regardless of the length of the ID. Entries are
+// reference counted, and removed from the table once the last handle on them is gone, such that the IDs of
+// terminated containers do not accumulate.
+class ContainerId {
+ public:
+  // Constructs a handle to the empty container ID.
+  ContainerId();
+  ContainerId(std::string_view id);
+  ContainerId(const std::string& id) : ContainerId(std::string_view(id)) {}
+  ContainerId(const char* id) : ContainerId(std::string_view(id)) {}
+
+  ContainerId(const ContainerId& other) : entry_(other.entry_) { Retain(); }
+  ContainerId(ContainerId&& other) noexcept : entry_(other.entry_) { other.entry_ = EmptyEntry(); }
+  ~ContainerId() { Release(); }
+
+  ContainerId& operator=(const ContainerId& other) {
+    if (entry_ != other.entry_) {
+      Release();
+      entry_ = other.entry_;
+      Retain();
+    }
+    return *this;
+  }
+
+  ContainerId& operator=(ContainerId&& other) noexcept {
+    if (this != &other) {
+      Release();
+      entry_ = other.entry_;
+      other.entry_ = EmptyEntry();
+    }
+    return *this;
+  }
+
+  const std::string& str() const { return entry_->str; }
+  bool empty() const { return entry_->str.empty(); }
+
+  bool operator==(const ContainerId& other) const { return entry_ == other.entry_; }
+  bool operator!=(const ContainerId& other) const { return !(*this == other); }
+
+  size_t Hash() const { return entry_->hash; }
+
+  // Returns the number of distinct container IDs currently interned, including the empty one.
+  static size_t InternedCount();
+
+ private:
+  static const internal::ContainerIdEntry* EmptyEntry();
+
+  void Retain() const {
+    if (!entry_->immortal) {
+      entry_->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  void Release() const {
+    if (!entry_->immortal) {
+      internal::ReleaseContainerIdEntry(entry_);
+    }
+  }
+
+  const internal::ContainerIdEntry* entry_;
+};
+
+std::ostream& operator<<(std::ostream& os, const ContainerId& container_id);
+
+}  // namespace collector
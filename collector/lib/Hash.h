@@ -1,8 +1,18 @@
 #pragma once
 
+#include <endian.h>
+
 #include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <tuple>
 #include <unordered_map>
 #include <unordered_set>
+#include <utility>
 
 namespace collector {
 
@@ -93,10 +103,554 @@ size_t HashAll(const FirstArg& first, const RestArgs&... rest) {
   return CombineHashes(Hasher()(first), HashAll(rest...));
 }
 
+namespace internal {
+
+// Control bytes of FlatHashMap slots. A full slot stores the 7 low bits of the (mixed) hash of its key, hence always
+// has its high bit cleared, while all special values have it set.
+enum : int8_t {
+  kCtrlEmpty = -128,  // 0b10000000
+  kCtrlDeleted = -2,  // 0b11111110
+  kCtrlSentinel = -1  // 0b11111111, marks the end of the control bytes for iteration.
+};
+
+// FlatHashGroup allows to inspect the control bytes of a group of 8 consecutive slots at once. It relies on plain
+// 64-bit arithmetic ("SWAR") rather than on SIMD instructions, so that it is portable to all supported architectures.
+// Every returned mask has the high bit of the byte corresponding to each matching slot set.
+class FlatHashGroup {
+ public:
+  static constexpr size_t kWidth = 8;
+
+  explicit FlatHashGroup(const int8_t* ctrl) {
+    uint64_t word;
+    std::memcpy(&word, ctrl, sizeof(word));
+    // Make sure that byte i of the group always maps to bits [8i, 8i+8) of the word, regardless of endianness.
+    word_ = le64toh(word);
+  }
+
+  // Returns the slots that may hold a key with the given H2 hash. There can be false positives, but only for full
+  // slots, and therefore keys need to be compared anyway.
+  uint64_t Match(uint8_t h2) const {
+    uint64_t x = word_ ^ (kLsbs * h2);
+    return (x - kLsbs) & ~x & kMsbs;
+  }
+
+  uint64_t MaskEmpty() const {
+    return word_ & ~(word_ << 6) & kMsbs;
+  }
+
+  uint64_t MaskEmptyOrDeleted() const {
+    return word_ & ~(word_ << 7) & kMsbs;
+  }
+
+  // Returns the index within the group of the lowest slot in the given (non-empty) mask.
+  static size_t LowestIndex(uint64_t mask) {
+    return static_cast<size_t>(__builtin_ctzll(mask)) >> 3;
+  }
+
+ private:
+  static constexpr uint64_t kLsbs = 0x0101010101010101ULL;
+  static constexpr uint64_t kMsbs = 0x8080808080808080ULL;
+
+  uint64_t word_;
+};
+
+}  // namespace internal
+
+// FlatHashMap is an open-addressing hash map in the style of Abseil's Swiss tables, meant as a drop-in replacement
+// for std::unordered_map in the hot paths of connection tracking.
+//
+// Entries are stored inline in a single array of slots, alongside an array of one control byte per slot holding 7
+// bits of the hash of the key. Lookups scan the control bytes of groups of 8 slots at a time, and only compare keys
+// for slots whose control byte matches, so that a lookup touches very few cache lines.
+//
+// Differences with std::unordered_map:
+//  - inserting an element invalidates all iterators, pointers and references to elements, if it causes a rehash.
+//  - erasing an element never invalidates iterators, pointers and references to other elements, so the usual
+//    `it = map.erase(it)` loop is supported.
+template <typename K, typename V, typename H = Hasher, typename E = std::equal_to<K>>
+class FlatHashMap {
+  using Group = internal::FlatHashGroup;
+
+  template <bool Const>
+  class Iterator;
+
+ public:
+  using key_type = K;
+  using mapped_type = V;
+  using value_type = std::pair<const K, V>;
+  using size_type = size_t;
+  using difference_type = std::ptrdiff_t;
+  using hasher = H;
+  using key_equal = E;
+  using reference = value_type&;
+  using const_reference = const value_type&;
+  using pointer = value_type*;
+  using const_pointer = const value_type*;
+  using iterator = Iterator<false>;
+  using const_iterator = Iterator<true>;
+
+  FlatHashMap() = default;
+
+  explicit FlatHashMap(size_t bucket_count, const H& hash = H(), const E& eq = E()) : hash_(hash), eq_(eq) {
+    reserve(bucket_count);
+  }
+
+  template <typename InputIt>
+  FlatHashMap(InputIt first, InputIt last) {
+    insert(first, last);
+  }
+
+  FlatHashMap(std::initializer_list<value_type> init) {
+    insert(init.begin(), init.end());
+  }
+
+  FlatHashMap(const FlatHashMap& other) : hash_(other.hash_), eq_(other.eq_) {
+    reserve(other.size());
+    for (const auto& entry : other) {
+      InsertUnique(HashOf(entry.first), entry);
+    }
+  }
+
+  FlatHashMap(FlatHashMap&& other) noexcept : FlatHashMap() {
+    swap(other);
+  }
+
+  ~FlatHashMap() {
+    DestroyAll();
+    Deallocate();
+  }
+
+  FlatHashMap& operator=(const FlatHashMap& other) {
+    if (this != &other) {
+      FlatHashMap copy(other);
+      swap(copy);
+    }
+    return *this;
+  }
+
+  FlatHashMap& operator=(FlatHashMap&& other) noexcept {
+    FlatHashMap moved(std::move(other));
+    swap(moved);
+    return *this;
+  }
+
+  FlatHashMap& operator=(std::initializer_list<value_type> init) {
+    FlatHashMap copy(init);
+    swap(copy);
+    return *this;
+  }
+
+  iterator begin() { return iterator(ctrl_, slots_).SkipEmpty(); }
+  iterator end() { return iterator(ctrl_ + capacity_, slots_ + capacity_); }
+  const_iterator begin() const { return const_iterator(ctrl_, slots_).SkipEmpty(); }
+  const_iterator end() const { return const_iterator(ctrl_ + capacity_, slots_ + capacity_); }
+  const_iterator cbegin() const { return begin(); }
+  const_iterator cend() const { return end(); }
+
+  bool empty() const { return size_ == 0; }
+  size_t size() const { return size_; }
+  size_t bucket_count() const { return capacity_; }
+  float load_factor() const { return capacity_ ? static_cast<float>(size_) / capacity_ : 0.0f; }
+
+  hasher hash_function() const { return hash_; }
+  key_equal key_eq() const { return eq_; }
+
+  void clear() {
+    DestroyAll();
+    if (capacity_) {
+      ResetCtrl();
+    }
+  }
+
+  // Makes sure that `count` elements can be stored without rehashing.
+  void reserve(size_t count) {
+    size_t capacity = Group::kWidth;
+    while (MaxLoad(capacity) < count) {
+      capacity <<= 1;
+    }
+    if (capacity > capacity_ || (count > 0 && capacity_ == 0)) {
+      Rehash(capacity);
+    }
+  }
+
+  void swap(FlatHashMap& other) noexcept {
+    using std::swap;
+    swap(ctrl_, other.ctrl_);
+    swap(slots_, other.slots_);
+    swap(capacity_, other.capacity_);
+    swap(size_, other.size_);
+    swap(growth_left_, other.growth_left_);
+    swap(hash_, other.hash_);
+    swap(eq_, other.eq_);
+  }
+
+  iterator find(const K& key) {
+    size_t idx = Find(key, HashOf(key));
+    return idx == kNotFound ? end() : IteratorAt(idx);
+  }
+
+  const_iterator find(const K& key) const {
+    size_t idx = Find(key, HashOf(key));
+    return idx == kNotFound ? end() : const_iterator(ctrl_ + idx, slots_ + idx);
+  }
+
+  size_t count(const K& key) const {
+    return Find(key, HashOf(key)) == kNotFound ? 0 : 1;
+  }
+
+  V& at(const K& key) {
+    auto it = find(key);
+    if (it == end()) {
+      throw std::out_of_range("FlatHashMap::at");
+    }
+    return it->second;
+  }
+
+  const V& at(const K& key) const {
+    auto it = find(key);
+    if (it == end()) {
+      throw std::out_of_range("FlatHashMap::at");
+    }
+    return it->second;
+  }
+
+  V& operator[](const K& key) {
+    return try_emplace(key).first->second;
+  }
+
+  template <typename... Args>
+  std::pair<iterator, bool> try_emplace(const K& key, Args&&... args) {
+    size_t hash = HashOf(key);
+    auto res = FindOrPrepareInsert(key, hash);
+    if (res.second) {
+      new (slots_ + res.first) value_type(std::piecewise_construct, std::forward_as_tuple(key),
+                                          std::forward_as_tuple(std::forward<Args>(args)...));
+    }
+    return {IteratorAt(res.first), res.second};
+  }
+
+  template <typename KArg, typename VArg>
+  std::pair<iterator, bool> emplace(KArg&& key, VArg&& value) {
+    if constexpr (std::is_same<typename std::decay<KArg>::type, K>::value) {
+      return EmplaceWithKey(key, std::forward<KArg>(key), std::forward<VArg>(value));
+    } else {
+      K k(std::forward<KArg>(key));
+      return EmplaceWithKey(k, std::move(k), std::forward<VArg>(value));
+    }
+  }
+
+  template <typename P>
+  std::pair<iterator, bool> emplace(P&& entry) {
+    return emplace(std::forward<P>(entry).first, std::forward<P>(entry).second);
+  }
+
+  std::pair<iterator, bool> insert(const value_type& entry) {
+    return emplace(entry.first, entry.second);
+  }
+
+  template <typename P, typename = typename std::enable_if<std::is_constructible<value_type, P&&>::value>::type>
+  std::pair<iterator, bool> insert(P&& entry) {
+    return emplace(std::forward<P>(entry).first, std::forward<P>(entry).second);
+  }
+
+  template <typename InputIt>
+  void insert(InputIt first, InputIt last) {
+    for (; first != last; ++first) {
+      insert(*first);
+    }
+  }
+
+  void insert(std::initializer_list<value_type> init) {
+    insert(init.begin(), init.end());
+  }
+
+  // Erases the element at the given position, and returns an iterator to the next element.
+  iterator erase(const_iterator pos) {
+    size_t idx = pos.slot_ - slots_;
+    EraseAt(idx);
+    return IteratorAt(idx).SkipEmpty();
+  }
+
+  iterator erase(iterator pos) {
+    return erase(const_iterator(pos));
+  }
+
+  size_t erase(const K& key) {
+    size_t idx = Find(key, HashOf(key));
+    if (idx == kNotFound) {
+      return 0;
+    }
+    EraseAt(idx);
+    return 1;
+  }
+
+  bool operator==(const FlatHashMap& other) const {
+    if (size_ != other.size_) {
+      return false;
+    }
+    for (const auto& entry : *this) {
+      auto it = other.find(entry.first);
+      if (it == other.end() || !(*it == entry)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool operator!=(const FlatHashMap& other) const {
+    return !(*this == other);
+  }
+
+ private:
+  static constexpr size_t kNotFound = static_cast<size_t>(-1);
+
+  template <bool Const>
+  class Iterator {
+   public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = std::pair<const K, V>;
+    using difference_type = std::ptrdiff_t;
+    using pointer = typename std::conditional<Const, const value_type*, value_type*>::type;
+    using reference = typename std::conditional<Const, const value_type&, value_type&>::type;
+
+    Iterator() = default;
+    // Allows converting an iterator into a const_iterator.
+    template <bool C = Const, typename = typename std::enable_if<C>::type>
+    Iterator(const Iterator<false>& other) : ctrl_(other.ctrl_), slot_(other.slot_) {}
+
+    reference operator*() const { return *slot_; }
+    pointer operator->() const { return slot_; }
+
+    Iterator& operator++() {
+      ++ctrl_;
+      ++slot_;
+      return SkipEmpty();
+    }
+
+    Iterator operator++(int) {
+      Iterator prev = *this;
+      ++*this;
+      return prev;
+    }
+
+    bool operator==(const Iterator& other) const { return slot_ == other.slot_; }
+    bool operator!=(const Iterator& other) const { return slot_ != other.slot_; }
+
+   private:
+    friend class FlatHashMap;
+    friend class Iterator<!Const>;
+
+    Iterator(const int8_t* ctrl, pointer slot) : ctrl_(ctrl), slot_(slot) {}
+
+    // Moves forward to the next full slot, or to the sentinel.
+    Iterator& SkipEmpty() {
+      if (!ctrl_) {
+        return *this;
+      }
+      while (*ctrl_ < internal::kCtrlSentinel) {
+        ++ctrl_;
+        ++slot_;
+      }
+      return *this;
+    }
+
+    const int8_t* ctrl_ = nullptr;
+    pointer slot_ = nullptr;
+  };
+
+  static size_t MaxLoad(size_t capacity) {
+    return capacity - capacity / 8;
+  }
+
+  // Mixes the user-provided hash, which may be of poor quality (e.g., the identity for integers), such that both the
+  // H1 part (slot position) and the H2 part (control byte) are well distributed.
+  size_t HashOf(const K& key) const {
+    uint64_t h = static_cast<uint64_t>(hash_(key)) * 0x9e3779b97f4a7c15ULL;
+    return static_cast<size_t>(h ^ (h >> 32));
+  }
+
+  static size_t H1(size_t hash) { return hash >> 7; }
+  static int8_t H2(size_t hash) { return static_cast<int8_t>(hash & 0x7f); }
+
+  size_t NumGroups() const { return capacity_ / Group::kWidth; }
+
+  iterator IteratorAt(size_t idx) { return iterator(ctrl_ + idx, slots_ + idx); }
+
+  size_t Find(const K& key, size_t hash) const {
+    if (size_ == 0) {
+      return kNotFound;
+    }
+    const size_t group_mask = NumGroups() - 1;
+    size_t group = H1(hash) & group_mask;
+    for (size_t i = 1;; i++) {
+      const size_t base = group * Group::kWidth;
+      Group g(ctrl_ + base);
+      for (uint64_t match = g.Match(H2(hash)); match; match &= match - 1) {
+        size_t idx = base + Group::LowestIndex(match);
+        if (eq_(slots_[idx].first, key)) {
+          return idx;
+        }
+      }
+      if (g.MaskEmpty()) {
+        return kNotFound;
+      }
+      // Triangular probing visits every group exactly once, since the number of groups is a power of two.
+      group = (group + i) & group_mask;
+    }
+  }
+
+  // Returns the index of the first empty or deleted slot in the probe sequence of the given hash.
+  size_t FindFirstNonFull(size_t hash) const {
+    const size_t group_mask = NumGroups() - 1;
+    size_t group = H1(hash) & group_mask;
+    for (size_t i = 1;; i++) {
+      const size_t base = group * Group::kWidth;
+      uint64_t mask = Group(ctrl_ + base).MaskEmptyOrDeleted();
+      if (mask) {
+        return base + Group::LowestIndex(mask);
+      }
+      group = (group + i) & group_mask;
+    }
+  }
+
+  // Returns the index of the slot holding the given key and false if it exists, otherwise marks a slot as full and
+  // returns its index and true. In the latter case, the caller is responsible for constructing the element.
+  std::pair<size_t, bool> FindOrPrepareInsert(const K& key, size_t hash) {
+    size_t idx = Find(key, hash);
+    if (idx != kNotFound) {
+      return {idx, false};
+    }
+    if (capacity_ == 0) {
+      Rehash(Group::kWidth);
+    }
+    idx = FindFirstNonFull(hash);
+    if (growth_left_ == 0 && ctrl_[idx] == internal::kCtrlEmpty) {
+      // Reclaim tombstones if they account for a large part of the table, otherwise grow it.
+      Rehash(size_ <= MaxLoad(capacity_) / 2 ? capacity_ : capacity_ * 2);
+      idx = FindFirstNonFull(hash);
+    }
+    if (ctrl_[idx] == internal::kCtrlEmpty) {
+      growth_left_--;
+    }
+    ctrl_[idx] = H2(hash);
+    size_++;
+    return {idx, true};
+  }
+
+  template <typename KArg, typename VArg>
+  std::pair<iterator, bool> EmplaceWithKey(const K& key, KArg&& key_arg, VArg&& value) {
+    // The key reference may point into the argument, so it must be used before the argument is moved from.
+    auto res = FindOrPrepareInsert(key, HashOf(key));
+    if (res.second) {
+      new (slots_ + res.first) value_type(std::forward<KArg>(key_arg), std::forward<VArg>(value));
+    }
+    return {IteratorAt(res.first), res.second};
+  }
+
+  // Inserts an element known not to be present, without looking it up first.
+  template <typename T>
+  void InsertUnique(size_t hash, T&& entry) {
+    size_t idx = FindFirstNonFull(hash);
+    if (ctrl_[idx] == internal::kCtrlEmpty) {
+      growth_left_--;
+    }
+    ctrl_[idx] = H2(hash);
+    new (slots_ + idx) value_type(std::forward<T>(entry));
+    size_++;
+  }
+
+  void EraseAt(size_t idx) {
+    slots_[idx].~value_type();
+    size_--;
+    // A lookup only moves past a group if it has no empty slot. If this group already has one, no lookup can rely
+    // on this slot being non-empty, and it can be reused right away instead of being turned into a tombstone.
+    const size_t base = idx & ~(Group::kWidth - 1);
+    if (Group(ctrl_ + base).MaskEmpty()) {
+      ctrl_[idx] = internal::kCtrlEmpty;
+      growth_left_++;
+    } else {
+      ctrl_[idx] = internal::kCtrlDeleted;
+    }
+  }
+
+  void ResetCtrl() {
+    std::memset(ctrl_, static_cast<uint8_t>(internal::kCtrlEmpty), capacity_);
+    ctrl_[capacity_] = internal::kCtrlSentinel;
+    size_ = 0;
+    growth_left_ = MaxLoad(capacity_);
+  }
+
+  void Rehash(size_t new_capacity) {
+    int8_t* old_ctrl = ctrl_;
+    value_type* old_slots = slots_;
+    size_t old_capacity = capacity_;
+
+    ctrl_ = new int8_t[new_capacity + 1];
+    slots_ = std::allocator<value_type>().allocate(new_capacity);
+    capacity_ = new_capacity;
+    ResetCtrl();
+
+    for (size_t i = 0; i < old_capacity; i++) {
+      if (old_ctrl[i] >= 0) {
+        InsertUnique(HashOf(old_slots[i].first), std::move(old_slots[i]));
+        old_slots[i].~value_type();
+      }
+    }
+
+    if (old_ctrl) {
+      delete[] old_ctrl;
+      std::allocator<value_type>().deallocate(old_slots, old_capacity);
+    }
+  }
+
+  void DestroyAll() {
+    if (!std::is_trivially_destructible<value_type>::value) {
+      for (size_t i = 0; i < capacity_; i++) {
+        if (ctrl_[i] >= 0) {
+          slots_[i].~value_type();
+        }
+      }
+    }
+    size_ = 0;
+  }
+
+  void Deallocate() {
+    if (ctrl_) {
+      delete[] ctrl_;
+      std::allocator<value_type>().deallocate(slots_, capacity_);
+    }
+    ctrl_ = nullptr;
+    slots_ = nullptr;
+    capacity_ = 0;
+    growth_left_ = 0;
+  }
+
+  int8_t* ctrl_ = nullptr;
+  value_type* slots_ = nullptr;
+  size_t capacity_ = 0;
+  size_t size_ = 0;
+  size_t growth_left_ = 0;
+  H hash_;
+  E eq_;
+};
+
+template <typename K, typename V, typename H, typename E>
+void swap(FlatHashMap<K, V, H, E>& lhs, FlatHashMap<K, V, H, E>& rhs) noexcept {
+  lhs.swap(rhs);
+}
+
 template <typename E>
 using UnorderedSet = std::unordered_set<E, Hasher>;
 
+// UnorderedMap is backed by FlatHashMap when building with USE_FLAT_HASH_MAP, and by std::unordered_map otherwise. Code
+// using it must thus follow the stricter rules of FlatHashMap, which the unit tests also run with, under the address
+// sanitizer.
+#ifdef COLLECTOR_FLAT_HASH_MAP
+template <typename K, typename V, typename E = std::equal_to<K>>
+using UnorderedMap = FlatHashMap<K, V, Hasher, E>;
+#else
 template <typename K, typename V, typename E = std::equal_to<K>>
 using UnorderedMap = std::unordered_map<K, V, Hasher, E>;
+#endif
 
 }  // namespace collector
@@ -28,227 +28,353 @@
 
 #include "NRadix.h"
 
+#include <algorithm>
+#include <tuple>
+
 #include "Utility.h"
 
 namespace collector {
 
-bool NRadixTree::Insert(const IPNet& network) const {
-  if (network.IsNull()) {
-    CLOG(ERROR) << "Cannot handle null IP networks in network tree";
-    return false;
-  }
+NRadixTree::Key NRadixTree::MakeKey(const Address& address, size_t bits) {
+  const uint64_t* data = address.u64_data();
+  return KeyPrefix({ntohll(data[0]), ntohll(data[1])}, bits);
+}
 
-  if (network.bits() < 1 || network.bits() > 128) {
-    CLOG(ERROR) << "Cannot handle CIDR " << network << " with /" << network.bits() << " , in network tree";
-    return false;
+NRadixTree::Key NRadixTree::KeyPrefix(Key key, size_t bits) {
+  if (bits < 64) {
+    key[0] &= bits == 0 ? 0 : ~(~static_cast<uint64_t>(0) >> bits);
+    key[1] = 0;
+  } else if (bits < 128) {
+    key[1] &= bits == 64 ? 0 : ~(~static_cast<uint64_t>(0) >> (bits - 64));
   }
+  return key;
+}
 
-  const uint64_t* addr_p = network.address().u64_data();
-  const auto net_mask = network.net_mask_array();
-  const uint64_t* net_mask_p = net_mask.data();
-  uint64_t bit(0x8000000000000000ULL);
-
-  nRadixNode* node = this->root_;
-  nRadixNode* next = this->root_;
-
-  size_t i = 0;
-  // Traverse the tree for the bits that already exist in the tree.
-  while (bit & *net_mask_p) {
-    // If the bit is set, go right, otherwise left.
-    if (ntohll(*addr_p) & bit) {
-      next = node->right_;
-    } else {
-      next = node->left_;
-    }
-
-    if (!next) {
-      break;
-    }
-
-    bit >>= 1;
-    node = next;
+size_t NRadixTree::CommonPrefixLength(const Key& a, const Key& b, size_t max_bits) {
+  size_t len;
+  if (uint64_t diff = a[0] ^ b[0]) {
+    len = __builtin_clzll(diff);
+  } else if (uint64_t diff = a[1] ^ b[1]) {
+    len = 64 + __builtin_clzll(diff);
+  } else {
+    len = 128;
+  }
+  return len < max_bits ? len : max_bits;
+}
 
-    if (bit == 0) {
-      // We have walked 128 bits, stop.
-      if (++i >= Address::kU64MaxLen) {
-        break;
-      }
+uint32_t NRadixTree::RootIndex(Address::Family family) {
+  switch (family) {
+    case Address::Family::IPV4:
+      return 0;
+    case Address::Family::IPV6:
+      return 1;
+    default:
+      return kNone;
+  }
+}
 
-      // Reset and move to lower part.
-      bit = 0x8000000000000000ULL;
-      if (network.bits() >= 64) {
-        addr_p++;
-        net_mask_p++;
-      }
+NRadixTree::NRadixTree(const std::vector<IPNet>& networks) : NRadixTree() {
+  std::vector<SortedNetwork> sorted;
+  sorted.reserve(networks.size());
+  for (size_t i = 0; i < networks.size(); i++) {
+    const IPNet& network = networks[i];
+    if (!IsValidNetwork(network)) {
+      CLOG(ERROR) << "Failed to insert CIDR " << network << " in network tree";
+      continue;
     }
+    sorted.push_back({RootIndex(network.family()), MakeKey(network.address(), network.bits()), network.bits(), static_cast<uint32_t>(i)});
   }
 
-  // We finished walking network bits of mask and a node already exist, try updating it with the value.
-  if (next) {
-    // Node already filled. Indicate that the new node was not actually inserted.
-    if (node->value_) {
-      CLOG(ERROR) << "CIDR " << network << " already exists";
+  // Sort by family, then by key, then by length, such that networks always come before their subnets, and the ones
+  // sharing a prefix are next to each other. Duplicates are ordered as in the input, only the first one is kept.
+  std::sort(sorted.begin(), sorted.end(), [](const SortedNetwork& a, const SortedNetwork& b) {
+    return std::tie(a.root, a.key, a.bits, a.network) < std::tie(b.root, b.key, b.bits, b.network);
+  });
+  std::vector<bool> duplicate(networks.size(), false);
+  auto last = std::unique(sorted.begin(), sorted.end(), [&networks, &duplicate](const SortedNetwork& a, const SortedNetwork& b) {
+    if (a.root != b.root || a.key != b.key || a.bits != b.bits) {
       return false;
     }
-    node->value_ = new IPNet(network);
+    CLOG(ERROR) << "CIDR " << networks[b.network] << " already exists";
+    CLOG(ERROR) << "Failed to insert CIDR " << networks[b.network] << " in network tree";
+    duplicate[b.network] = true;
     return true;
+  });
+  sorted.erase(last, sorted.end());
+
+  // Networks are stored in input order, as they would be when inserted one by one.
+  std::vector<uint32_t> network_indices(networks.size(), kNone);
+  for (const auto& net : sorted) {
+    network_indices[net.network] = 0;
+  }
+  data_->networks.reserve(sorted.size());
+  for (size_t i = 0; i < networks.size(); i++) {
+    if (network_indices[i] != kNone) {
+      network_indices[i] = static_cast<uint32_t>(data_->networks.size());
+      data_->networks.push_back(networks[i]);
+    }
+  }
+  for (auto& net : sorted) {
+    net.network = network_indices[net.network];
   }
 
-  // There still are bits to be walked, so go ahead and add them to the tree.
-  while (bit & *net_mask_p) {
-    next = new nRadixNode();
+  data_->nodes.reserve(2 + 2 * sorted.size());
+  data_->keys.reserve(2 + 2 * sorted.size());
+  const SortedNetwork* begin = sorted.data();
+  const SortedNetwork* end = begin + sorted.size();
+  for (uint32_t root : {RootIndex(Address::Family::IPV4), RootIndex(Address::Family::IPV6)}) {
+    const SortedNetwork* root_end = std::partition_point(begin, end, [root](const SortedNetwork& net) { return net.root == root; });
+    const SortedNetwork* mid = std::partition_point(begin, root_end, [](const SortedNetwork& net) { return Bit(net.key, 0) == 0; });
+    uint32_t left = BuildSubtree(begin, mid);
+    uint32_t right = BuildSubtree(mid, root_end);
+    data_->nodes[root].children = {left, right};
+    begin = root_end;
+  }
 
-    if (ntohll(*addr_p) & bit) {
-      node->right_ = next;
-    } else {
-      node->left_ = next;
+  for (const auto& net : sorted) {
+    if (net.root == RootIndex(Address::Family::IPV4)) {
+      InsertIPv4(static_cast<uint32_t>(net.key[0] >> 32), net.bits, net.network);
     }
+  }
+}
 
-    bit >>= 1;
-    node = next;
-
-    if (bit == 0) {
-      // We have walked all 128 bits, stop.
-      if (++i >= Address::kU64MaxLen) {
-        break;
-      }
+uint32_t NRadixTree::BuildSubtree(const SortedNetwork* begin, const SortedNetwork* end) {
+  if (begin == end) {
+    return kNone;
+  }
 
-      bit = 0x8000000000000000ULL;
-      if (network.bits() >= 64) {
-        addr_p++;
-        net_mask_p++;
-      }
-    }
+  // The subtree root is where the keys of the first and last networks diverge, as the ones in between share at least
+  // as many bits, unless the first network, which is then the shortest one, ends before.
+  size_t common = CommonPrefixLength(begin->key, (end - 1)->key, 128);
+  uint32_t node;
+  if (begin->bits <= common) {
+    common = begin->bits;
+    node = AddNode(begin->key, common, begin->network);
+    ++begin;
+  } else {
+    node = AddNode(KeyPrefix(begin->key, common), common, kNone);
   }
 
-  node->value_ = new IPNet(network);
-  return true;
+  const SortedNetwork* mid = std::partition_point(begin, end, [common](const SortedNetwork& net) { return Bit(net.key, common) == 0; });
+  uint32_t left = BuildSubtree(begin, mid);
+  uint32_t right = BuildSubtree(mid, end);
+  data_->nodes[node].children = {left, right};
+  return node;
 }
 
-IPNet NRadixTree::Find(const IPNet& network) const {
+bool NRadixTree::IsValidNetwork(const IPNet& network) {
   if (network.IsNull()) {
-    return {};
+    CLOG(ERROR) << "Cannot handle null IP networks in network tree";
+    return false;
   }
 
-  if (network.bits() == 0) {
-    CLOG(ERROR) << "Cannot handle CIDR " << network << " with /0, in network tree";
-    return {};
+  if (network.bits() < 1 || network.bits() > 128 || RootIndex(network.family()) == kNone) {
+    CLOG(ERROR) << "Cannot handle CIDR " << network << " with /" << network.bits() << " , in network tree";
+    return false;
   }
+  return true;
+}
 
-  const uint64_t* addr_p = network.address().u64_data();
-  const auto net_mask = network.net_mask_array();
-  const uint64_t* net_mask_p = net_mask.data();
-  uint64_t bit(0x8000000000000000ULL);
-
-  IPNet ret;
-  nRadixNode* node = this->root_;
-  size_t i = 0;
-  while (node) {
-    if (node->value_) {
-      ret = *node->value_;
-    }
+void NRadixTree::Clear() {
+  data_ = std::make_shared<Data>();
+  AddNode({0, 0}, 0, kNone);  // IPv4 root
+  AddNode({0, 0}, 0, kNone);  // IPv6 root
+}
 
-    if (ntohll(*addr_p) & bit) {
-      node = node->right_;
-    } else {
-      node = node->left_;
-    }
+void NRadixTree::Reserve(size_t num_networks) {
+  MakeDataUnique();
+  // Each network adds at most two nodes: its own, and one where it branches off.
+  data_->nodes.reserve(2 + 2 * num_networks);
+  data_->keys.reserve(2 + 2 * num_networks);
+  data_->networks.reserve(num_networks);
+}
 
-    // All network bits are traversed. If a supernet was found along the way, `ret` holds it,
-    // else there does not exist any supernet containing the search network/address.
-    if (!(*net_mask_p & bit)) {
+uint32_t NRadixTree::AddNode(const Key& key, size_t bits, uint32_t network) {
+  data_->nodes.push_back({static_cast<uint8_t>(bits), network, {kNone, kNone}});
+  data_->keys.push_back(key);
+  return static_cast<uint32_t>(data_->nodes.size() - 1);
+}
+
+bool NRadixTree::Insert(const IPNet& network) {
+  if (!IsValidNetwork(network)) {
+    return false;
+  }
+  MakeDataUnique();
+
+  size_t bits = network.bits();
+  uint32_t root = RootIndex(network.family());
+
+  const Key key = MakeKey(network.address(), bits);
+  const uint32_t network_index = static_cast<uint32_t>(data_->networks.size());
+
+  // Nodes are referred to by index, as adding nodes may reallocate the array.
+  uint32_t node = root;
+  while (true) {
+    if (data_->nodes[node].bits == bits) {
+      // Node already filled. Indicate that the new node was not actually inserted.
+      if (data_->nodes[node].network != kNone) {
+        CLOG(ERROR) << "CIDR " << network << " already exists";
+        return false;
+      }
+      data_->nodes[node].network = network_index;
+      data_->networks.push_back(network);
       break;
     }
 
-    bit >>= 1;
+    int branch = Bit(key, data_->nodes[node].bits);
+    uint32_t child = data_->nodes[node].children[branch];
+    if (child == kNone) {
+      uint32_t leaf = AddNode(key, bits, network_index);
+      data_->networks.push_back(network);
+      data_->nodes[node].children[branch] = leaf;
+      break;
+    }
 
-    if (bit == 0) {
-      // We have walked 128 bits, stop.
-      if (++i >= Address::kU64MaxLen) {
-        if (node && node->value_) {
-          ret = *node->value_;
-        }
-        break;
-      }
+    size_t child_bits = data_->nodes[child].bits;
+    size_t common = CommonPrefixLength(data_->keys[child], key, std::min(child_bits, bits));
+    if (common == child_bits) {
+      node = child;
+      continue;
+    }
 
-      bit = 0x8000000000000000ULL;
-      if (network.bits() >= 64) {
-        addr_p++;
-        net_mask_p++;
-      }
+    // The child and the new network diverge before the end of the child's prefix, so a node is needed where they
+    // do. This is the new network's node itself if it ends there.
+    Key split_key = MakeKey(network.address(), common);
+    uint32_t split;
+    if (common == bits) {
+      split = AddNode(split_key, common, network_index);
+      data_->networks.push_back(network);
+    } else {
+      split = AddNode(split_key, common, kNone);
+      uint32_t leaf = AddNode(key, bits, network_index);
+      data_->networks.push_back(network);
+      data_->nodes[split].children[Bit(key, common)] = leaf;
     }
+    data_->nodes[split].children[Bit(data_->keys[child], common)] = child;
+    data_->nodes[node].children[branch] = split;
+    break;
   }
 
-  return (network.family() == ret.family()) ? ret : IPNet();
-}
-
-IPNet NRadixTree::Find(const Address& addr) const {
-  return Find(IPNet(addr));
+  if (network.family() == Address::Family::IPV4) {
+    InsertIPv4(static_cast<uint32_t>(key[0] >> 32), bits, network_index);
+  }
+  return true;
 }
 
-void getAll(nRadixNode* node, std::vector<IPNet>& ret) {
-  if (!node) {
-    return;
+void NRadixTree::InsertIPv4(uint32_t address, size_t bits, uint32_t network) {
+  if (data_->ipv4_table.empty()) {
+    data_->ipv4_table.resize(1 << kIPv4FirstStride, 0);
   }
 
-  if (node->value_) {
-    ret.push_back(*node->value_);
-  }
+  // Walk down the levels until the one where the network spans a range of entries, creating the tables on the way.
+  // Entries are referred to by index, as adding tables may reallocate data_->ipv4_chunks.
+  uint32_t chunk = kNone;
+  size_t level_bits = kIPv4FirstStride;
+  size_t level_stride = kIPv4FirstStride;
+  while (true) {
+    size_t slot = (address >> (32 - level_bits)) & ((1U << level_stride) - 1);
+    if (bits <= level_bits) {
+      size_t num_slots = 1U << (level_bits - bits);
+      for (size_t i = 0; i < num_slots; i++) {
+        CoverIPv4Entry(chunk, slot + i, network, bits);
+      }
+      return;
+    }
 
-  getAll(node->left_, ret);
-  getAll(node->right_, ret);
+    uint32_t entry = IPv4Entry(chunk, slot);
+    if (!(entry & kIPv4Chunk)) {
+      // The new table inherits the network of the entry for all its own entries.
+      IPv4Chunk next;
+      next.fill(entry);
+      data_->ipv4_chunks.push_back(next);
+      entry = kIPv4Chunk | static_cast<uint32_t>(data_->ipv4_chunks.size() - 1);
+      IPv4Entry(chunk, slot) = entry;
+    }
+    chunk = entry & ~kIPv4Chunk;
+    level_bits += kIPv4Stride;
+    level_stride = kIPv4Stride;
+  }
 }
 
-std::vector<IPNet> NRadixTree::GetAll() const {
-  std::vector<IPNet> ret;
-  getAll(this->root_, ret);
-  return ret;
+void NRadixTree::CoverIPv4Entry(uint32_t chunk, size_t slot, uint32_t network, size_t bits) {
+  uint32_t entry = IPv4Entry(chunk, slot);
+  if (entry & kIPv4Chunk) {
+    for (size_t i = 0; i < std::tuple_size<IPv4Chunk>::value; i++) {
+      CoverIPv4Entry(entry & ~kIPv4Chunk, i, network, bits);
+    }
+  } else if (entry == 0 || data_->networks[entry - 1].bits() < bits) {
+    IPv4Entry(chunk, slot) = network + 1;
+  }
 }
 
-// Check if any subnet in n2's (sub-)tree is fully contained by a subnet in n1's (sub-)tree.
-bool isAnyIPNetSubsetUtil(Address::Family family, const nRadixNode* n1, const nRadixNode* n2,
-                          const IPNet* containing_net, const IPNet* contained_net) {
-  // If we have found networks from both trees belonging to same family, we have the answer.
-  if (containing_net && contained_net) {
-    if (family == Address::Family::UNKNOWN) {
-      if (containing_net->family() == contained_net->family()) {
-        return true;
-      }
-    } else {
-      if (containing_net->family() == family && contained_net->family() == family) {
-        return true;
-      }
+uint32_t NRadixTree::FindIndex(Address::Family family, const Key& key, size_t bits) const {
+  uint32_t node = RootIndex(family);
+  if (node == kNone) {
+    return kNone;
+  }
+
+  // Descend by looking at a single bit per node, without comparing the skipped bits, and remember the networks on
+  // the way. Nodes only match the key up to the first node whose prefix does not, so the smallest network containing
+  // the key is the last matching one among those.
+  std::array<uint32_t, 129> candidates;
+  size_t num_candidates = 0;
+  while (true) {
+    const Node& n = data_->nodes[node];
+    if (n.bits > bits) {
+      break;
+    }
+    candidates[num_candidates] = node;
+    num_candidates += n.network != kNone;
+    if (n.bits == bits) {
+      break;
+    }
+    node = n.children[Bit(key, n.bits)];
+    if (node == kNone) {
+      break;
     }
   }
 
-  // There are no more networks down the path in second tree, so stop.
-  if (!n2) {
-    return false;
+  while (num_candidates > 0) {
+    uint32_t candidate = candidates[--num_candidates];
+    const Node& n = data_->nodes[candidate];
+    if (CommonPrefixLength(data_->keys[candidate], key, n.bits) == n.bits) {
+      return n.network;
+    }
   }
+  return kNone;
+}
 
-  if (n1 && n1->value_) {
-    containing_net = n1->value_;
+IPNet NRadixTree::Find(const IPNet& network) const {
+  if (network.IsNull()) {
+    return {};
   }
 
-  if (n2->value_) {
-    contained_net = n2->value_;
+  if (network.bits() == 0) {
+    CLOG(ERROR) << "Cannot handle CIDR " << network << " with /0, in network tree";
+    return {};
   }
 
-  // If we find a network in first tree, that means it contains
-  // some subnet in network in n2 subtree. However, former may
-  // belong to IPv4 and later may belong to IPv6. Hence, continue
-  // finding the smaller network down the path.
+  uint32_t found = FindIndex(network.family(), MakeKey(network.address(), network.bits()), network.bits());
+  return found == kNone ? IPNet() : data_->networks[found];
+}
 
-  if (n1) {
-    return isAnyIPNetSubsetUtil(family, n1->left_, n2->left_, containing_net, contained_net) ||
-           isAnyIPNetSubsetUtil(family, n1->right_, n2->right_, containing_net, contained_net);
+IPNet NRadixTree::Find(const Address& addr) const {
+  if (addr.family() != Address::Family::IPV4) {
+    return Find(IPNet(addr));
   }
-  return isAnyIPNetSubsetUtil(family, nullptr, n2->left_, containing_net, contained_net) ||
-         isAnyIPNetSubsetUtil(family, nullptr, n2->right_, containing_net, contained_net);
-}
 
-bool NRadixTree::IsEmpty() const {
-  return root_->left_ == nullptr && root_->right_ == nullptr && root_->value_ == nullptr;
+  if (data_->ipv4_table.empty()) {
+    return {};
+  }
+  uint32_t address = static_cast<uint32_t>(ntohll(addr.u64_data()[0]) >> 32);
+  uint32_t entry = data_->ipv4_table[address >> kIPv4FirstStride];
+  if (entry & kIPv4Chunk) {
+    entry = data_->ipv4_chunks[entry & ~kIPv4Chunk][(address >> kIPv4Stride) & ((1U << kIPv4Stride) - 1)];
+    if (entry & kIPv4Chunk) {
+      entry = data_->ipv4_chunks[entry & ~kIPv4Chunk][address & ((1U << kIPv4Stride) - 1)];
+    }
+  }
+  return entry == 0 ? IPNet() : data_->networks[entry - 1];
 }
 
 bool NRadixTree::IsAnyIPNetSubset(const NRadixTree& other) const {
@@ -256,7 +382,15 @@ bool NRadixTree::IsAnyIPNetSubset(const NRadixTree& other) const {
 }
 
 bool NRadixTree::IsAnyIPNetSubset(Address::Family family, const NRadixTree& other) const {
-  return isAnyIPNetSubsetUtil(family, root_, other.root_, nullptr, nullptr);
+  for (const auto& network : other.data_->networks) {
+    if (family != Address::Family::UNKNOWN && network.family() != family) {
+      continue;
+    }
+    if (FindIndex(network.family(), MakeKey(network.address(), network.bits()), network.bits()) != kNone) {
+      return true;
+    }
+  }
+  return false;
 }
 
 }  // namespace collector
@@ -28,7 +28,10 @@
 
 #pragma once
 
-#include <mutex>
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <vector>
 
 #include "Logging.h"
 #include "NetworkConnection.h"
@@ -36,91 +39,130 @@
 
 namespace collector {
 
-struct nRadixNode {
-  nRadixNode() : value_(nullptr), left_(nullptr), right_(nullptr) {}
-  explicit nRadixNode(const IPNet& value) : value_(new IPNet(value)), left_(nullptr), right_(nullptr) {}
-
-  nRadixNode(const nRadixNode& other) : value_(nullptr), left_(nullptr), right_(nullptr) {
-    if (other.value_) {
-      value_ = new IPNet(*other.value_);
-    }
-    if (other.left_) {
-      left_ = new nRadixNode(*other.left_);
-    }
-    if (other.right_) {
-      right_ = new nRadixNode(*other.right_);
-    }
-  }
-
-  nRadixNode& operator=(const nRadixNode& other) {
-    if (this == &other) {
-      return *this;
-    }
-    auto* new_node = new nRadixNode(other);
-    std::swap(*new_node, *this);
-    delete new_node;
-    return *this;
-  }
-
-  ~nRadixNode() {
-    delete left_;
-    delete right_;
-    delete value_;
-  }
-
-  const IPNet* value_;
-  nRadixNode* left_;
-  nRadixNode* right_;
-};
-
+// NRadixTree stores IP networks and finds the smallest stored network containing a given address or network.
+//
+// It is a path-compressed binary trie (a.k.a. Patricia trie): a node only exists where stored networks branch off or
+// end, so a lookup visits at most one node per stored network containing the address, instead of one per bit. Nodes
+// and networks live in contiguous arrays and reference each other by index, which keeps the tree compact. These arrays
+// are shared by copies of the tree, and copied on write. IPv4 and IPv6 networks are stored in separate subtrees.
+//
+// Addresses are mostly IPv4, so IPv4 address lookups do not walk the tree, but use a multibit trie with strides of
+// 16, 8 and 8 bits (DIR-16-8-8): a 64k entries table indexed by the first 16 bits of the address, whose entries either
+// give the smallest network containing all addresses starting with these bits, or refer to a 256 entries table for
+// the next 8 bits, and so on. A lookup thus takes at most three memory accesses. The first level table is only
+// allocated if the tree holds IPv4 networks.
 class NRadixTree {
  public:
-  NRadixTree() : root_(new nRadixNode()) {}
-  explicit NRadixTree(const std::vector<IPNet>& networks) : root_(new nRadixNode()) {
-    for (const auto& network : networks) {
-      auto inserted = this->Insert(network);
-      if (!inserted) {
-        CLOG(ERROR) << "Failed to insert CIDR " << network << " in network tree";
-      }
-    }
-  }
-
-  NRadixTree(const NRadixTree& other) : root_(new nRadixNode(*other.root_)) {}
-
-  ~NRadixTree() {
-    // This calls the node destructor which in turn cleans up all the nodes.
-    delete root_;
-  }
-
-  NRadixTree& operator=(const NRadixTree& other) {
-    if (this == &other) {
-      return *this;
-    }
-    delete root_;
-    // This calls the node copy constructor which in turn copies all the nodes.
-    root_ = new nRadixNode(*other.root_);
-    return *this;
-  }
+  NRadixTree() { Clear(); }
+  // Copies share their data, so copying a tree is cheap. Moves are copies as well, such that moved-from trees remain
+  // valid.
+  NRadixTree(const NRadixTree& other) = default;
+  NRadixTree& operator=(const NRadixTree& other) = default;
+  // Builds a tree holding the given networks. This gives the same tree as inserting them one by one, but sorts them
+  // first and builds the tree in one pass instead, without ever revisiting a node.
+  explicit NRadixTree(const std::vector<IPNet>& networks);
 
   // Inserts a network into radix tree. If the network already exists, insertion is skipped.
   // This function does not guarantee thread safety.
-  bool Insert(const IPNet& network) const;
+  bool Insert(const IPNet& network);
   // Returns the smallest subnet larger than or equal to the queried network.
   // This function does not guarantee thread safety.
   IPNet Find(const IPNet& network) const;
   // Returns the smallest subnet larger than or equal to the queried address.
   // This function does not guarantee thread safety.
   IPNet Find(const Address& addr) const;
-  // Returns a vector of all the stored networks.
-  std::vector<IPNet> GetAll() const;
+  // Returns all the stored networks, in insertion order. The reference is valid until the tree is modified.
+  const std::vector<IPNet>& GetAll() const { return data_->networks; }
   // Tells whether the RadixTree contains no network.
-  bool IsEmpty() const;
+  bool IsEmpty() const { return data_->networks.empty(); }
+  // Returns the number of stored networks.
+  size_t size() const { return data_->networks.size(); }
+  // Allocates storage for the given number of networks upfront, so that inserting them does not reallocate.
+  void Reserve(size_t num_networks);
   // Determines whether any network in `other` is fully contained by any network in this tree.
   bool IsAnyIPNetSubset(const NRadixTree& other) const;
   // Determines whether any network in `other` is fully contained by any network in this tree, for a given family.
   bool IsAnyIPNetSubset(Address::Family family, const NRadixTree& other) const;
 
-  nRadixNode* root_;
+ private:
+  // Network prefixes are handled as 128-bit integers in host order, most significant bits first.
+  using Key = std::array<uint64_t, 2>;
+
+  static constexpr uint32_t kNone = ~static_cast<uint32_t>(0);
+
+  // Nodes only hold what is needed to walk down the tree, their prefix is kept apart in Data::keys, at the same index, as
+  // it is only looked at once the walk is over. This keeps nodes small enough for four of them to fit in a cache line.
+  struct Node {
+    uint8_t bits;
+    // Index of the network stored at this node in Data::networks, if any.
+    uint32_t network;
+    // Indices of the child nodes in Data::nodes, for the next bit being 0 and 1.
+    std::array<uint32_t, 2> children;
+  };
+
+  static Key MakeKey(const Address& address, size_t bits);
+  // Returns the `bits` first bits of the key, followed by zeros.
+  static Key KeyPrefix(Key key, size_t bits);
+  static int Bit(const Key& key, size_t i) {
+    return static_cast<int>((key[i / 64] >> (63 - i % 64)) & 1);
+  }
+  // Returns the length of the longest common prefix of a and b, up to max_bits.
+  static size_t CommonPrefixLength(const Key& a, const Key& b, size_t max_bits);
+  // Returns the index of the root node for the given family, or kNone if the family is not supported.
+  static uint32_t RootIndex(Address::Family family);
+
+  // IPv4 table entries hold either the index of a network in Data::networks plus one, zero for none, or the index of the
+  // next level table in Data::ipv4_chunks, flagged with kIPv4Chunk.
+  static constexpr uint32_t kIPv4Chunk = 1U << 31;
+  static constexpr size_t kIPv4FirstStride = 16;
+  static constexpr size_t kIPv4Stride = 8;
+  using IPv4Chunk = std::array<uint32_t, 1 << kIPv4Stride>;
+
+  // A network to build the tree with, see NRadixTree(const std::vector<IPNet>&).
+  struct SortedNetwork {
+    uint32_t root;
+    Key key;
+    size_t bits;
+    uint32_t network;
+  };
+
+  // Returns whether the network can be stored in the tree, logging why it cannot otherwise.
+  static bool IsValidNetwork(const IPNet& network);
+
+  void Clear();
+  // The following functions modify the data, which must not be shared, see MakeDataUnique().
+  uint32_t AddNode(const Key& key, size_t bits, uint32_t network);
+  // Builds the subtree holding the given networks, sorted by key and length, which all branch off the parent node the
+  // same way. Returns the index of its root, or kNone if there are no networks.
+  uint32_t BuildSubtree(const SortedNetwork* begin, const SortedNetwork* end);
+  void InsertIPv4(uint32_t address, size_t bits, uint32_t network);
+  // Makes `network` the value of the given IPv4 table entry and all entries below it, unless they already have a smaller
+  // network. `chunk` is kNone for the first level table.
+  void CoverIPv4Entry(uint32_t chunk, size_t slot, uint32_t network, size_t bits);
+  uint32_t& IPv4Entry(uint32_t chunk, size_t slot) {
+    return chunk == kNone ? data_->ipv4_table[slot] : data_->ipv4_chunks[chunk][slot];
+  }
+  // Returns the index of the smallest network containing the `bits` first bits of `key`, or kNone.
+  uint32_t FindIndex(Address::Family family, const Key& key, size_t bits) const;
+
+  struct Data {
+    std::vector<Node> nodes;
+    // The prefix shared by all networks below each node. Bits after the first `bits` ones are zero.
+    std::vector<Key> keys;
+    std::vector<IPNet> networks;
+    std::vector<uint32_t> ipv4_table;
+    std::vector<IPv4Chunk> ipv4_chunks;
+  };
+
+  // Gives this tree its own copy of the data, if it is shared with other trees, before modifying it.
+  void MakeDataUnique() {
+    if (data_.use_count() > 1) {
+      data_ = std::make_shared<Data>(*data_);
+    }
+  }
+
+  // Shared between copies of the tree, until one of them is modified.
+  std::shared_ptr<Data> data_;
 };
 
 }  // namespace collector
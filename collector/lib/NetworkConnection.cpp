@@ -6,17 +6,132 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 
+#include "Logging.h"
 #include "Process.h"
 
 namespace collector {
 
-bool Address::IsPublic() const {
-  for (const auto& net : PrivateNetworks(family_)) {
-    if (net.Contains(*this)) {
-      return false;
+namespace {
+
+// A range of addresses of a given class, as a mask and value to compare the address words with. Both are in network
+// byte order, like the address words.
+struct AddressRange {
+  std::array<uint64_t, Address::kU64MaxLen> mask;
+  std::array<uint64_t, Address::kU64MaxLen> value;
+  AddressClass address_class;
+  uint8_t bits;
+};
+
+// All families have the same number of ranges, unused ones never match, so that all addresses go through the
+// same sequence of compares.
+constexpr size_t kMaxAddressRanges = 9;
+using AddressRanges = std::array<AddressRange, kMaxAddressRanges>;
+
+constexpr uint64_t HostToNetwork64(uint64_t value) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  return __builtin_bswap64(value);
+#else
+  return value;
+#endif
+}
+
+constexpr uint64_t WordMask(size_t bits) {
+  return bits >= 64 ? ~static_cast<uint64_t>(0) : bits == 0 ? 0 : ~(~static_cast<uint64_t>(0) >> bits);
+}
+
+// Makes the range of the network whose address words are `high` and `low`, in host order.
+constexpr AddressRange MakeAddressRange(uint64_t high, uint64_t low, size_t bits, AddressClass address_class) {
+  uint64_t high_mask = WordMask(bits);
+  uint64_t low_mask = WordMask(bits > 64 ? bits - 64 : 0);
+  return {{HostToNetwork64(high_mask), HostToNetwork64(low_mask)},
+          {HostToNetwork64(high & high_mask), HostToNetwork64(low & low_mask)},
+          address_class,
+          static_cast<uint8_t>(bits)};
+}
+
+constexpr AddressRanges MakeAddressRanges(Address::Family family) {
+  // Zero mask and non-zero value, which no address matches.
+  AddressRanges ranges = {};
+  for (auto& range : ranges) {
+    range = {{0, 0}, {1, 1}, AddressClass::PUBLIC, 0};
+  }
+
+  // at() fails the compilation if a family has too many ranges.
+  size_t n = 0;
+  switch (family) {
+    case Address::Family::IPV4:
+      for (const auto& private_range : kPrivateIPv4Ranges) {
+        ranges.at(n++) = MakeAddressRange(static_cast<uint64_t>(private_range.address) << 32, 0, private_range.bits, AddressClass::PRIVATE);
+      }
+      ranges.at(n++) = MakeAddressRange(0x7f00000000000000ULL, 0, 8, AddressClass::LOCAL);
+      ranges.at(n++) = MakeAddressRange(0xffffffff00000000ULL, 0, 32, AddressClass::CANONICAL_EXTERNAL);
+      break;
+    case Address::Family::IPV6:
+      ranges.at(n++) = MakeAddressRange(0xfd00000000000000ULL, 0, 8, AddressClass::PRIVATE);  // ULA
+      for (const auto& private_range : kPrivateIPv4Ranges) {
+        // IPv4-mapped addresses.
+        ranges.at(n++) = MakeAddressRange(0, 0x0000ffff00000000ULL | private_range.address, 96 + private_range.bits, AddressClass::PRIVATE);
+      }
+      ranges.at(n++) = MakeAddressRange(0, 1, 128, AddressClass::LOCAL);
+      ranges.at(n++) = MakeAddressRange(0, 0x0000ffff7f000000ULL, 104, AddressClass::LOCAL);
+      ranges.at(n++) = MakeAddressRange(~0ULL, ~0ULL, 128, AddressClass::CANONICAL_EXTERNAL);
+      break;
+    default:
+      break;
+  }
+  return ranges;
+}
+
+// Indexed by family.
+constexpr std::array<AddressRanges, 3> kAddressRanges = {
+    MakeAddressRanges(Address::Family::UNKNOWN),
+    MakeAddressRanges(Address::Family::IPV4),
+    MakeAddressRanges(Address::Family::IPV6),
+};
+
+// The private ranges of the family with the most of them.
+constexpr size_t kNumPrivateRanges = kPrivateIPv4Ranges.size() + 1;
+static_assert(kAddressRanges[static_cast<size_t>(Address::Family::IPV6)][kNumPrivateRanges - 1].address_class == AddressClass::PRIVATE);
+static_assert(kAddressRanges[static_cast<size_t>(Address::Family::IPV6)][kNumPrivateRanges].address_class != AddressClass::PRIVATE);
+
+inline bool RangeContains(const AddressRange& range, const uint64_t* data) {
+  return ((data[0] & range.mask[0]) == range.value[0]) & ((data[1] & range.mask[1]) == range.value[1]);
+}
+
+}  // namespace
+
+void ClassifyAddresses(const Address* addresses, size_t count, AddressClass* classes) {
+  for (size_t i = 0; i < count; i++) {
+    const uint64_t* data = addresses[i].u64_data();
+    const auto& ranges = kAddressRanges[static_cast<size_t>(addresses[i].family())];
+    // The ranges of a family do not overlap, so at most one of them matches.
+    uint8_t address_class = 0;
+    for (const auto& range : ranges) {
+      uint8_t match = RangeContains(range, data);
+      address_class |= static_cast<uint8_t>(range.address_class) & -match;
     }
+    classes[i] = static_cast<AddressClass>(address_class);
+  }
+}
+
+bool IsPrivateNetwork(const IPNet& network) {
+  const Address address = network.address();
+  const uint64_t* data = address.u64_data();
+  bool is_private = false;
+  for (const auto& range : kAddressRanges[static_cast<size_t>(address.family())]) {
+    is_private |= RangeContains(range, data) & (range.address_class == AddressClass::PRIVATE) & (network.bits() >= range.bits);
+  }
+  return is_private;
+}
+
+bool Address::IsPublic() const {
+  // Private ranges come first, no need to look further.
+  const auto& ranges = kAddressRanges[static_cast<size_t>(family_)];
+  bool is_private = false;
+  for (size_t i = 0; i < kNumPrivateRanges; i++) {
+    is_private |= RangeContains(ranges[i], data_.data()) & (ranges[i].address_class == AddressClass::PRIVATE);
   }
-  return true;
+  return !is_private;
 }
 
 std::ostream& operator<<(std::ostream& os, L4Proto l4proto) {
@@ -7,6 +7,7 @@
 #define htonll(x) htobe64(x)
 #define ntohll(x) be64toh(x)
 
+#include <algorithm>
 #include <array>
 #include <cstring>
 #include <optional>
@@ -14,6 +15,7 @@
 #include <string>
 #include <vector>
 
+#include "ContainerId.h"
 #include "Hash.h"
 #include "Process.h"
 
@@ -162,6 +164,50 @@ class Address {
   Family family_;
 };
 
+// Private IPv4 networks, as their address in host order and prefix length. The private IPv6 networks are the unique
+// local addresses, and these networks mapped to IPv6, see PrivateIPv6Networks().
+struct PrivateIPv4Range {
+  uint32_t address;
+  uint8_t bits;
+};
+
+inline constexpr std::array<PrivateIPv4Range, 5> kPrivateIPv4Ranges = {{
+    {0x0a000000, 8},   // 10.0.0.0/8
+    {0x64400000, 10},  // 100.64.0.0/10
+    {0xa9fe0000, 16},  // 169.254.0.0/16
+    {0xac100000, 12},  // 172.16.0.0/12
+    {0xc0a80000, 16},  // 192.168.0.0/16
+}};
+
+// AddressClass tells the kind of network an address belongs to, as far as connection normalization is concerned.
+enum class AddressClass : uint8_t {
+  PUBLIC = 0,
+  // In one of PrivateNetworks().
+  PRIVATE,
+  // Loopback, see Address::IsLocal().
+  LOCAL,
+  // See Address::IsCanonicalExternalIp().
+  CANONICAL_EXTERNAL,
+};
+
+// ClassifyAddresses stores the class of addresses[i] in classes[i], for all i < count. Every address is compared with
+// all the known ranges of its family using the same masked word compares, without branching on the address, which
+// makes it much cheaper than the equivalent IsLocal()/IsPublic()/IsCanonicalExternalIp() calls for large batches.
+void ClassifyAddresses(const Address* addresses, size_t count, AddressClass* classes);
+
+inline AddressClass ClassifyAddress(const Address& address) {
+  AddressClass address_class;
+  ClassifyAddresses(&address, 1, &address_class);
+  return address_class;
+}
+
+class IPNet;
+
+// Returns whether the network is contained in one of PrivateNetworks().
+bool IsPrivateNetwork(const IPNet& network);
+
+// IPNet is stored in a packed form, as it makes up most of the size of the connections and endpoints held by the
+// connection tracker. Only the address is stored, the network prefix is derived from it when needed.
 class IPNet {
  public:
   // Parse the string representation of a network (<address>/<prefix>) or an address (<address>).
@@ -171,29 +217,27 @@ class IPNet {
   IPNet() : IPNet(Address(), 0, false) {}
   explicit IPNet(const Address& address) : IPNet(address, 8 * address.length(), true) {}
   IPNet(const Address& address, size_t bits, bool is_addr = false)
-      : address_(address), mask_({0, 0}), bits_(bits), is_addr_(is_addr) {
-    if (bits_ > Address::Length(address_.family()) * 8) {
-      bits_ = Address::Length(address_.family()) * 8;
-    }
-
-    size_t bits_left = bits_;
+      : data_(address.array()),
+        family_(address.family()),
+        bits_(static_cast<uint8_t>(std::min(bits, Address::Length(address.family()) * 8))),
+        is_addr_(is_addr) {}
 
-    const uint64_t* in_mask_p = address.array().data();
-    uint64_t* out_mask_p = mask_.data();
+  Address::Family family() const { return family_; }
 
-    while (bits_left >= 64) {
-      *out_mask_p++ = *in_mask_p++;
-      bits_left -= 64;
+  // Returns the network prefix of the address, with the last uint64 intentionally in *host* order.
+  const std::array<uint64_t, Address::kU64MaxLen> mask_array() const {
+    std::array<uint64_t, Address::kU64MaxLen> mask = {0, 0};
+    size_t i = 0;
+    size_t bits_left = bits_;
+    for (; bits_left >= 64; bits_left -= 64, i++) {
+      mask[i] = data_[i];
     }
-
     if (bits_left > 0) {
-      uint64_t last_mask = ~(~static_cast<uint64_t>(0) >> bits_left);
-      *out_mask_p = ntohll(*in_mask_p) & last_mask;  // last uint64 is intentionally stored in *host* order
+      mask[i] = ntohll(data_[i]) & ~(~static_cast<uint64_t>(0) >> bits_left);
     }
+    return mask;
   }
 
-  Address::Family family() const { return address_.family(); }
-  const std::array<uint64_t, Address::kU64MaxLen>& mask_array() const { return mask_; }
   const std::array<uint64_t, Address::kU64MaxLen> net_mask_array() const {
     if (bits_ < 64) {
       return {~(0xFFFFFFFFFFFFFFFFULL >> bits_), 0ULL};
@@ -207,24 +251,24 @@ class IPNet {
   size_t bits() const { return bits_; }
 
   bool Contains(const Address& address) const {
-    if (address.family() != address_.family()) {
+    if (address.family() != family_) {
       return false;
     }
 
     const uint64_t* addr_p = address.u64_data();
-    const uint64_t* mask_p = mask_.data();
+    const uint64_t* data_p = data_.data();
 
     size_t bitsLeft = bits_;
     while (bitsLeft >= 64) {
-      if (*addr_p++ != *mask_p++) {
+      if (*addr_p++ != *data_p++) {
         return false;
       }
       bitsLeft -= 64;
     }
 
     if (bitsLeft > 0) {
-      uint64_t lastMask = ~(~static_cast<uint64_t>(0) >> bitsLeft);
-      if ((ntohll(*addr_p) & lastMask) != *mask_p) {
+      uint64_t lastMask = htonll(~(~static_cast<uint64_t>(0) >> bitsLeft));
+      if (((*addr_p ^ *data_p) & lastMask) != 0) {
         return false;
       }
     }
@@ -232,19 +276,19 @@ class IPNet {
     return true;
   }
 
-  const Address& address() const {
-    return address_;
+  Address address() const {
+    return Address(family_, data_);
   }
 
   size_t Hash() const {
     if (is_addr_) {
-      return HashAll(address_.array(), mask_, bits_);
+      return HashAll(data_, bits_);
     }
-    return HashAll(mask_, bits_);
+    return HashAll(mask_array(), bits_);
   }
 
   bool IsNull() const {
-    return bits_ == 0 && address_.IsNull();
+    return bits_ == 0 && data_[0] == 0 && data_[1] == 0;
   }
 
   bool IsAddress() const {
@@ -256,9 +300,9 @@ class IPNet {
       return false;
     }
     if (is_addr_) {
-      return address_ == other.address_;
+      return family_ == other.family_ && data_ == other.data_;
     }
-    return mask_ == other.mask_;
+    return mask_array() == other.mask_array();
   }
 
   bool operator!=(const IPNet& other) const {
@@ -269,70 +313,84 @@ class IPNet {
     if (bits_ != that.bits_) {
       return bits_ > that.bits_;
     }
-    return address_ > that.address_;
+    return address() > that.address();
   }
 
  private:
   friend std::ostream& operator<<(std::ostream& os, const IPNet& net) {
-    return os << net.address_ << "/" << net.bits_;
+    return os << net.address() << "/" << static_cast<int>(net.bits_);
   }
 
-  Address address_;
-  std::array<uint64_t, Address::kU64MaxLen> mask_;
-  size_t bits_;
+  std::array<uint64_t, Address::kU64MaxLen> data_;
+  Address::Family family_;
+  uint8_t bits_;
   bool is_addr_;
 };
 
+static_assert(sizeof(IPNet) == 24, "IPNet is expected to be packed in 24 bytes");
+
+// Endpoint stores the fields of its network itself rather than an IPNet, so that the port fits in what would
+// otherwise be the padding of the IPNet.
 class Endpoint {
  public:
-  Endpoint() : port_(0) {}
-  Endpoint(const Address& address, unsigned short port) : network_(IPNet(address)), port_(port) {}
-  Endpoint(const IPNet& network, unsigned short port) : network_(network), port_(port) {}
+  Endpoint() : Endpoint(IPNet(), 0) {}
+  Endpoint(const Address& address, unsigned short port) : Endpoint(IPNet(address), port) {}
+  Endpoint(const IPNet& network, unsigned short port)
+      : data_(network.address().array()),
+        family_(network.family()),
+        bits_(static_cast<uint8_t>(network.bits())),
+        is_addr_(network.IsAddress()),
+        port_(port) {}
 
   size_t Hash() const {
-    return HashAll(network_, port_);
+    return HashAll(network(), port_);
   }
 
   bool operator==(const Endpoint& other) const {
-    return port_ == other.port_ && network_ == other.network_;
+    return port_ == other.port_ && network() == other.network();
   }
 
   bool operator!=(const Endpoint& other) const {
     return !(*this == other);
   }
 
-  const IPNet& network() const { return network_; }
-  Address address() const { return network_.address(); }
+  IPNet network() const { return IPNet(address(), bits_, is_addr_); }
+  Address address() const { return Address(family_, data_); }
   uint16_t port() const { return port_; }
 
   bool IsNull() const {
-    return port_ == 0 && network_.IsNull();
+    return port_ == 0 && bits_ == 0 && data_[0] == 0 && data_[1] == 0;
   }
 
  private:
   friend std::ostream& operator<<(std::ostream& os, const Endpoint& ep) {
     // This is an individual IP address.
-    if (ep.network_.bits() == 8 * ep.network_.address().length()) {
-      if (ep.network_.family() == Address::Family::IPV6) {
-        os << "[" << ep.network_.address() << "]";
+    if (ep.bits_ == 8 * ep.address().length()) {
+      if (ep.family_ == Address::Family::IPV6) {
+        os << "[" << ep.address() << "]";
       } else {
-        os << ep.network_.address();
+        os << ep.address();
       }
     } else {
       // Represent network in /nn notation.
-      if (ep.network_.family() == Address::Family::IPV6) {
-        os << "[" << ep.network_ << "]";
+      if (ep.family_ == Address::Family::IPV6) {
+        os << "[" << ep.network() << "]";
       } else {
-        os << ep.network_;
+        os << ep.network();
       }
     }
-    return os << ":" << ep.port_;
+    return os << ":" << ep.port();
   }
 
-  IPNet network_;
+  std::array<uint64_t, Address::kU64MaxLen> data_;
+  Address::Family family_;
+  uint8_t bits_;
+  bool is_addr_;
   uint16_t port_;
 };
 
+static_assert(sizeof(Endpoint) == sizeof(IPNet), "Endpoint is expected to be packed in the same size as IPNet");
+
 enum class L4Proto : uint8_t {
   UNKNOWN = 0,
   TCP,
@@ -346,10 +404,11 @@ size_t Hash(const L4ProtoPortPair& pp);
 
 class ContainerEndpoint {
  public:
-  ContainerEndpoint(std::string container, const Endpoint& endpoint, L4Proto l4proto, std::shared_ptr<IProcess> originator)
-      : container_(std::move(container)), endpoint_(endpoint), l4proto_(l4proto), originator_(originator) {}
+  ContainerEndpoint(ContainerId container, const Endpoint& endpoint, L4Proto l4proto, std::shared_ptr<IProcess> originator)
+      : container_(container), endpoint_(endpoint), l4proto_(l4proto), originator_(std::move(originator)) {}
 
-  const std::string& container() const { return container_; }
+  const std::string& container() const { return container_.str(); }
+  ContainerId container_id() const { return container_; }
   const Endpoint& endpoint() const { return endpoint_; }
   const L4Proto l4proto() const { return l4proto_; }
   const std::shared_ptr<IProcess> originator() const { return originator_; }
@@ -369,7 +428,7 @@ class ContainerEndpoint {
   size_t Hash() const { return HashAll(container_, endpoint_, l4proto_); }
 
  private:
-  std::string container_;
+  ContainerId container_;
   Endpoint endpoint_;
   L4Proto l4proto_;
   std::shared_ptr<IProcess> originator_;
@@ -380,10 +439,11 @@ std::ostream& operator<<(std::ostream& os, const ContainerEndpoint& container_en
 class Connection {
  public:
   Connection() : flags_(0) {}
-  Connection(std::string container, const Endpoint& local, const Endpoint& remote, L4Proto l4proto, bool is_server)
-      : container_(std::move(container)), local_(local), remote_(remote), flags_((static_cast<uint8_t>(l4proto) << 1) | ((is_server) ? 1 : 0)) {}
+  Connection(ContainerId container, const Endpoint& local, const Endpoint& remote, L4Proto l4proto, bool is_server)
+      : container_(container), local_(local), remote_(remote), flags_((static_cast<uint8_t>(l4proto) << 1) | ((is_server) ? 1 : 0)) {}
 
-  const std::string& container() const { return container_; }
+  const std::string& container() const { return container_.str(); }
+  ContainerId container_id() const { return container_; }
   const Endpoint& local() const { return local_; }
   const Endpoint& remote() const { return remote_; }
   bool is_server() const { return (flags_ & 0x1) != 0; }
@@ -400,12 +460,14 @@ class Connection {
   size_t Hash() const { return HashAll(container_, local_, remote_, flags_); }
 
  private:
-  std::string container_;
+  ContainerId container_;
   Endpoint local_;
   Endpoint remote_;
   uint8_t flags_;
 };
 
+static_assert(sizeof(Connection) <= 64, "Connection is expected to fit in a cache line");
+
 std::ostream& operator<<(std::ostream& os, const Connection& conn);
 
 // Checks if the given connection is relevant (i.e., it is a connection with a remote address that is
@@ -440,13 +502,13 @@ inline int IsEphemeralPort(uint16_t port) {
 
 // PrivateIPv4Networks return private IPv4 networks.
 static inline const std::vector<IPNet>& PrivateIPv4Networks() {
-  static auto* networks = new std::vector<IPNet>{
-      IPNet(Address(10, 0, 0, 0), 8),
-      IPNet(Address(100, 64, 0, 0), 10),
-      IPNet(Address(169, 254, 0, 0), 16),
-      IPNet(Address(172, 16, 0, 0), 12),
-      IPNet(Address(192, 168, 0, 0), 16),
-  };
+  static auto* networks = []() {
+    auto* networks = new std::vector<IPNet>();
+    for (const auto& range : kPrivateIPv4Ranges) {
+      networks->emplace_back(Address(htonl(range.address)), range.bits);
+    }
+    return networks;
+  }();
 
   return *networks;
 }
@@ -8,16 +8,22 @@ namespace collector {
 
 constexpr char NetworkConnectionInfoServiceComm::kHostnameMetadataKey[];
 constexpr char NetworkConnectionInfoServiceComm::kCapsMetadataKey[];
+constexpr char NetworkConnectionInfoServiceComm::kSensorCapsMetadataKey[];
 constexpr char NetworkConnectionInfoServiceComm::kSupportedCaps[];
+constexpr char NetworkConnectionInfoServiceComm::kStringDictionaryCap[];
 
 std::unique_ptr<grpc::ClientContext> NetworkConnectionInfoServiceComm::CreateClientContext() const {
   auto ctx = std::make_unique<grpc::ClientContext>();
   ctx->AddMetadata(kHostnameMetadataKey, HostInfo::GetHostname());
-  ctx->AddMetadata(kCapsMetadataKey, kSupportedCaps);
+  ctx->AddMetadata(kCapsMetadataKey, caps_);
   return ctx;
 }
 
-NetworkConnectionInfoServiceComm::NetworkConnectionInfoServiceComm(std::shared_ptr<grpc::Channel> channel) : channel_(std::move(channel)) {
+NetworkConnectionInfoServiceComm::NetworkConnectionInfoServiceComm(std::shared_ptr<grpc::Channel> channel, bool string_dictionary)
+    : channel_(std::move(channel)), caps_(kSupportedCaps) {
+  if (string_dictionary) {
+    caps_.append(",").append(kStringDictionaryCap);
+  }
   if (channel_) {
     stub_ = sensor::NetworkConnectionInfoService::NewStub(channel_);
   }
@@ -59,4 +65,22 @@ std::unique_ptr<IDuplexClientWriter<sensor::NetworkConnectionInfoMessage>> Netwo
   }
 }
 
+bool NetworkConnectionInfoServiceComm::StringDictionaryAcknowledged() {
+  WITH_LOCK(context_mutex_) {
+    if (!channel_ || !context_) {
+      return false;
+    }
+
+    auto [begin, end] = context_->GetServerInitialMetadata().equal_range(kSensorCapsMetadataKey);
+    for (auto it = begin; it != end; ++it) {
+      for (const auto& cap : SplitStringView(std::string_view(it->second.data(), it->second.length()), ',')) {
+        if (cap == kStringDictionaryCap) {
+          return true;
+        }
+      }
+    }
+  }
+  return false;
+}
+
 }  // namespace collector
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <memory>
+#include <string>
 
 #include <grpc/grpc.h>
 #include <grpcpp/channel.h>
@@ -28,11 +29,17 @@ class INetworkConnectionInfoServiceComm {
   virtual sensor::NetworkConnectionInfoService::StubInterface* GetStub() = 0;
 
   virtual std::unique_ptr<IDuplexClientWriter<sensor::NetworkConnectionInfoMessage>> PushNetworkConnectionInfoOpenStream(std::function<void(const sensor::NetworkFlowsControlMessage*)> receive_func) = 0;
+
+  // Whether Sensor accepted the string dictionary capability for the current stream. Only known once a control message
+  // was received on the stream, as Sensor tells it in the initial metadata of its response.
+  virtual bool StringDictionaryAcknowledged() = 0;
 };
 
 class NetworkConnectionInfoServiceComm : public INetworkConnectionInfoServiceComm {
  public:
-  NetworkConnectionInfoServiceComm(std::shared_ptr<grpc::Channel> channel);
+  // With string_dictionary, Sensor is told that the strings of the messages may be encoded with a
+  // StringDictionaryEncoder, which they only are if it acknowledges it, see StringDictionaryAcknowledged().
+  NetworkConnectionInfoServiceComm(std::shared_ptr<grpc::Channel> channel, bool string_dictionary = false);
 
   void ResetClientContext() override;
   bool WaitForConnectionReady(const std::function<bool()>& check_interrupted) override;
@@ -44,16 +51,23 @@ class NetworkConnectionInfoServiceComm : public INetworkConnectionInfoServiceCom
 
   std::unique_ptr<IDuplexClientWriter<sensor::NetworkConnectionInfoMessage>> PushNetworkConnectionInfoOpenStream(std::function<void(const sensor::NetworkFlowsControlMessage*)> receive_func) override;
 
+  bool StringDictionaryAcknowledged() override;
+
  private:
   static constexpr char kHostnameMetadataKey[] = "rox-collector-hostname";
   static constexpr char kCapsMetadataKey[] = "rox-collector-capabilities";
+  // Sensor lists the capabilities it accepts in the initial metadata of its response, in the same format.
+  static constexpr char kSensorCapsMetadataKey[] = "rox-sensor-capabilities";
 
   // Keep this updated with all capabilities supported. Format it as a comma-separated list with NO spaces.
   static constexpr char kSupportedCaps[] = "public-ips,network-graph-external-srcs";
+  // Only advertised when enabled, as it changes the content of the messages.
+  static constexpr char kStringDictionaryCap[] = "string-dictionary";
 
   std::unique_ptr<grpc::ClientContext> CreateClientContext() const;
 
   std::shared_ptr<grpc::Channel> channel_;
+  std::string caps_;
   std::unique_ptr<sensor::NetworkConnectionInfoService::Stub> stub_;
 
   std::mutex context_mutex_;
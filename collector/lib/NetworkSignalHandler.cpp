@@ -44,7 +44,7 @@ EventMap<Modifier> modifiers = {
 }  // namespace
 
 NetworkSignalHandler::NetworkSignalHandler(sinsp* inspector, std::shared_ptr<ConnectionTracker> conn_tracker, system_inspector::Stats* stats)
-    : event_extractor_(std::make_unique<system_inspector::EventExtractor>()), conn_tracker_(std::move(conn_tracker)), stats_(stats), collect_connection_status_(true), track_send_recv_(false) {
+    : event_extractor_(std::make_unique<system_inspector::EventExtractor>()), conn_tracker_(std::move(conn_tracker)), conn_updates_(conn_tracker_), stats_(stats), collect_connection_status_(true), track_send_recv_(false) {
   event_extractor_->Init(inspector);
 }
 
@@ -151,7 +151,9 @@ SignalHandler::Result NetworkSignalHandler::HandleSignal(sinsp_evt* evt) {
     return SignalHandler::IGNORED;
   }
 
-  conn_tracker_->UpdateConnection(*result, evt->get_ts() / 1000UL, modifier == Modifier::ADD);
+  // Updates are batched to reduce contention on the tracker. They are applied at the latest when the tracker state is
+  // fetched.
+  conn_updates_.UpdateConnection(*result, evt->get_ts() / 1000UL, modifier == Modifier::ADD);
   return SignalHandler::PROCESSED;
 }
 
@@ -190,6 +192,7 @@ std::vector<std::string> NetworkSignalHandler::GetRelevantEvents() {
 }
 
 bool NetworkSignalHandler::Stop() {
+  conn_updates_.Flush();
   event_extractor_->ClearWrappers();
   return true;
 }
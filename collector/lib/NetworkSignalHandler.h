@@ -34,6 +34,7 @@ class NetworkSignalHandler final : public SignalHandler {
 
   std::unique_ptr<system_inspector::EventExtractor> event_extractor_;
   std::shared_ptr<ConnectionTracker> conn_tracker_;
+  ConnectionUpdateBuffer conn_updates_;
   system_inspector::Stats* stats_;
 
   bool collect_connection_status_;
@@ -72,14 +72,14 @@ bool NetworkStatusInspector::shouldNormalize(const QueryParams& query_params) co
 }
 
 bool NetworkStatusInspector::handleGetEndpoints(struct mg_connection* conn, const QueryParams& query_params) {
-  collector::AdvertisedEndpointMap endpoint_states = conntracker_->FetchEndpointState(shouldNormalize(query_params), false);
+  auto endpoint_states = conntracker_->GetEndpointStateSnapshot(shouldNormalize(query_params));
   Json::Value body_root(Json::objectValue);
 
-  std::unordered_map<std::string, std::forward_list<collector::ContainerEndpointMap::value_type*>> by_container;
+  std::unordered_map<std::string, std::forward_list<const collector::AdvertisedEndpointMap::value_type*>> by_container;
 
   std::optional<std::string> container_filter = GetParameter(query_params, kQueryParam_container);
 
-  for (auto& endpoint_state : endpoint_states) {
+  for (const auto& endpoint_state : *endpoint_states) {
     if (!container_filter || *container_filter == endpoint_state.first.container()) {
       by_container[endpoint_state.first.container()].push_front(&endpoint_state);
     }
@@ -119,14 +119,14 @@ bool NetworkStatusInspector::handleGetEndpoints(struct mg_connection* conn, cons
 }
 
 bool NetworkStatusInspector::handleGetConnections(struct mg_connection* conn, const QueryParams& query_params) {
-  collector::ConnMap connection_states = conntracker_->FetchConnState(shouldNormalize(query_params), false);
+  auto connection_states = conntracker_->GetConnStateSnapshot(shouldNormalize(query_params));
   Json::Value body_root(Json::objectValue);
 
-  std::unordered_map<std::string, std::forward_list<collector::ConnMap::value_type*>> by_container;
+  std::unordered_map<std::string, std::forward_list<const collector::ConnMap::value_type*>> by_container;
 
   std::optional<std::string> container_filter = GetParameter(query_params, kQueryParam_container);
 
-  for (auto& connection_state : connection_states) {
+  for (const auto& connection_state : *connection_states) {
     if (!container_filter || *container_filter == connection_state.first.container()) {
       by_container[connection_state.first.container()].push_front(&connection_state);
     }
@@ -1,11 +1,14 @@
 #include "NetworkStatusNotifier.h"
 
+#include <google/protobuf/io/coded_stream.h>
 #include <google/protobuf/util/time_util.h>
 
 #include "CollectorStats.h"
 #include "DuplexGRPC.h"
 #include "GRPCUtil.h"
+#include "Hash.h"
 #include "Logging.h"
+#include "NRadix.h"
 #include "Profiler.h"
 #include "ProtoUtil.h"
 #include "RateLimit.h"
@@ -42,19 +45,18 @@ sensor::SocketFamily TranslateAddressFamily(Address::Family family) {
 
 }  // namespace
 
-std::vector<IPNet> readNetworks(const std::string& networks, Address::Family family) {
-  int tuple_size = Address::Length(family) + 1;
-  int num_nets = networks.size() / tuple_size;
-  std::vector<IPNet> ip_nets;
-  ip_nets.reserve(num_nets);
-  for (int i = 0; i < num_nets; i++) {
+// Appends the networks packed in `networks` to `out`, decoding them straight from the received buffer. Each network is
+// made of the address bytes, followed by the prefix length in one byte.
+void readNetworks(const std::string& networks, Address::Family family, std::vector<IPNet>* out) {
+  size_t address_size = Address::Length(family);
+  size_t tuple_size = address_size + 1;
+  const char* data = networks.data();
+  for (size_t offset = 0; offset + tuple_size <= networks.size(); offset += tuple_size) {
     // Bytes are received in big-endian order.
     std::array<uint64_t, Address::kU64MaxLen> ip = {};
-    std::memcpy(&ip, &networks.c_str()[tuple_size * i], Address::Length(family));
-    IPNet net(Address(family, ip), static_cast<int>(networks.c_str()[tuple_size * i + tuple_size - 1]));
-    ip_nets.push_back(net);
+    std::memcpy(&ip, data + offset, address_size);
+    out->emplace_back(Address(family, ip), static_cast<uint8_t>(data[offset + address_size]));
   }
-  return ip_nets;
 }
 
 void NetworkStatusNotifier::OnRecvControlMessage(const sensor::NetworkFlowsControlMessage* msg) {
@@ -67,6 +69,10 @@ void NetworkStatusNotifier::OnRecvControlMessage(const sensor::NetworkFlowsContr
   if (msg->has_ip_networks()) {
     ReceiveIPNetworks(msg->ip_networks());
   }
+  if (config_.NetworkStringDictionary() && !string_dictionary_acked_ && comm_->StringDictionaryAcknowledged()) {
+    CLOG(INFO) << "Sensor acknowledged the string dictionary";
+    string_dictionary_acked_ = true;
+  }
 }
 
 void NetworkStatusNotifier::ReceivePublicIPs(const sensor::IPAddressList& public_ips) {
@@ -90,23 +96,38 @@ void NetworkStatusNotifier::ReceivePublicIPs(const sensor::IPAddressList& public
 }
 
 void NetworkStatusNotifier::ReceiveIPNetworks(const sensor::IPNetworkList& networks) {
-  UnorderedMap<Address::Family, std::vector<IPNet>> known_ip_networks;
+  // Control messages carry the whole list of networks, which seldom changes from one to the next. Skip rebuilding the
+  // tree then.
+  size_t networks_hash = HashAll(networks.ipv4_networks(), networks.ipv6_networks());
+  if (known_ip_networks_hash_ && *known_ip_networks_hash_ == networks_hash) {
+    CLOG(DEBUG) << "Received unchanged known IP networks";
+    return;
+  }
+  known_ip_networks_hash_ = networks_hash;
+
+  // Networks of both families are built into the tree at once, which logs the invalid ones and skips them.
+  std::vector<IPNet> known_ip_networks;
+  std::vector<Address::Family> families;
   auto ipv4_networks_size = networks.ipv4_networks().size();
-  if (ipv4_networks_size % 5 != 0) {
+  bool ipv4_valid = ipv4_networks_size % 5 == 0;
+  auto ipv6_networks_size = networks.ipv6_networks().size();
+  bool ipv6_valid = ipv6_networks_size % 17 == 0;
+  known_ip_networks.reserve((ipv4_valid ? ipv4_networks_size / 5 : 0) + (ipv6_valid ? ipv6_networks_size / 17 : 0));
+
+  if (!ipv4_valid) {
     CLOG(WARNING) << "IPv4 network field has incorrect length (" << ipv4_networks_size << "). Ignoring IPv4 networks...";
   } else {
-    std::vector<IPNet> ipv4_networks = readNetworks(networks.ipv4_networks(), Address::Family::IPV4);
-    known_ip_networks[Address::Family::IPV4] = ipv4_networks;
+    readNetworks(networks.ipv4_networks(), Address::Family::IPV4, &known_ip_networks);
+    families.push_back(Address::Family::IPV4);
   }
 
-  auto ipv6_networks_size = networks.ipv6_networks().size();
-  if (ipv6_networks_size % 17 != 0) {
+  if (!ipv6_valid) {
     CLOG(WARNING) << "IPv6 network field has incorrect length (" << ipv6_networks_size << "). Ignoring IPv6 networks...";
   } else {
-    std::vector<IPNet> ipv6_networks = readNetworks(networks.ipv6_networks(), Address::Family::IPV6);
-    known_ip_networks[Address::Family::IPV6] = ipv6_networks;
+    readNetworks(networks.ipv6_networks(), Address::Family::IPV6, &known_ip_networks);
+    families.push_back(Address::Family::IPV6);
   }
-  conn_tracker_->UpdateKnownIPNetworks(std::move(known_ip_networks));
+  conn_tracker_->UpdateKnownIPNetworks(NRadixTree(known_ip_networks), families);
 }
 
 void NetworkStatusNotifier::Run() {
@@ -115,6 +136,7 @@ void NetworkStatusNotifier::Run() {
 
   while (thread_.PauseUntil(next_attempt)) {
     comm_->ResetClientContext();
+    string_dictionary_acked_ = false;
 
     if (!comm_->WaitForConnectionReady([this] { return thread_.should_stop(); })) {
       break;
@@ -195,12 +217,11 @@ void NetworkStatusNotifier::ReportConnectionStats() {
   }
 }
 
-bool NetworkStatusNotifier::UpdateAllConnsAndEndpoints() {
+bool NetworkStatusNotifier::UpdateAllConnsAndEndpoints(int64_t ts) {
   if (config_.TurnOffScrape()) {
     return true;
   }
 
-  int64_t ts = NowMicros();
   std::vector<Connection> all_conns;
   std::vector<ContainerEndpoint> all_listen_endpoints;
   WITH_TIMER(CollectorStats::net_scrape_read) {
@@ -220,109 +241,332 @@ bool NetworkStatusNotifier::UpdateAllConnsAndEndpoints() {
 void NetworkStatusNotifier::RunSingle(IDuplexClientWriter<sensor::NetworkConnectionInfoMessage>* writer) {
   WaitUntilWriterStarted(writer, 10);
 
+  // Each scrape request yields exactly one scrape, then one (possibly null) message. Requests hold the time they were
+  // made at, which the scraped connections and endpoints are stamped with, whatever the delay before the scrape thread
+  // picks them up. Requests are skipped rather than queued while a scrape is pending, as the next scrape will catch up
+  // with all the changes anyway. Messages are not skipped, since each holds the changes since the previous one, so the
+  // stages producing them wait for room instead.
+  BoundedQueue<int64_t> scrape_requests(1);
+  BoundedQueue<bool> scrapes(1);
+  BoundedQueue<PendingMessage> messages(1);
+  BoundedQueue<MessageAllocator*> free_allocators(message_allocators_.size());
+  ResetStringDictionary();
+  // Messages are bounded when limits are set, and so is the memory their allocators need to keep.
+  bool bounded_messages = config_.NetworkMessageMaxEntries() != 0 || config_.NetworkMessageMaxBytes() != 0;
+  for (auto& allocator : message_allocators_) {
+    allocator.EnablePoolGrowth(!bounded_messages);
+    free_allocators.Push(&allocator);
+  }
+
+  auto close_queues = [&] {
+    scrape_requests.Close();
+    scrapes.Close();
+    messages.Close();
+    free_allocators.Close();
+  };
+
+  if (!scrape_thread_.Start([&] { RunScrapeStage(&scrape_requests, &scrapes); })) {
+    CLOG(ERROR) << "Failed to start the network scrape thread";
+    return;
+  }
+  if (!delta_thread_.Start([&] { RunDeltaStage(&scrapes, &free_allocators, &messages); })) {
+    CLOG(ERROR) << "Failed to start the network delta thread";
+    close_queues();
+    scrape_thread_.Stop();
+    return;
+  }
+
+  RunWriteStage(writer, &scrape_requests, &messages, &free_allocators);
+
+  close_queues();
+  scrape_thread_.Stop();
+  delta_thread_.Stop();
+}
+
+void NetworkStatusNotifier::RunScrapeStage(BoundedQueue<int64_t>* scrape_requests, BoundedQueue<bool>* scrapes) {
+  Profiler::RegisterCPUThread();
+
+  while (auto scrape_time = scrape_requests->Pop()) {
+    bool scraped = false;
+    if (auto stage_timer = internal::scoped_timer(stage_stats_.get(), SCRAPE_STAGE)) {
+      scraped = UpdateAllConnsAndEndpoints(*scrape_time);
+    }
+
+    if (scraped) {
+      ReportConnectionStats();
+    } else {
+      CLOG(DEBUG) << "No connection or endpoint to report";
+    }
+
+    if (!scrapes->Push(scraped)) {
+      return;
+    }
+  }
+}
+
+void NetworkStatusNotifier::RunDeltaStage(BoundedQueue<bool>* scrapes, BoundedQueue<MessageAllocator*>* free_allocators, BoundedQueue<PendingMessage>* messages) {
+  Profiler::RegisterCPUThread();
+
+  // Each stream starts from scratch, as Sensor knows none of the connections reported on the previous ones, and some
+  // of them may have been lost with the messages which failed to be written.
   ConnMap old_conn_state;
+  ReportedConnState reported_conn_state;
   AdvertisedEndpointMap old_cep_state;
-  auto next_scrape = std::chrono::system_clock::now();
+  conn_tracker_->ResetChangeTracking();
   int64_t time_at_last_scrape = NowMicros();
 
-  bool prevEnableExternalIPs = config_.EnableExternalIPs();
+  // Connections newly tracked between two scrapes, be it from events or from the scrape, tell about the churn in
+  // between, unlike the updates of connections scraped again and again.
+  auto count_inserted_connections = [this]() -> unsigned int {
+    ConnectionTracker::Stats inserted = conn_tracker_->GetConnectionStats_NewConnectionCounters();
+    return inserted.inbound.private_ + inserted.inbound.public_ + inserted.outbound.private_ + inserted.outbound.public_;
+  };
+  unsigned int inserted_at_last_scrape = count_inserted_connections();
 
-  while (writer->Sleep(next_scrape)) {
-    CLOG(DEBUG) << "Starting network status notification";
-    next_scrape = std::chrono::system_clock::now() + std::chrono::seconds(config_.ScrapeInterval());
+  bool prevEnableExternalIPs = config_.EnableExternalIPs();
 
-    if (!UpdateAllConnsAndEndpoints()) {
-      CLOG(DEBUG) << "No connection or endpoint to report";
+  while (auto scraped = scrapes->Pop()) {
+    if (!*scraped) {
+      if (!messages->Push({nullptr, nullptr, true})) {
+        return;
+      }
       continue;
     }
 
-    ReportConnectionStats();
-
     int64_t time_micros = NowMicros();
-    const sensor::NetworkConnectionInfoMessage* msg;
     ConnMap new_conn_state, delta_conn;
     AdvertisedEndpointMap new_cep_state;
+    DeltaEntries delta;
     bool enableExternalIPs = config_.EnableExternalIPs();
 
-    WITH_TIMER(CollectorStats::net_fetch_state) {
-      conn_tracker_->EnableExternalIPs(enableExternalIPs);
-
-      new_conn_state = conn_tracker_->FetchConnState(true, true);
-      if (config_.EnableAfterglow()) {
-        ConnectionTracker::ComputeDeltaAfterglow(new_conn_state, old_conn_state, delta_conn, time_micros, time_at_last_scrape, config_.AfterglowPeriod());
-        if (prevEnableExternalIPs != enableExternalIPs) {
-          conn_tracker_->CloseConnectionsOnRuntimeConfigChange(&old_conn_state, &delta_conn, enableExternalIPs);
-          prevEnableExternalIPs = enableExternalIPs;
+    if (auto stage_timer = internal::scoped_timer(stage_stats_.get(), DELTA_STAGE)) {
+      WITH_TIMER(CollectorStats::net_fetch_state) {
+        conn_tracker_->EnableExternalIPs(enableExternalIPs);
+
+        if (config_.EnableAfterglow()) {
+          // A change of the external IPs setting changes the network tables, so the full state is fetched then.
+          if (conn_tracker_->FetchConnStateWithChanges(&new_conn_state)) {
+            // Only the connections that changed since the last fetch need to be looked at.
+            reported_conn_state.ComputeDeltaAfterglow(new_conn_state, &delta_conn, time_micros, time_at_last_scrape, config_.AfterglowPeriod());
+          } else {
+            old_conn_state = reported_conn_state.Release();
+            ConnectionTracker::ComputeDeltaAfterglow(new_conn_state, old_conn_state, delta_conn, time_micros, time_at_last_scrape, config_.AfterglowPeriod());
+            if (prevEnableExternalIPs != enableExternalIPs) {
+              conn_tracker_->CloseConnectionsOnRuntimeConfigChange(&old_conn_state, &delta_conn, enableExternalIPs);
+              prevEnableExternalIPs = enableExternalIPs;
+            }
+            ConnectionTracker::UpdateOldState(&old_conn_state, new_conn_state, time_micros, config_.AfterglowPeriod());
+            reported_conn_state.Reset(std::move(old_conn_state), std::move(new_conn_state));
+            old_conn_state.clear();
+          }
+        } else {
+          new_conn_state = conn_tracker_->FetchConnState(true, true);
+          ConnectionTracker::ComputeDelta(new_conn_state, &old_conn_state);
         }
-      } else {
-        ConnectionTracker::ComputeDelta(new_conn_state, &old_conn_state);
+
+        new_cep_state = conn_tracker_->FetchEndpointState(true, true);
+        ConnectionTracker::ComputeDelta(new_cep_state, &old_cep_state);
       }
 
-      new_cep_state = conn_tracker_->FetchEndpointState(true, true);
-      ConnectionTracker::ComputeDelta(new_cep_state, &old_cep_state);
+      const ConnMap& conn_delta = config_.EnableAfterglow() ? delta_conn : old_conn_state;
+      delta = GetDeltaEntries(conn_delta, old_cep_state);
+
+      unsigned int inserted = count_inserted_connections();
+      auto interval = scrape_interval_.Update(conn_delta.size() + old_cep_state.size(), inserted - inserted_at_last_scrape);
+      inserted_at_last_scrape = inserted;
+      COUNTER_SET(CollectorStats::net_scrape_interval_ms, interval.count());
     }
 
-    WITH_TIMER(CollectorStats::net_create_message) {
-      if (config_.EnableAfterglow()) {
-        msg = CreateInfoMessage(delta_conn, old_cep_state);
-        ConnectionTracker::UpdateOldState(&old_conn_state, new_conn_state, time_micros, config_.AfterglowPeriod());
-      } else {
-        msg = CreateInfoMessage(old_conn_state, old_cep_state);
-        old_conn_state = std::move(new_conn_state);
+    // The delta is sent in as many messages as the size limits require. Each one is handed over to the write stage as
+    // soon as it is built, so that the next one is built while it is written.
+    do {
+      // Wait for the write stage to be done with the message previously built in this allocator.
+      auto allocator = free_allocators->Pop();
+      if (!allocator) {
+        return;
       }
-      old_cep_state = std::move(new_cep_state);
-      time_at_last_scrape = time_micros;
-    }
 
-    if (!msg) {
-      CLOG(DEBUG) << "No update to report";
-      continue;
-    }
+      const sensor::NetworkConnectionInfoMessage* msg = nullptr;
+      if (auto stage_timer = internal::scoped_timer(stage_stats_.get(), SERIALIZE_STAGE)) {
+        WITH_TIMER(CollectorStats::net_create_message) {
+          if (!delta.Done()) {
+            msg = CreateInfoMessage(*allocator, &delta);
+          }
+        }
+      }
 
-    WITH_TIMER(CollectorStats::net_write_message) {
-      if (!writer->Write(*msg, next_scrape)) {
-        CLOG(ERROR) << "Failed to write network connection info";
+      if (!messages->Push({*allocator, msg, delta.Done()})) {
         return;
       }
+    } while (!delta.Done());
+
+    // The messages hold copies of the delta entries, which can go now.
+    if (!config_.EnableAfterglow()) {
+      old_conn_state = std::move(new_conn_state);
     }
+    old_cep_state = std::move(new_cep_state);
+    time_at_last_scrape = time_micros;
+  }
+}
+
+void NetworkStatusNotifier::RunWriteStage(IDuplexClientWriter<sensor::NetworkConnectionInfoMessage>* writer,
+                                          BoundedQueue<int64_t>* scrape_requests,
+                                          BoundedQueue<PendingMessage>* messages,
+                                          BoundedQueue<MessageAllocator*>* free_allocators) {
+  auto next_scrape = std::chrono::system_clock::now();
 
-    CLOG(DEBUG) << "Network status notification done";
+  while (writer->Sleep(next_scrape)) {
+    CLOG(DEBUG) << "Starting network status notification";
+    next_scrape = std::chrono::system_clock::now() + scrape_interval_.interval();
+
+    if (!scrape_requests->TryPush(NowMicros())) {
+      CLOG(DEBUG) << "Previous network scrape still pending";
+    }
+
+    // Write the messages of this scrape, unless the next one is due first, along with any other message ready by then.
+    bool scrape_written = false;
+    for (auto pending = messages->PopUntil(next_scrape); pending; pending = scrape_written ? messages->TryPop() : messages->PopUntil(next_scrape)) {
+      if (pending->msg) {
+        if (auto stage_timer = internal::scoped_timer(stage_stats_.get(), WRITE_STAGE)) {
+          WITH_TIMER(CollectorStats::net_write_message) {
+            if (!writer->Write(*pending->msg, next_scrape)) {
+              CLOG(ERROR) << "Failed to write network connection info";
+              return;
+            }
+          }
+        }
+        CLOG(DEBUG) << "Network status notification done";
+      } else {
+        CLOG(DEBUG) << "No update to report";
+      }
+
+      if (pending->allocator) {
+        free_allocators->Push(pending->allocator);
+      }
+      scrape_written = pending->last;
+    }
   }
 }
 
-sensor::NetworkConnectionInfoMessage* NetworkStatusNotifier::CreateInfoMessage(const ConnMap& conn_delta, const AdvertisedEndpointMap& endpoint_delta) {
-  if (conn_delta.empty() && endpoint_delta.empty()) {
-    return nullptr;
+NetworkStatusNotifier::DeltaEntries NetworkStatusNotifier::GetDeltaEntries(const ConnMap& conn_delta, const AdvertisedEndpointMap& endpoint_delta) {
+  DeltaEntries delta;
+  delta.conns = RateLimitConnections(conn_delta);
+  COUNTER_ADD(CollectorStats::net_conn_deltas, conn_delta.size());
+  delta.endpoints.reserve(endpoint_delta.size());
+  for (const auto& delta_entry : endpoint_delta) {
+    CLOG(DEBUG) << delta_entry.first << " active:" << delta_entry.second.IsActive();
+    delta.endpoints.push_back(&delta_entry);
   }
+  COUNTER_ADD(CollectorStats::net_cep_deltas, endpoint_delta.size());
+  return delta;
+}
 
-  Reset();
-  auto* msg = AllocateRoot();
+sensor::NetworkConnectionInfoMessage* NetworkStatusNotifier::CreateInfoMessage(MessageAllocator* allocator, DeltaEntries* delta) {
+  allocator_ = allocator;
+  allocator_->Reset();
+  auto* msg = allocator_->AllocateRoot();
   auto* info = msg->mutable_info();
 
-  AddConnections(info->mutable_updated_connections(), conn_delta);
-  COUNTER_ADD(CollectorStats::net_conn_deltas, conn_delta.size());
-  AddContainerEndpoints(info->mutable_updated_endpoints(), endpoint_delta);
-  COUNTER_ADD(CollectorStats::net_cep_deltas, endpoint_delta.size());
+  size_t max_entries = config_.NetworkMessageMaxEntries();
+  size_t max_bytes = config_.NetworkMessageMaxBytes();
+  size_t num_entries = 0;
+  size_t num_bytes = 0;
+
+  // Counts the last entry added to `updates` in the message, unless it goes over the limits, in which case it is
+  // removed. There is always room for one entry though, such that each message makes progress through the delta.
+  auto fits = [&](auto* updates) {
+    size_t entry_bytes = 0;
+    if (max_bytes > 0) {
+      // Entries are length-delimited fields, preceded by a one byte tag and their length.
+      size_t size = updates->Get(updates->size() - 1).ByteSizeLong();
+      entry_bytes = 1 + google::protobuf::io::CodedOutputStream::VarintSize64(size) + size;
+    }
+    if (num_entries > 0 && ((max_entries > 0 && num_entries >= max_entries) || (max_bytes > 0 && num_bytes + entry_bytes > max_bytes))) {
+      updates->RemoveLast();
+      return false;
+    }
+    num_entries++;
+    num_bytes += entry_bytes;
+    return true;
+  };
+
+  // Strings are only encoded if Sensor acknowledged the string dictionary, which is known once its first control message
+  // is received. Whether to encode them is decided with the first message of the stream and kept for all the others,
+  // such that Sensor never gets a reference to a string sent before it.
+  if (!encode_strings_) {
+    encode_strings_ = config_.NetworkStringDictionary() && string_dictionary_acked_;
+    if (config_.NetworkStringDictionary() && !*encode_strings_) {
+      CLOG(INFO) << "Sensor did not acknowledge the string dictionary, sending plain strings";
+    }
+  }
+
+  // Entries are encoded once they fit, such that the dictionary only gets the strings which are sent. The size limits
+  // are checked before encoding, which only makes entries smaller.
+  auto* updated_connections = info->mutable_updated_connections();
+  for (; delta->next_conn < delta->conns.size(); delta->next_conn++) {
+    const auto& [conn, status] = *delta->conns[delta->next_conn];
+    auto* conn_proto = ConnToProto(conn, status);
+    updated_connections->AddAllocated(conn_proto);
+    if (!fits(updated_connections)) {
+      break;
+    }
+    if (*encode_strings_) {
+      EncodeConnection(conn_proto);
+    }
+  }
+
+  if (delta->next_conn == delta->conns.size()) {
+    auto* updated_endpoints = info->mutable_updated_endpoints();
+    for (; delta->next_endpoint < delta->endpoints.size(); delta->next_endpoint++) {
+      const auto& [cep, status] = *delta->endpoints[delta->next_endpoint];
+      auto* endpoint_proto = ContainerEndpointToProto(cep, status);
+      updated_endpoints->AddAllocated(endpoint_proto);
+      if (!fits(updated_endpoints)) {
+        break;
+      }
+      if (*encode_strings_) {
+        EncodeEndpoint(endpoint_proto, cep);
+      }
+    }
+  }
 
   *info->mutable_time() = CurrentTimeProto();
 
   return msg;
 }
 
-void NetworkStatusNotifier::AddConnections(::google::protobuf::RepeatedPtrField<sensor::NetworkConnection>* updates, const ConnMap& delta) {
-  int64_t per_container_limit = config_.PerContainerRateLimit();
+void NetworkStatusNotifier::EncodeConnection(sensor::NetworkConnection* conn) {
+  conn->set_container_id(string_dictionary_.Encode(conn->container_id()));
+}
+
+void NetworkStatusNotifier::EncodeEndpoint(sensor::NetworkEndpoint* endpoint, const ContainerEndpoint& cep) {
+  endpoint->set_container_id(string_dictionary_.Encode(endpoint->container_id()));
+  if (cep.originator()) {
+    // The originator may be a cached message shared with other messages, see UseCached, so it gets replaced rather
+    // than modified.
+    ReleaseCached(endpoint->unsafe_arena_release_originator());
+    endpoint->unsafe_arena_set_allocated_originator(EncodedProcessToProto(*cep.originator().get()));
+  }
+}
+
+void NetworkStatusNotifier::ResetStringDictionary() {
+  // Sensor starts each stream with an empty dictionary.
+  string_dictionary_.Clear();
+  string_dictionary_stream_++;
+  encode_strings_.reset();
+}
+
+std::vector<const ConnMap::value_type*> NetworkStatusNotifier::RateLimitConnections(const ConnMap& delta) {
+  int64_t per_container_limit = config_.PerContainerRateLimit(scrape_interval_.interval());
   CountLimiter rate_limiter(per_container_limit);
 
   UnorderedMap<std::string_view, int> rate_limited_containers;
 
-  int64_t added_events = 0;
+  std::vector<const ConnMap::value_type*> entries;
+  entries.reserve(delta.size());
 
   for (const auto& delta_entry : delta) {
-    auto* conn_proto = ConnToProto(delta_entry.first);
-    if (!delta_entry.second.IsActive()) {
-      *conn_proto->mutable_close_timestamp() = google::protobuf::util::TimeUtil::MicrosecondsToTimestamp(
-          delta_entry.second.LastActiveTime());
-    } else {
+    if (delta_entry.second.IsActive()) {
       //
       // We want to rate limit connections per container, even after afterglow
       // has been (optionally) applied. Afterglow does not guard against a high
@@ -348,51 +592,50 @@ void NetworkStatusNotifier::AddConnections(::google::protobuf::RepeatedPtrField<
       }
     }
 
-    added_events++;
-    updates->AddAllocated(conn_proto);
+    entries.push_back(&delta_entry);
   }
 
   for (const auto& [id, events] : rate_limited_containers) {
     CLOG(INFO) << "Rate limited " << events << " connections from container " << id << " (limit: " << per_container_limit << ")";
   }
 
-  CLOG(DEBUG) << "Processed " << delta.size() << " events; sending " << added_events;
-}
-
-void NetworkStatusNotifier::AddContainerEndpoints(::google::protobuf::RepeatedPtrField<sensor::NetworkEndpoint>* updates, const AdvertisedEndpointMap& delta) {
-  for (const auto& delta_entry : delta) {
-    auto* endpoint_proto = ContainerEndpointToProto(delta_entry.first);
+  CLOG(DEBUG) << "Processed " << delta.size() << " events; sending " << entries.size();
 
-    CLOG(DEBUG) << delta_entry.first << " active:" << delta_entry.second.IsActive();
+  return entries;
+}
 
-    if (!delta_entry.second.IsActive()) {
-      *endpoint_proto->mutable_close_timestamp() = google::protobuf::util::TimeUtil::MicrosecondsToTimestamp(
-          delta_entry.second.LastActiveTime());
-    }
-    updates->AddAllocated(endpoint_proto);
+void NetworkStatusNotifier::AddConnections(::google::protobuf::RepeatedPtrField<sensor::NetworkConnection>* updates, const ConnMap& delta) {
+  for (const auto* delta_entry : RateLimitConnections(delta)) {
+    updates->AddAllocated(ConnToProto(delta_entry->first, delta_entry->second));
   }
 }
 
-sensor::NetworkConnection* NetworkStatusNotifier::ConnToProto(const Connection& conn) {
+sensor::NetworkConnection* NetworkStatusNotifier::ConnToProto(const Connection& conn, const ConnStatus& status) {
   auto* conn_proto = Allocate<sensor::NetworkConnection>();
   conn_proto->set_container_id(conn.container());
   conn_proto->set_role(conn.is_server() ? sensor::ROLE_SERVER : sensor::ROLE_CLIENT);
   conn_proto->set_protocol(TranslateL4Protocol(conn.l4proto()));
   conn_proto->set_socket_family(TranslateAddressFamily(conn.local().address().family()));
-  conn_proto->set_allocated_local_address(EndpointToProto(conn.local()));
-  conn_proto->set_allocated_remote_address(EndpointToProto(conn.remote()));
+  conn_proto->unsafe_arena_set_allocated_local_address(EndpointToProto(conn.local()));
+  conn_proto->unsafe_arena_set_allocated_remote_address(EndpointToProto(conn.remote()));
+  if (!status.IsActive()) {
+    *conn_proto->mutable_close_timestamp() = google::protobuf::util::TimeUtil::MicrosecondsToTimestamp(status.LastActiveTime());
+  }
 
   return conn_proto;
 }
 
-sensor::NetworkEndpoint* NetworkStatusNotifier::ContainerEndpointToProto(const ContainerEndpoint& cep) {
+sensor::NetworkEndpoint* NetworkStatusNotifier::ContainerEndpointToProto(const ContainerEndpoint& cep, const ConnStatus& status) {
   auto* endpoint_proto = Allocate<sensor::NetworkEndpoint>();
   endpoint_proto->set_container_id(cep.container());
   endpoint_proto->set_protocol(TranslateL4Protocol(cep.l4proto()));
   endpoint_proto->set_socket_family(TranslateAddressFamily(cep.endpoint().address().family()));
-  endpoint_proto->set_allocated_listen_address(EndpointToProto(cep.endpoint()));
+  endpoint_proto->unsafe_arena_set_allocated_listen_address(EndpointToProto(cep.endpoint()));
   if (cep.originator()) {
-    endpoint_proto->set_allocated_originator(ProcessToProto(*cep.originator().get()));
+    endpoint_proto->unsafe_arena_set_allocated_originator(ProcessToProto(*cep.originator().get()));
+  }
+  if (!status.IsActive()) {
+    *endpoint_proto->mutable_close_timestamp() = google::protobuf::util::TimeUtil::MicrosecondsToTimestamp(status.LastActiveTime());
   }
 
   return endpoint_proto;
@@ -403,12 +646,18 @@ sensor::NetworkAddress* NetworkStatusNotifier::EndpointToProto(const collector::
     return nullptr;
   }
 
+  if (const auto* cached = address_cache_.Find(endpoint)) {
+    COUNTER_INC(CollectorStats::net_proto_cache_hit);
+    return UseCached(*cached);
+  }
+  COUNTER_INC(CollectorStats::net_proto_cache_miss);
+
   // Note: We are sending the address data and network data as separate fields for
   // backward compatibility, although, network field can handle both.
   // Sensor tries to match address to known cluster entities. If that fails, it tries
   // to match the network to known external networks,
 
-  auto* addr_proto = Allocate<sensor::NetworkAddress>();
+  auto addr_proto = std::make_shared<sensor::NetworkAddress>();
   auto addr_length = endpoint.address().length();
   if (endpoint.network().IsAddress()) {
     addr_proto->set_address_data(endpoint.address().data(), addr_length);
@@ -421,17 +670,52 @@ sensor::NetworkAddress* NetworkStatusNotifier::EndpointToProto(const collector::
   }
   addr_proto->set_port(endpoint.port());
 
-  return addr_proto;
+  address_cache_.Insert(endpoint, addr_proto);
+  return UseCached(addr_proto);
 }
 
 storage::NetworkProcessUniqueKey* NetworkStatusNotifier::ProcessToProto(const collector::IProcess& process) {
-  auto* process_proto = Allocate<storage::NetworkProcessUniqueKey>();
+  ProcessKey key{process.comm(), process.exe_path(), process.args()};
+  if (const auto* cached = process_cache_.Find(key)) {
+    COUNTER_INC(CollectorStats::net_proto_cache_hit);
+    return UseCached(cached->proto);
+  }
+  COUNTER_INC(CollectorStats::net_proto_cache_miss);
 
-  process_proto->set_process_name(process.comm());
-  process_proto->set_process_exec_file_path(process.exe_path());
-  process_proto->set_process_args(process.args());
+  auto process_proto = std::make_shared<storage::NetworkProcessUniqueKey>();
 
-  return process_proto;
+  process_proto->set_process_name(key.comm);
+  process_proto->set_process_exec_file_path(key.exe_path);
+  process_proto->set_process_args(key.args);
+
+  process_cache_.Insert(key, CachedProcess{process_proto});
+  return UseCached(process_proto);
+}
+
+storage::NetworkProcessUniqueKey* NetworkStatusNotifier::EncodedProcessToProto(const collector::IProcess& process) {
+  ProcessKey key{process.comm(), process.exe_path(), process.args()};
+  // The plain originator was just taken from the cache, so the process is still there, unless the cache is disabled.
+  auto* cached = process_cache_.Find(key);
+  if (cached && cached->encoded && cached->encoded_stream == string_dictionary_stream_) {
+    return UseCached(cached->encoded);
+  }
+
+  auto encoded = std::make_shared<storage::NetworkProcessUniqueKey>();
+  encoded->set_process_name(string_dictionary_.Encode(key.comm));
+  encoded->set_process_exec_file_path(string_dictionary_.Encode(key.exe_path));
+  encoded->set_process_args(string_dictionary_.Encode(key.args));
+
+  // Strings go into the dictionary the first time they are encoded, if ever, so from the second time on they encode
+  // the same until the dictionary is reset.
+  if (cached) {
+    if (cached->encoded_stream == string_dictionary_stream_) {
+      cached->encoded = encoded;
+    } else {
+      cached->encoded_stream = string_dictionary_stream_;
+      cached->encoded.reset();
+    }
+  }
+  return UseCached(encoded);
 }
 
 }  // namespace collector
@@ -1,21 +1,39 @@
 #pragma once
 
+#include <array>
+#include <atomic>
 #include <memory>
+#include <optional>
+#include <string>
 #include <utility>
+#include <vector>
 
 #include <gtest/gtest_prod.h>
 
+#include "AdaptiveInterval.h"
+#include "BoundedQueue.h"
+#include "ClockCache.h"
 #include "CollectorConfig.h"
 #include "CollectorConnectionStats.h"
+#include "CollectorStageStats.h"
 #include "ConnTracker.h"
+#include "Hash.h"
 #include "NetworkConnectionInfoServiceComm.h"
 #include "ProcfsScraper.h"
 #include "ProtoAllocator.h"
 #include "StoppableThread.h"
+#include "StringDictionary.h"
 
 namespace collector {
 
-class NetworkStatusNotifier : protected ProtoAllocator<sensor::NetworkConnectionInfoMessage> {
+// NetworkStatusNotifier periodically reports the connections and endpoints that changed to Sensor. Each report goes
+// through a pipeline of stages, which run on their own thread and hand work over through bounded queues:
+//  - scrape: reads the connections and endpoints from /proc and updates the connection tracker,
+//  - delta and serialize: fetches the tracker state, computes the changes since the last report and builds the message,
+//  - write: sends the message to Sensor, on the thread owning the gRPC stream.
+// Thus a slow write does not hold back the next scrape, nor a slow scrape the pending write, and the time between two
+// reports is bounded by the slowest stage rather than by the sum of them.
+class NetworkStatusNotifier {
  public:
   NetworkStatusNotifier(std::shared_ptr<ConnectionTracker> conn_tracker,
                         const CollectorConfig& config,
@@ -24,7 +42,10 @@ class NetworkStatusNotifier : protected ProtoAllocator<sensor::NetworkConnection
       : conn_scraper_(std::make_unique<ConnScraper>(config, inspector)),
         conn_tracker_(std::move(conn_tracker)),
         config_(config),
-        comm_(std::make_unique<NetworkConnectionInfoServiceComm>(config.grpc_channel)) {
+        comm_(std::make_unique<NetworkConnectionInfoServiceComm>(config.grpc_channel, config.NetworkStringDictionary())),
+        scrape_interval_(std::chrono::seconds(config.ScrapeInterval()),
+                         std::chrono::seconds(config.ScrapeIntervalMin()),
+                         std::chrono::seconds(config.ScrapeIntervalMax())) {
     if (config_.EnableConnectionStats()) {
       connections_total_reporter_ = {{registry,
                                       "rox_connections_total",
@@ -39,6 +60,14 @@ class NetworkStatusNotifier : protected ProtoAllocator<sensor::NetworkConnection
                                      config.GetConnectionStatsQuantiles(),
                                      config.GetConnectionStatsError()}};
     }
+    if (registry) {
+      stage_stats_ = std::make_unique<CollectorStageStats>(
+          registry,
+          "rox_collector_network_stage_duration_seconds",
+          "Time spent in each stage of the network status notifications",
+          std::vector<std::string>{"scrape", "delta", "serialize", "write"},
+          std::vector<double>{0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5, 10, 30});
+    }
   }
 
   void Start();
@@ -69,28 +98,119 @@ class NetworkStatusNotifier : protected ProtoAllocator<sensor::NetworkConnection
 
  private:
   FRIEND_TEST(NetworkStatusNotifierTest, RateLimitedConnections);
+  FRIEND_TEST(NetworkStatusNotifierTest, ChunkedMessages);
+  FRIEND_TEST(NetworkStatusNotifierTest, CachedSubMessages);
+  FRIEND_TEST(NetworkStatusNotifierTest, UnchangedKnownIPNetworks);
+  FRIEND_TEST(NetworkStatusNotifierTest, KnownIPv6NetworkFullLength);
+  FRIEND_TEST(NetworkStatusNotifierTest, StringDictionary);
+  FRIEND_TEST(NetworkStatusNotifierTest, StringDictionaryNotAcknowledged);
+
+  using MessageAllocator = ProtoAllocator<sensor::NetworkConnectionInfoMessage>;
+
+  // Stages of the pipeline, in the order of the histograms of stage_stats_.
+  enum Stage : size_t {
+    SCRAPE_STAGE,
+    DELTA_STAGE,
+    SERIALIZE_STAGE,
+    WRITE_STAGE,
+  };
+
+  // A message handed over to the write stage, along with the allocator holding it, which must not be reused until the
+  // message is written. The message is null if there is no update to report. A scrape may yield several messages, the
+  // last one of which is flagged.
+  struct PendingMessage {
+    MessageAllocator* allocator;
+    const sensor::NetworkConnectionInfoMessage* msg;
+    bool last;
+  };
+
+  // The entries of a delta which remain to be reported. They point into the delta maps, which must outlive them.
+  struct DeltaEntries {
+    std::vector<const ConnMap::value_type*> conns;
+    std::vector<const AdvertisedEndpointMap::value_type*> endpoints;
+    size_t next_conn = 0;
+    size_t next_endpoint = 0;
 
-  sensor::NetworkConnectionInfoMessage* CreateInfoMessage(const ConnMap& conn_delta, const AdvertisedEndpointMap& cep_delta);
+    bool Done() const { return next_conn == conns.size() && next_endpoint == endpoints.size(); }
+  };
+
+  // Returns the entries of the deltas to report, leaving out the new connections of containers over the rate limit.
+  DeltaEntries GetDeltaEntries(const ConnMap& conn_delta, const AdvertisedEndpointMap& cep_delta);
+  // The rate limit scales with the current scrape interval.
+  std::vector<const ConnMap::value_type*> RateLimitConnections(const ConnMap& delta);
+  // Builds a message with the next entries of the delta, as many as the configured message size limits allow, in the
+  // given allocator, which is reset first.
+  sensor::NetworkConnectionInfoMessage* CreateInfoMessage(MessageAllocator* allocator, DeltaEntries* delta);
   void AddConnections(::google::protobuf::RepeatedPtrField<sensor::NetworkConnection>* updates, const ConnMap& delta);
-  void AddContainerEndpoints(::google::protobuf::RepeatedPtrField<sensor::NetworkEndpoint>* updates, const AdvertisedEndpointMap& delta);
+  // Encode the strings of an entry of the message with string_dictionary_, once it fits in the message. Sensor decodes
+  // them in the order of the message: the container ID of each connection, then the container ID and originator process
+  // name, executable path and arguments of each endpoint.
+  void EncodeConnection(sensor::NetworkConnection* conn);
+  void EncodeEndpoint(sensor::NetworkEndpoint* endpoint, const ContainerEndpoint& cep);
+  // Starts the dictionary of a new stream, whose strings are encoded only if Sensor acknowledged it.
+  void ResetStringDictionary();
 
-  sensor::NetworkConnection* ConnToProto(const Connection& conn);
-  sensor::NetworkEndpoint* ContainerEndpointToProto(const ContainerEndpoint& cep);
+  sensor::NetworkConnection* ConnToProto(const Connection& conn, const ConnStatus& status);
+  sensor::NetworkEndpoint* ContainerEndpointToProto(const ContainerEndpoint& cep, const ConnStatus& status);
+  // The addresses and processes are taken from caches, see UseCached.
   sensor::NetworkAddress* EndpointToProto(const Endpoint& endpoint);
   storage::NetworkProcessUniqueKey* ProcessToProto(const collector::IProcess& process);
+  // The originator with its strings encoded, also taken from the process cache once they encode the same every time.
+  storage::NetworkProcessUniqueKey* EncodedProcessToProto(const collector::IProcess& process);
+
+  template <typename T>
+  T* Allocate() {
+    return allocator_->Allocate<T>();
+  }
+
+  // Returns a cached sub-message, to be set in the message being built with unsafe_arena_set_allocated_*(). Messages
+  // built in an arena refer to the cached sub-message rather than copying it, and keep it alive until the arena is
+  // reset, even if it is evicted from the cache in the meantime. Messages on the heap would take ownership of it though,
+  // so they get a copy.
+  template <typename T>
+  T* UseCached(const std::shared_ptr<T>& cached) {
+#ifdef USE_PROTO_ARENAS
+    allocator_->KeepUntilReset(cached);
+    return cached.get();
+#else
+    auto* copy = Allocate<T>();
+    copy->CopyFrom(*cached);
+    return copy;
+#endif
+  }
+
+  // Frees a sub-message obtained from UseCached, once released from the message it was set in.
+  template <typename T>
+  void ReleaseCached(T* released) {
+#ifdef USE_PROTO_ARENAS
+    (void)released;  // kept alive by the allocator until it is reset
+#else
+    delete released;
+#endif
+  }
 
   void OnRecvControlMessage(const sensor::NetworkFlowsControlMessage* msg);
 
   void Run();
   void WaitUntilWriterStarted(IDuplexClientWriter<sensor::NetworkConnectionInfoMessage>* writer, int wait_time);
-  bool UpdateAllConnsAndEndpoints();
+  // Scrapes the connections and endpoints, and updates the tracker with them as active at `ts`.
+  bool UpdateAllConnsAndEndpoints(int64_t ts);
   void RunSingle(IDuplexClientWriter<sensor::NetworkConnectionInfoMessage>* writer);
+  // Pipeline stages, see RunSingle.
+  void RunScrapeStage(BoundedQueue<int64_t>* scrape_requests, BoundedQueue<bool>* scrapes);
+  void RunDeltaStage(BoundedQueue<bool>* scrapes, BoundedQueue<MessageAllocator*>* free_allocators, BoundedQueue<PendingMessage>* messages);
+  void RunWriteStage(IDuplexClientWriter<sensor::NetworkConnectionInfoMessage>* writer,
+                     BoundedQueue<int64_t>* scrape_requests,
+                     BoundedQueue<PendingMessage>* messages,
+                     BoundedQueue<MessageAllocator*>* free_allocators);
   void ReceivePublicIPs(const sensor::IPAddressList& public_ips);
   void ReceiveIPNetworks(const sensor::IPNetworkList& networks);
 
   void ReportConnectionStats();
 
   StoppableThread thread_;
+  StoppableThread scrape_thread_;
+  StoppableThread delta_thread_;
 
   std::unique_ptr<IConnScraper> conn_scraper_;
   std::shared_ptr<ConnectionTracker> conn_tracker_;
@@ -98,10 +218,52 @@ class NetworkStatusNotifier : protected ProtoAllocator<sensor::NetworkConnection
   const CollectorConfig& config_;
   std::unique_ptr<INetworkConnectionInfoServiceComm> comm_;
 
+  // Strings sent on the current stream, if enabled. Only the delta stage uses it.
+  StringDictionaryEncoder string_dictionary_;
+  uint64_t string_dictionary_stream_ = 1;  // identifies the dictionary of the current stream
+  // Set when Sensor acknowledges the string dictionary on the current stream, and reset for each new one.
+  std::atomic<bool> string_dictionary_acked_ = false;
+  // Whether the strings of the current stream are encoded, decided with its first message, see CreateInfoMessage.
+  std::optional<bool> encode_strings_;
+
+  // Updated by the delta stage with the churn of each scrape, and read by the write stage to schedule the next one.
+  AdaptiveInterval scrape_interval_;
+
+  // Messages are built in one allocator while the previous one is written from another.
+  std::array<MessageAllocator, 2> message_allocators_;
+  MessageAllocator* allocator_ = &message_allocators_[0];  // the allocator the message being built comes from
+
+  struct ProcessKey {
+    std::string comm;
+    std::string exe_path;
+    std::string args;
+
+    bool operator==(const ProcessKey& other) const {
+      return comm == other.comm && exe_path == other.exe_path && args == other.args;
+    }
+    size_t Hash() const { return HashAll(comm, exe_path, args); }
+  };
+
+  struct CachedProcess {
+    std::shared_ptr<storage::NetworkProcessUniqueKey> proto;
+    // The proto with its strings encoded in the dictionary of encoded_stream, if they were already encoded in it.
+    std::shared_ptr<storage::NetworkProcessUniqueKey> encoded;
+    uint64_t encoded_stream = 0;
+  };
+
+  // Most endpoints and processes are reported again and again, so their sub-messages are only built once. Only the
+  // delta stage uses the caches.
+  static constexpr size_t kAddressCacheCapacity = 16384;
+  static constexpr size_t kProcessCacheCapacity = 1024;
+  ClockCache<Endpoint, std::shared_ptr<sensor::NetworkAddress>> address_cache_{kAddressCacheCapacity};
+  ClockCache<ProcessKey, CachedProcess> process_cache_{kProcessCacheCapacity};
+
   std::optional<CollectorConnectionStats<unsigned int>> connections_total_reporter_;
   std::optional<CollectorConnectionStats<float>> connections_rate_reporter_;
   std::chrono::steady_clock::time_point connections_last_report_time_;     // time delta between the current reporting and the previous (rate computation)
   std::optional<ConnectionTracker::Stats> connections_rate_counter_last_;  // previous counter values (rate computation)
+  std::optional<size_t> known_ip_networks_hash_;                          // hash of the last received known IP networks
+  std::unique_ptr<CollectorStageStats> stage_stats_;
 };
 
 }  // namespace collector
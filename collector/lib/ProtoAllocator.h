@@ -4,6 +4,9 @@
 #  include <google/protobuf/arena.h>
 #endif
 
+#include <memory>
+#include <vector>
+
 #include "Logging.h"
 
 namespace collector {
@@ -29,9 +32,15 @@ class ArenaProtoAllocator {
   explicit ArenaProtoAllocator(size_t pool_size)
       : pool_(new char[pool_size]), pool_size_(pool_size), arena_(ArenaOptionsForInitialBlock(pool_.get(), pool_size_)) {}
 
+  // Whether the pool grows to fit the largest message built so far, which is the default. When messages are bounded
+  // in size, the rare one which does not fit is better served by the arena's own blocks, released on reset, than by
+  // keeping a larger pool for good.
+  void EnablePoolGrowth(bool enable) { grow_pool_ = enable; }
+
   void Reset() {
+    kept_objects_.clear();
     google::protobuf::uint64 bytes_used = arena_.Reset();
-    if (bytes_used > pool_size_) {
+    if (grow_pool_ && bytes_used > pool_size_) {
       size_t new_pool_size = (bytes_used / kDefaultPoolSize + 1) * kDefaultPoolSize;
       CLOG(WARNING) << "Used " << bytes_used << " bytes in the arena, which is more than the pre-allocated "
                     << pool_size_ << " bytes. Increasing arena size to " << new_pool_size << " bytes.";
@@ -55,10 +64,17 @@ class ArenaProtoAllocator {
     return google::protobuf::Arena::CreateMessage<Message>(&arena_);
   }
 
+  // Keeps an object alive until the next reset, for allocated messages referring to objects they do not own.
+  void KeepUntilReset(std::shared_ptr<const void> object) {
+    kept_objects_.push_back(std::move(object));
+  }
+
  private:
   std::unique_ptr<char[]> pool_;
   size_t pool_size_;
+  bool grow_pool_ = true;
   google::protobuf::Arena arena_;
+  std::vector<std::shared_ptr<const void>> kept_objects_;
 };
 
 #endif
@@ -70,7 +86,11 @@ class HeapProtoAllocator {
 
   HeapProtoAllocator(size_t) : HeapProtoAllocator() {}
 
-  void Reset() {}
+  void EnablePoolGrowth(bool) {}
+
+  void Reset() {
+    kept_objects_.clear();
+  }
 
   template <typename T, typename... Args>
   T* Allocate(Args&&... args) { return new T(std::forward<Args>(args)...); }
@@ -80,8 +100,13 @@ class HeapProtoAllocator {
     return &message_;
   }
 
+  void KeepUntilReset(std::shared_ptr<const void> object) {
+    kept_objects_.push_back(std::move(object));
+  }
+
  private:
   Message message_;
+  std::vector<std::shared_ptr<const void>> kept_objects_;
 };
 
 }  // namespace internal
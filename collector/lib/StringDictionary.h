@@ -0,0 +1,123 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "Hash.h"
+
+namespace collector {
+
+// A string dictionary lets the messages of a stream send repeated strings, like container IDs or process names, only
+// once. Both ends of the stream build the same dictionary implicitly, without it ever being sent: each string is
+// either sent as is, in which case it is appended to the dictionary unless it is too short or the dictionary is full,
+// or as a reference to a previous one, by its index in the dictionary. The encoder and the decoder must thus see the
+// strings of the stream in the same order, and start from an empty dictionary with the same capacity.
+//
+// A reference is a NUL character followed by the index, in base 128, most significant digit first, each digit in a
+// byte. This keeps references valid UTF-8, as string fields must be. Plain strings never start with NUL, since they
+// come from C strings.
+namespace string_dictionary {
+
+// Up to 16k strings, such that references are at most three bytes long...
+constexpr size_t kMaxCapacity = 1 << 14;
+// ... and shorter strings are not worth a reference.
+constexpr size_t kMinLength = 4;
+constexpr char kReferenceMarker = '\0';
+
+}  // namespace string_dictionary
+
+class StringDictionaryEncoder {
+ public:
+  explicit StringDictionaryEncoder(size_t capacity = string_dictionary::kMaxCapacity)
+      : capacity_(std::min(capacity, string_dictionary::kMaxCapacity)) {}
+
+  // Returns the string to send in place of `str`: a reference if it was sent before, or `str` itself otherwise.
+  std::string Encode(const std::string& str) {
+    if (str.size() < string_dictionary::kMinLength) {
+      return str;
+    }
+
+    auto it = indices_.find(str);
+    if (it != indices_.end()) {
+      hits_++;
+      return Reference(it->second);
+    }
+
+    if (indices_.size() < capacity_) {
+      indices_.emplace(str, indices_.size());
+    }
+    return str;
+  }
+
+  // Forgets all the strings, for a new stream.
+  void Clear() {
+    indices_.clear();
+    hits_ = 0;
+  }
+
+  size_t size() const { return indices_.size(); }
+  // Number of strings sent as references since the last Clear().
+  size_t hits() const { return hits_; }
+
+ private:
+  static std::string Reference(uint32_t index) {
+    std::string reference(1, string_dictionary::kReferenceMarker);
+    int shift = 0;
+    while (shift + 7 < 32 && (index >> (shift + 7)) != 0) {
+      shift += 7;
+    }
+    for (; shift >= 0; shift -= 7) {
+      reference.push_back(static_cast<char>((index >> shift) & 0x7f));
+    }
+    return reference;
+  }
+
+  const size_t capacity_;
+  UnorderedMap<std::string, uint32_t> indices_;
+  size_t hits_ = 0;
+};
+
+// The receiving end of a StringDictionaryEncoder, for tests and as a reference for the receiver's implementation.
+class StringDictionaryDecoder {
+ public:
+  explicit StringDictionaryDecoder(size_t capacity = string_dictionary::kMaxCapacity)
+      : capacity_(std::min(capacity, string_dictionary::kMaxCapacity)) {}
+
+  // Returns the string sent as `str`, or nullopt if it is a malformed reference, or one to an unknown string.
+  std::optional<std::string> Decode(const std::string& str) {
+    if (str.empty() || str[0] != string_dictionary::kReferenceMarker) {
+      if (str.size() >= string_dictionary::kMinLength && strings_.size() < capacity_) {
+        strings_.push_back(str);
+      }
+      return str;
+    }
+
+    // A reference to an index below kMaxCapacity has at most two digits.
+    if (str.size() < 2 || str.size() > 3) {
+      return std::nullopt;
+    }
+    uint32_t index = 0;
+    for (size_t i = 1; i < str.size(); i++) {
+      auto digit = static_cast<unsigned char>(str[i]);
+      if (digit > 0x7f) {
+        return std::nullopt;
+      }
+      index = (index << 7) | digit;
+    }
+    if (index >= strings_.size()) {
+      return std::nullopt;
+    }
+    return strings_[index];
+  }
+
+  size_t size() const { return strings_.size(); }
+
+ private:
+  const size_t capacity_;
+  std::vector<std::string> strings_;
+};
+
+}  // namespace collector
@@ -0,0 +1,78 @@
+#include <chrono>
+
+#include "AdaptiveInterval.h"
+#include "gtest/gtest.h"
+
+namespace collector {
+
+namespace {
+
+using std::chrono::seconds;
+
+TEST(AdaptiveIntervalTest, FixedWithEqualBounds) {
+  AdaptiveInterval interval(seconds(30), seconds(30), seconds(30));
+  EXPECT_EQ(interval.interval(), seconds(30));
+
+  for (int i = 0; i < 5; i++) {
+    EXPECT_EQ(interval.Update(0, 0), seconds(30));
+  }
+  EXPECT_EQ(interval.Update(10, 10), seconds(30));
+  EXPECT_EQ(interval.Update(10000, 10000), seconds(30));
+}
+
+TEST(AdaptiveIntervalTest, GrowsWhileIdle) {
+  AdaptiveInterval interval(seconds(30), seconds(5), seconds(120));
+
+  // A single scrape without changes is not enough.
+  EXPECT_EQ(interval.Update(0, 0), seconds(30));
+  EXPECT_EQ(interval.Update(0, 0), seconds(60));
+  EXPECT_EQ(interval.Update(0, 0), seconds(120));
+  EXPECT_EQ(interval.Update(0, 0), seconds(120));
+
+  // Any change gets back to the base interval.
+  EXPECT_EQ(interval.Update(1, 0), seconds(30));
+  EXPECT_EQ(interval.interval(), seconds(30));
+}
+
+TEST(AdaptiveIntervalTest, ShrinksOnSpikes) {
+  AdaptiveInterval interval(seconds(30), seconds(5), seconds(120));
+
+  for (int i = 0; i < 5; i++) {
+    EXPECT_EQ(interval.Update(50, 10), seconds(30));
+  }
+
+  // Activity over twice its average is a spike.
+  EXPECT_EQ(interval.Update(500, 100), seconds(15));
+  EXPECT_EQ(interval.Update(5000, 1000), seconds(7) + std::chrono::milliseconds(500));
+  EXPECT_EQ(interval.Update(50000, 10000), seconds(5));
+
+  // Once the activity gets back to normal, so does the interval, gradually.
+  for (int i = 0; i < 20 && interval.interval() != seconds(30); i++) {
+    interval.Update(50, 10);
+  }
+  EXPECT_EQ(interval.interval(), seconds(30));
+}
+
+TEST(AdaptiveIntervalTest, SmallSpikesAreIgnored) {
+  AdaptiveInterval interval(seconds(30), seconds(5), seconds(120));
+
+  EXPECT_EQ(interval.Update(1, 0), seconds(30));
+  EXPECT_EQ(interval.Update(10, 10), seconds(30));
+}
+
+TEST(AdaptiveIntervalTest, ActivityIsPerBaseInterval) {
+  AdaptiveInterval interval(seconds(30), seconds(5), seconds(120));
+
+  EXPECT_EQ(interval.Update(0, 100), seconds(30));
+  EXPECT_EQ(interval.Update(0, 100), seconds(60));
+  EXPECT_EQ(interval.Update(0, 200), seconds(120));
+
+  // New connections accumulate over longer intervals, which does not make them a spike: 400 connections in 120s is the
+  // same rate as 100 in 30s.
+  EXPECT_EQ(interval.Update(1, 400), seconds(30));
+  EXPECT_EQ(interval.Update(100, 100), seconds(30));
+}
+
+}  // namespace
+
+}  // namespace collector
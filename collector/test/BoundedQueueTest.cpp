@@ -0,0 +1,84 @@
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "BoundedQueue.h"
+#include "gtest/gtest.h"
+
+namespace collector {
+
+namespace {
+
+TEST(BoundedQueueTest, PushPop) {
+  BoundedQueue<int> queue(2);
+  EXPECT_EQ(queue.TryPop(), std::nullopt);
+
+  EXPECT_TRUE(queue.Push(1));
+  EXPECT_TRUE(queue.TryPush(2));
+  EXPECT_FALSE(queue.TryPush(3));
+  EXPECT_EQ(queue.size(), 2);
+
+  EXPECT_EQ(queue.Pop(), 1);
+  EXPECT_EQ(queue.TryPop(), 2);
+  EXPECT_EQ(queue.PopUntil(std::chrono::steady_clock::now() + std::chrono::milliseconds(10)), std::nullopt);
+}
+
+TEST(BoundedQueueTest, Close) {
+  BoundedQueue<int> queue(2);
+  EXPECT_TRUE(queue.Push(1));
+  queue.Close();
+
+  EXPECT_FALSE(queue.Push(2));
+  EXPECT_FALSE(queue.TryPush(2));
+  // Remaining items can still be consumed.
+  EXPECT_EQ(queue.Pop(), 1);
+  EXPECT_EQ(queue.Pop(), std::nullopt);
+}
+
+TEST(BoundedQueueTest, CloseWakesWaitingThreads) {
+  BoundedQueue<int> full(1);
+  BoundedQueue<int> empty(1);
+  ASSERT_TRUE(full.Push(1));
+
+  bool pushed = true;
+  std::optional<int> popped = 0;
+  std::thread producer([&] { pushed = full.Push(2); });
+  std::thread consumer([&] { popped = empty.Pop(); });
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  full.Close();
+  empty.Close();
+  producer.join();
+  consumer.join();
+
+  EXPECT_FALSE(pushed);
+  EXPECT_EQ(popped, std::nullopt);
+}
+
+TEST(BoundedQueueTest, ProducerConsumer) {
+  constexpr int kNumItems = 10000;
+  BoundedQueue<int> queue(4);
+
+  std::thread producer([&] {
+    for (int i = 0; i < kNumItems; i++) {
+      ASSERT_TRUE(queue.Push(i));
+    }
+    queue.Close();
+  });
+
+  std::vector<int> items;
+  while (auto item = queue.Pop()) {
+    EXPECT_LE(queue.size(), queue.capacity());
+    items.push_back(*item);
+  }
+  producer.join();
+
+  ASSERT_EQ(items.size(), kNumItems);
+  for (int i = 0; i < kNumItems; i++) {
+    EXPECT_EQ(items[i], i);
+  }
+}
+
+}  // namespace
+
+}  // namespace collector
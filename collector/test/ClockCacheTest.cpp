@@ -0,0 +1,85 @@
+#include <string>
+
+#include "ClockCache.h"
+#include "gtest/gtest.h"
+
+namespace collector {
+
+namespace {
+
+TEST(ClockCacheTest, FindInsertClear) {
+  ClockCache<std::string, int> cache(2);
+  EXPECT_EQ(cache.Find("a"), nullptr);
+
+  cache.Insert("a", 1);
+  cache.Insert("b", 2);
+  ASSERT_NE(cache.Find("a"), nullptr);
+  EXPECT_EQ(*cache.Find("a"), 1);
+  ASSERT_NE(cache.Find("b"), nullptr);
+  EXPECT_EQ(*cache.Find("b"), 2);
+  EXPECT_EQ(cache.size(), 2);
+
+  cache.Clear();
+  EXPECT_EQ(cache.size(), 0);
+  EXPECT_EQ(cache.Find("a"), nullptr);
+  EXPECT_EQ(cache.Find("b"), nullptr);
+}
+
+TEST(ClockCacheTest, EvictsEntriesNotUsedRecently) {
+  ClockCache<int, int> cache(3);
+  cache.Insert(1, 10);
+  cache.Insert(2, 20);
+  cache.Insert(3, 30);
+
+  // 1 and 3 are used, so 2 makes room for 4.
+  EXPECT_NE(cache.Find(1), nullptr);
+  EXPECT_NE(cache.Find(3), nullptr);
+  cache.Insert(4, 40);
+  EXPECT_EQ(cache.size(), 3);
+  EXPECT_EQ(cache.Find(2), nullptr);
+  ASSERT_NE(cache.Find(4), nullptr);
+  EXPECT_EQ(*cache.Find(4), 40);
+
+  // All entries are used now. The hand clears the flags of all of them, and evicts the first one it passes again.
+  EXPECT_NE(cache.Find(1), nullptr);
+  EXPECT_NE(cache.Find(3), nullptr);
+  cache.Insert(5, 50);
+  EXPECT_EQ(cache.size(), 3);
+  EXPECT_EQ(cache.Find(3), nullptr);
+  EXPECT_NE(cache.Find(1), nullptr);
+  EXPECT_NE(cache.Find(4), nullptr);
+  EXPECT_NE(cache.Find(5), nullptr);
+}
+
+TEST(ClockCacheTest, EraseIf) {
+  ClockCache<int, int> cache(4);
+  for (int i = 1; i <= 4; i++) {
+    cache.Insert(i, 10 * i);
+  }
+
+  cache.EraseIf([](int key) { return key % 2 == 0; });
+  EXPECT_EQ(cache.size(), 2);
+  EXPECT_EQ(cache.Find(2), nullptr);
+  EXPECT_EQ(cache.Find(4), nullptr);
+  ASSERT_NE(cache.Find(3), nullptr);
+  EXPECT_EQ(*cache.Find(3), 30);
+
+  // Room is made for new entries without evicting the remaining ones.
+  cache.Insert(5, 50);
+  cache.Insert(6, 60);
+  EXPECT_EQ(cache.size(), 4);
+  ASSERT_NE(cache.Find(1), nullptr);
+  EXPECT_EQ(*cache.Find(1), 10);
+  EXPECT_NE(cache.Find(6), nullptr);
+}
+
+TEST(ClockCacheTest, ZeroCapacity) {
+  ClockCache<int, int> cache(0);
+  cache.Insert(1, 10);
+  EXPECT_EQ(cache.size(), 0);
+  EXPECT_EQ(cache.Find(1), nullptr);
+}
+
+}  // namespace
+
+}  // namespace collector
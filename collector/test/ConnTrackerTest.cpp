@@ -20,8 +20,14 @@ You should have received a copy of the GNU General Public License along with thi
 * do not wish to do so, delete this exception statement from your
 * version. */
 
+#include <malloc.h>
+
+#include <iostream>
+#include <random>
+#include <thread>
 #include <utility>
 
+#include "CollectorStats.h"
 #include "ConnTracker.h"
 #include "TimeUtil.h"
 #include "gmock/gmock.h"
@@ -33,6 +39,7 @@ namespace {
 
 using CT = ConnectionTracker;
 using ::testing::IsEmpty;
+using ::testing::SizeIs;
 using ::testing::UnorderedElementsAre;
 
 TEST(ConnTrackerTest, TestAddRemove) {
@@ -1749,6 +1756,874 @@ TEST(ConnTrackerTest, TestShouldNormalizeConnectionFalse) {
   EXPECT_FALSE(tracker.ShouldNormalizeConnection(&conn));
 }
 
+TEST(ConnTrackerTest, TestConcurrentUpdateAndFetch) {
+  ConnectionTracker tracker;
+  Endpoint local(Address(10, 0, 0, 1), 80);
+
+  std::vector<Connection> conns;
+  for (uint16_t port = 1; port <= 2000; port++) {
+    conns.emplace_back("xyz", local, Endpoint(Address(10, 0, 1, 1), port), L4Proto::TCP, true);
+  }
+
+  std::thread updater([&tracker, &conns]() {
+    for (const auto& conn : conns) {
+      tracker.AddConnection(conn, 1000);
+    }
+  });
+
+  // Fetching while the updater is running must neither block it indefinitely nor lose any connection.
+  size_t fetched = 0;
+  while (fetched < conns.size()) {
+    fetched = tracker.FetchConnState(false, false).size();
+  }
+  updater.join();
+
+  ConnMap state = tracker.FetchConnState(true, false);
+  ASSERT_EQ(state.size(), 1);
+  EXPECT_TRUE(state.begin()->second.IsActive());
+
+  state = tracker.FetchConnState(false, false);
+  EXPECT_EQ(state.size(), conns.size());
+  for (const auto& conn : conns) {
+    EXPECT_EQ(state[conn], ConnStatus(1000, true));
+  }
+
+  ConnectionTracker::Stats stats = tracker.GetConnectionStats_NewConnectionCounters();
+  EXPECT_EQ(stats.inbound.private_, conns.size());
+}
+
+TEST(ConnTrackerTest, TestNetworkTablesUpdatedConcurrently) {
+  ConnectionTracker tracker;
+  Endpoint local(Address(10, 0, 0, 1), 1234);
+
+  std::vector<Connection> conns;
+  for (uint8_t i = 1; i <= 100; i++) {
+    conns.emplace_back("xyz", local, Endpoint(Address(35, i % 2, i, 1), 443), L4Proto::TCP, false);
+  }
+  tracker.Update(conns, {}, 1000);
+
+  auto update_known_networks = [&tracker](size_t bits) {
+    tracker.UpdateKnownIPNetworks({{Address::Family::IPV4, {IPNet(Address(35, 0, 0, 0), bits), IPNet(Address(35, 1, 0, 0), 16)}}});
+  };
+  update_known_networks(8);
+
+  std::atomic<bool> done = false;
+  std::thread updater([&update_known_networks, &done]() {
+    for (int i = 1; !done; i++) {
+      update_known_networks(i % 2 ? 16 : 8);
+    }
+  });
+
+  // Every fetch normalizes all connections with the same network tables, whatever the updates happening meanwhile.
+  ConnStatus status(1000, true);
+  ConnMap with_supernet = {
+      {Connection("xyz", Endpoint(), Endpoint(IPNet(Address(35, 0, 0, 0), 8), 443), L4Proto::TCP, false), status},
+      {Connection("xyz", Endpoint(), Endpoint(IPNet(Address(35, 1, 0, 0), 16), 443), L4Proto::TCP, false), status}};
+  ConnMap without_supernet = {
+      {Connection("xyz", Endpoint(), Endpoint(IPNet(Address(35, 0, 0, 0), 16), 443), L4Proto::TCP, false), status},
+      {Connection("xyz", Endpoint(), Endpoint(IPNet(Address(35, 1, 0, 0), 16), 443), L4Proto::TCP, false), status}};
+  size_t inconsistent = 0;
+  for (int i = 0; i < 200; i++) {
+    ConnMap state = tracker.FetchConnState(true, false);
+    inconsistent += state != with_supernet && state != without_supernet;
+  }
+  done = true;
+  updater.join();
+  EXPECT_EQ(inconsistent, 0);
+}
+
+TEST(ConnTrackerTest, TestNormalizationCache) {
+  CollectorStats& stats = CollectorStats::GetOrCreate();
+  auto hits = [&stats]() { return stats.GetCounter(CollectorStats::net_conn_address_cache_hit); };
+  auto misses = [&stats]() { return stats.GetCounter(CollectorStats::net_conn_address_cache_miss); };
+
+  ConnectionTracker tracker;
+  Endpoint local(Address(10, 0, 0, 1), 1234);
+  Connection conn1("xyz", local, Endpoint(Address(35, 127, 0, 1), 443), L4Proto::TCP, false);
+  Connection conn2("xyz", local, Endpoint(Address(35, 127, 0, 2), 443), L4Proto::TCP, false);
+  tracker.Update({conn1, conn2}, {}, 1000);
+
+  int64_t hits_before = hits(), misses_before = misses();
+  Connection conn_normalized("xyz", Endpoint(), Endpoint(IPNet(Address(255, 255, 255, 255), 0, true), 443), L4Proto::TCP, false);
+  EXPECT_THAT(tracker.FetchConnState(true), UnorderedElementsAre(std::make_pair(conn_normalized, ConnStatus(1000, true))));
+  EXPECT_EQ(hits() - hits_before, 0);
+  EXPECT_EQ(misses() - misses_before, 2);
+
+  EXPECT_THAT(tracker.FetchConnState(true), UnorderedElementsAre(std::make_pair(conn_normalized, ConnStatus(1000, true))));
+  EXPECT_EQ(hits() - hits_before, 2);
+  EXPECT_EQ(misses() - misses_before, 2);
+
+  // Fetching without normalization does not touch the cache.
+  tracker.FetchConnState(false);
+  EXPECT_EQ(hits() - hits_before, 2);
+  EXPECT_EQ(misses() - misses_before, 2);
+
+  // A configuration change affecting normalization invalidates all cached entries.
+  tracker.EnableExternalIPs(true);
+  Connection conn1_normalized("xyz", Endpoint(), Endpoint(IPNet(Address(35, 127, 0, 1), 32), 443), L4Proto::TCP, false);
+  Connection conn2_normalized("xyz", Endpoint(), Endpoint(IPNet(Address(35, 127, 0, 2), 32), 443), L4Proto::TCP, false);
+  EXPECT_THAT(tracker.FetchConnState(true), UnorderedElementsAre(std::make_pair(conn1_normalized, ConnStatus(1000, true)),
+                                                                 std::make_pair(conn2_normalized, ConnStatus(1000, true))));
+  EXPECT_EQ(hits() - hits_before, 2);
+  EXPECT_EQ(misses() - misses_before, 4);
+
+  tracker.UpdateKnownPublicIPs({Address(35, 127, 0, 1)});
+  Connection conn1_public("xyz", Endpoint(), Endpoint(IPNet(Address(35, 127, 0, 1), 0, true), 443), L4Proto::TCP, false);
+  EXPECT_THAT(tracker.FetchConnState(true), UnorderedElementsAre(std::make_pair(conn1_public, ConnStatus(1000, true)),
+                                                                 std::make_pair(conn2_normalized, ConnStatus(1000, true))));
+  EXPECT_EQ(misses() - misses_before, 6);
+
+  tracker.UpdateKnownIPNetworks({{Address::Family::IPV4, {IPNet(Address(35, 127, 0, 0), 24)}}});
+  Connection conn1_public_network("xyz", Endpoint(), Endpoint(IPNet(Address(35, 127, 0, 1), 24, true), 443), L4Proto::TCP, false);
+  Connection conn2_network("xyz", Endpoint(), Endpoint(IPNet(Address(35, 127, 0, 0), 24), 443), L4Proto::TCP, false);
+  EXPECT_THAT(tracker.FetchConnState(true), UnorderedElementsAre(std::make_pair(conn1_public_network, ConnStatus(1000, true)),
+                                                                 std::make_pair(conn2_network, ConnStatus(1000, true))));
+  EXPECT_EQ(misses() - misses_before, 8);
+
+  tracker.UpdateNonAggregatedNetworks({IPNet(Address(35, 127, 0, 2), 32)});
+  Connection conn2_not_aggregated("xyz", Endpoint(), Endpoint(IPNet(Address(35, 127, 0, 2), 0, true), 443), L4Proto::TCP, false);
+  EXPECT_THAT(tracker.FetchConnState(true), UnorderedElementsAre(std::make_pair(conn1_public_network, ConnStatus(1000, true)),
+                                                                 std::make_pair(conn2_not_aggregated, ConnStatus(1000, true))));
+  EXPECT_EQ(misses() - misses_before, 10);
+  EXPECT_EQ(hits() - hits_before, 2);
+}
+
+TEST(ConnTrackerTest, TestUpdateKnownIPNetworksFromTree) {
+  ConnectionTracker tracker;
+  Connection conn("xyz", Endpoint(Address(10, 0, 0, 1), 1234), Endpoint(Address(35, 127, 0, 1), 443), L4Proto::TCP, false);
+  tracker.Update({conn}, {}, 1000);
+  tracker.UpdateNonAggregatedNetworks({IPNet(Address(35, 127, 0, 1), 32)});
+
+  NRadixTree tree;
+  tree.Insert(IPNet(Address(35, 127, 0, 0), 24));
+  tracker.UpdateKnownIPNetworks(NRadixTree(tree), {Address::Family::IPV4});
+
+  // No private network is known for IPv4, so the address is kept without its network.
+  Connection conn_no_network("xyz", Endpoint(), Endpoint(IPNet(Address(35, 127, 0, 1), 0, true), 443), L4Proto::TCP, false);
+  EXPECT_THAT(tracker.FetchConnState(true), UnorderedElementsAre(std::make_pair(conn_no_network, ConnStatus(1000, true))));
+
+  // Whether private networks are known for IPv4 is unknown if its networks were not received.
+  tracker.UpdateKnownIPNetworks(NRadixTree(tree), {Address::Family::IPV6});
+  Connection conn_network("xyz", Endpoint(), Endpoint(IPNet(Address(35, 127, 0, 1), 24, true), 443), L4Proto::TCP, false);
+  EXPECT_THAT(tracker.FetchConnState(true), UnorderedElementsAre(std::make_pair(conn_network, ConnStatus(1000, true))));
+}
+
+TEST(ConnTrackerTest, TestExternalIPsAggregation) {
+  ConnectionTracker tracker;
+  tracker.EnableExternalIPs(true);
+  tracker.SetExternalIPsAggregation(2, 24, 48);
+
+  Endpoint local(Address(10, 0, 0, 1), 1234);
+  Connection conn1("xyz", local, Endpoint(Address(35, 127, 0, 1), 443), L4Proto::TCP, false);
+  Connection conn2("xyz", local, Endpoint(Address(35, 127, 0, 2), 443), L4Proto::TCP, false);
+  Connection conn3("xyz", local, Endpoint(Address(35, 127, 0, 3), 443), L4Proto::TCP, false);
+  Connection conn3_other_port("xyz", local, Endpoint(Address(35, 127, 0, 3), 80), L4Proto::TCP, false);
+  Connection conn4("xyz", local, Endpoint(Address(35, 128, 0, 1), 443), L4Proto::TCP, false);
+  Connection conn4_other_port("xyz", local, Endpoint(Address(35, 128, 0, 1), 80), L4Proto::TCP, false);
+  Connection conn5("xyz", local, Endpoint(Address(35, 128, 0, 2), 443), L4Proto::TCP, false);
+  Connection conn6("xyz", local, Endpoint(Address(35, 128, 0, 3), 443), L4Proto::TCP, false);
+  tracker.Update({conn1, conn2, conn3, conn3_other_port, conn4, conn4_other_port, conn5}, {}, 1000);
+
+  auto normalized = [](const Connection& conn, const IPNet& remote) {
+    return Connection("xyz", Endpoint(), Endpoint(remote, conn.remote().port()), L4Proto::TCP, false);
+  };
+  IPNet subnet(Address(35, 127, 0, 0), 24);
+  IPNet other_subnet(Address(35, 128, 0, 0), 24);
+
+  // Subnets are aggregated by the change-tracking fetch which finds them. 35.127.0.0/24 has three different addresses,
+  // 35.128.0.0/24 only two.
+  ConnMap state;
+  EXPECT_FALSE(tracker.FetchConnStateWithChanges(&state));
+  EXPECT_THAT(state, UnorderedElementsAre(std::make_pair(normalized(conn1, subnet), ConnStatus(1000, true)),
+                                          std::make_pair(normalized(conn3_other_port, subnet), ConnStatus(1000, true)),
+                                          std::make_pair(normalized(conn4, IPNet(Address(35, 128, 0, 1), 32)), ConnStatus(1000, true)),
+                                          std::make_pair(normalized(conn4_other_port, IPNet(Address(35, 128, 0, 1), 32)), ConnStatus(1000, true)),
+                                          std::make_pair(normalized(conn5, IPNet(Address(35, 128, 0, 2), 32)), ConnStatus(1000, true))));
+  // The aggregated subnet is reported as such, whichever connection it was first seen with.
+  for (const auto& entry : state) {
+    if (entry.first.remote().network() == subnet) {
+      EXPECT_EQ(entry.first.remote().address(), Address(35, 127, 0, 0));
+    }
+  }
+  // Other fetches only apply the aggregated subnets, without looking for new ones.
+  EXPECT_EQ(tracker.FetchConnState(true), state);
+
+  // Aggregating does not make the next change-tracking fetch start over.
+  state.clear();
+  EXPECT_TRUE(tracker.FetchConnStateWithChanges(&state));
+  EXPECT_THAT(state, IsEmpty());
+
+  // A third address in 35.128.0.0/24 aggregates it: the connections to its addresses are closed, and replaced by
+  // connections to the subnet. The new connection is never reported with its own address.
+  tracker.AddConnection(conn6, 2000);
+  EXPECT_TRUE(tracker.FetchConnStateWithChanges(&state));
+  EXPECT_THAT(state, SizeIs(5));
+  for (const auto& conn : {conn4, conn4_other_port, conn5}) {
+    const ConnStatus* status = Lookup(state, normalized(conn, IPNet(conn.remote().address(), 32)));
+    ASSERT_NE(status, nullptr);
+    EXPECT_FALSE(status->IsActive());
+  }
+  EXPECT_TRUE(state[normalized(conn6, other_subnet)].IsActive());
+  EXPECT_TRUE(state[normalized(conn4_other_port, other_subnet)].IsActive());
+  EXPECT_THAT(tracker.FetchConnState(true), SizeIs(4));
+
+  // Once there are no connections to a subnet for long enough, it is no longer aggregated.
+  tracker.Update({conn4, conn4_other_port, conn5, conn6}, {}, 3000);
+  state.clear();
+  EXPECT_TRUE(tracker.FetchConnStateWithChanges(&state));
+  EXPECT_THAT(state, UnorderedElementsAre(std::make_pair(normalized(conn1, subnet), ConnStatus(1000, false)),
+                                          std::make_pair(normalized(conn3_other_port, subnet), ConnStatus(1000, false))));
+  for (int i = 0; i < 10; i++) {
+    state.clear();
+    EXPECT_TRUE(tracker.FetchConnStateWithChanges(&state));
+    EXPECT_THAT(state, IsEmpty());
+  }
+  tracker.AddConnection(conn1, 4000);
+  EXPECT_TRUE(tracker.FetchConnStateWithChanges(&state));
+  EXPECT_THAT(state, UnorderedElementsAre(std::make_pair(normalized(conn1, IPNet(Address(35, 127, 0, 1), 32)), ConnStatus(4000, true))));
+  tracker.RemoveConnection(conn1, 4001);
+
+  // Aggregation only applies to external IPs.
+  tracker.EnableExternalIPs(false);
+  IPNet external(Address(255, 255, 255, 255), 0, true);
+  state.clear();
+  EXPECT_FALSE(tracker.FetchConnStateWithChanges(&state));
+  EXPECT_THAT(state, UnorderedElementsAre(std::make_pair(normalized(conn1, external), ConnStatus(3000, true)),
+                                          std::make_pair(normalized(conn4_other_port, external), ConnStatus(3000, true))));
+
+  // Changing the settings starts over.
+  tracker.EnableExternalIPs(true);
+  tracker.SetExternalIPsAggregation(1, 16, 48);
+  tracker.AddConnection(conn3, 5000);
+  state.clear();
+  EXPECT_FALSE(tracker.FetchConnStateWithChanges(&state));
+  EXPECT_THAT(state, UnorderedElementsAre(std::make_pair(normalized(conn3, IPNet(Address(35, 127, 0, 3), 32)), ConnStatus(5000, true)),
+                                          std::make_pair(normalized(conn4, IPNet(Address(35, 128, 0, 0), 16)), ConnStatus(3000, true)),
+                                          std::make_pair(normalized(conn4_other_port, IPNet(Address(35, 128, 0, 0), 16)), ConnStatus(3000, true))));
+}
+
+TEST(ConnTrackerTest, TestAddressCache) {
+  CollectorStats& stats = CollectorStats::GetOrCreate();
+  auto hits = [&stats]() { return stats.GetCounter(CollectorStats::net_conn_address_cache_hit); };
+  auto misses = [&stats]() { return stats.GetCounter(CollectorStats::net_conn_address_cache_miss); };
+
+  // Many connections to the same remote endpoint, spread over all shards. The address is only resolved once per shard.
+  ConnectionTracker tracker;
+  std::vector<Connection> conns;
+  for (uint16_t port = 1; port <= 200; port++) {
+    conns.emplace_back("xyz", Endpoint(Address(10, 0, 0, 1), port), Endpoint(Address(35, 127, 0, 1), 443), L4Proto::TCP, false);
+  }
+  tracker.Update(conns, {}, 1000);
+
+  int64_t hits_before = hits(), misses_before = misses();
+  Connection conn_normalized("xyz", Endpoint(), Endpoint(IPNet(Address(255, 255, 255, 255), 0, true), 443), L4Proto::TCP, false);
+  EXPECT_THAT(tracker.FetchConnState(true), UnorderedElementsAre(std::make_pair(conn_normalized, ConnStatus(1000, true))));
+  EXPECT_EQ(hits() - hits_before + misses() - misses_before, 200);
+  EXPECT_LE(misses() - misses_before, 32);
+
+  // A configuration change affecting normalization invalidates the resolved addresses too.
+  tracker.EnableExternalIPs(true);
+  hits_before = hits(), misses_before = misses();
+  Connection conn_external("xyz", Endpoint(), Endpoint(IPNet(Address(35, 127, 0, 1), 32), 443), L4Proto::TCP, false);
+  EXPECT_THAT(tracker.FetchConnState(true), UnorderedElementsAre(std::make_pair(conn_external, ConnStatus(1000, true))));
+  EXPECT_EQ(hits() - hits_before + misses() - misses_before, 200);
+  EXPECT_GT(misses() - misses_before, 0);
+  EXPECT_LE(misses() - misses_before, 32);
+}
+
+// Layout of a tracked connection before Address was packed into IPNet, and IPNet into Endpoint.
+struct LegacyAddress {
+  std::array<uint64_t, Address::kU64MaxLen> data;
+  Address::Family family;
+};
+
+struct LegacyIPNet {
+  LegacyAddress address;
+  std::array<uint64_t, Address::kU64MaxLen> mask;
+  size_t bits;
+  bool is_addr;
+};
+
+struct LegacyEndpoint {
+  LegacyIPNet network;
+  uint16_t port;
+};
+
+struct LegacyConnection {
+  ContainerId container;
+  LegacyEndpoint local;
+  LegacyEndpoint remote;
+  uint8_t flags;
+
+  bool operator==(const LegacyConnection& other) const {
+    return container == other.container && remote.port == other.remote.port && remote.network.address.data == other.remote.network.address.data;
+  }
+};
+
+struct LegacyConnectionHasher {
+  size_t operator()(const LegacyConnection& conn) const {
+    return HashAll(conn.container, conn.remote.network.address.data, conn.remote.port);
+  }
+};
+
+// Large allocations are served by mmap, and accounted separately from the rest of the heap.
+size_t HeapInUse() {
+  struct mallinfo2 info = mallinfo2();
+  return info.uordblks + info.hblkhd;
+}
+
+// Reports the heap usage per connection stored in `Map`, given a function creating the i-th connection.
+template <typename Map, typename MakeFn>
+double HeapBytesPerConnection(size_t num_connections, const MakeFn& make_fn) {
+  size_t before = HeapInUse();
+  auto m = std::make_unique<Map>();
+  for (size_t i = 0; i < num_connections; i++) {
+    m->emplace(make_fn(i), ConnStatus(1000, true));
+  }
+  EXPECT_EQ(m->size(), num_connections);
+  return static_cast<double>(HeapInUse() - before) / num_connections;
+}
+
+TEST(ConnTrackerTest, TestMemoryPerConnection) {
+  // Heap statistics are not kept when malloc is replaced, as with the address sanitizer.
+  if (HeapInUse() == 0) {
+    GTEST_SKIP() << "Heap usage is not available";
+  }
+
+  using LegacyConnMap = std::unordered_map<LegacyConnection, ConnStatus, LegacyConnectionHasher>;
+  constexpr size_t legacy_entry_size = sizeof(LegacyConnMap::value_type);
+  constexpr size_t entry_size = sizeof(ConnMap::value_type);
+  EXPECT_EQ(legacy_entry_size, 152);
+  EXPECT_LE(2 * entry_size, legacy_entry_size);
+
+  const size_t num_connections = 100000;
+  ContainerId container("0123456789ab");
+  Endpoint local(Address(10, 0, 0, 1), 1234);
+  auto remote_address = [](size_t i) {
+    return Address(10, static_cast<unsigned char>(i >> 16), static_cast<unsigned char>(i >> 8), static_cast<unsigned char>(i));
+  };
+
+  double legacy_bytes = HeapBytesPerConnection<LegacyConnMap>(num_connections, [&](size_t i) {
+    LegacyConnection conn = {};
+    conn.container = container;
+    conn.remote.network.address.data = remote_address(i).array();
+    conn.remote.port = 443;
+    return conn;
+  });
+  double bytes = HeapBytesPerConnection<ConnMap>(num_connections, [&](size_t i) {
+    return Connection(container, local, Endpoint(remote_address(i), 443), L4Proto::TCP, false);
+  });
+
+  size_t before = HeapInUse();
+  ConnectionTracker tracker;
+  for (size_t i = 0; i < num_connections; i++) {
+    tracker.UpdateConnection(Connection(container, local, Endpoint(remote_address(i), 443), L4Proto::TCP, false), 1000, true);
+  }
+  double tracker_bytes = static_cast<double>(HeapInUse() - before) / num_connections;
+
+  // Normalizing fetches only keep the normalized remote addresses, in caches of bounded size, rather than a normalized
+  // copy of every connection.
+  EXPECT_THAT(tracker.FetchConnState(true, false), SizeIs(num_connections));
+  double fetched_tracker_bytes = static_cast<double>(HeapInUse() - before) / num_connections;
+  EXPECT_LT(fetched_tracker_bytes - tracker_bytes, bytes / 2);
+
+  std::cout << "Connection map entry: " << legacy_entry_size << " bytes before, " << entry_size << " bytes after" << std::endl;
+  std::cout << "Heap usage per connection in a map: " << legacy_bytes << " bytes before, " << bytes << " bytes after" << std::endl;
+  std::cout << "Heap usage per connection in the tracker: " << tracker_bytes << " bytes, " << fetched_tracker_bytes << " bytes after a normalizing fetch" << std::endl;
+}
+
+TEST(ConnTrackerTest, TestContainerIdsReleased) {
+  size_t count = ContainerId::InternedCount();
+  Endpoint local(Address(10, 0, 0, 1), 80);
+
+  ConnectionTracker tracker;
+  for (int i = 0; i < 10; i++) {
+    Connection conn("short-lived-" + std::to_string(i), local, Endpoint(Address(10, 0, 1, i), 1234), L4Proto::TCP, true);
+    tracker.AddConnection(conn, 1000);
+    tracker.RemoveConnection(conn, 2000);
+  }
+  EXPECT_EQ(ContainerId::InternedCount(), count + 10);
+
+  EXPECT_THAT(tracker.FetchConnState(false, true), SizeIs(10));
+  EXPECT_THAT(tracker.FetchConnState(), IsEmpty());
+  EXPECT_EQ(ContainerId::InternedCount(), count);
+}
+
+TEST(ConnTrackerTest, TestUpdateConnections) {
+  std::mt19937 gen(42);
+  std::vector<Connection> conns;
+  for (int i = 0; i < 100; i++) {
+    conns.emplace_back("xyz", Endpoint(Address(10, 0, 0, 1), 80), Endpoint(Address(10, 0, 1, i), 1234), L4Proto::TCP, true);
+  }
+
+  // Random updates, with many timestamps ties, so that the order in which updates are applied matters.
+  std::vector<ConnectionTracker::ConnectionUpdate> updates;
+  for (int i = 0; i < 5000; i++) {
+    updates.push_back({conns[gen() % conns.size()], static_cast<int64_t>(gen() % 50), gen() % 2 == 0});
+  }
+
+  ConnectionTracker expected, tracker;
+  for (const auto& update : updates) {
+    expected.UpdateConnection(update.conn, update.timestamp, update.added);
+  }
+  tracker.UpdateConnections(updates);
+  EXPECT_EQ(tracker.FetchConnState(), expected.FetchConnState());
+}
+
+TEST(ConnTrackerTest, TestConnectionUpdateBuffer) {
+  auto tracker = std::make_shared<ConnectionTracker>();
+  Endpoint local(Address(10, 0, 0, 1), 80);
+  Connection conn1("xyz", local, Endpoint(Address(10, 0, 1, 1), 1234), L4Proto::TCP, true);
+  Connection conn2("xyz", local, Endpoint(Address(10, 0, 1, 2), 1234), L4Proto::TCP, true);
+  Connection conn3("xyz", local, Endpoint(Address(10, 0, 1, 3), 1234), L4Proto::TCP, true);
+
+  {
+    ConnectionUpdateBuffer buffer(tracker, 3, 1000);
+
+    // Pending updates are applied before fetching.
+    buffer.UpdateConnection(conn1, 100, true);
+    buffer.UpdateConnection(conn2, 100, true);
+    EXPECT_EQ(buffer.size(), 2);
+    EXPECT_THAT(tracker->FetchConnState(), UnorderedElementsAre(std::make_pair(conn1, ConnStatus(100, true)),
+                                                                std::make_pair(conn2, ConnStatus(100, true))));
+    EXPECT_EQ(buffer.size(), 0);
+
+    // Flush by size.
+    buffer.UpdateConnection(conn1, 200, false);
+    buffer.UpdateConnection(conn2, 200, true);
+    EXPECT_EQ(buffer.size(), 2);
+    buffer.UpdateConnection(conn3, 200, true);
+    EXPECT_EQ(buffer.size(), 0);
+
+    // Flush by age of the oldest pending update.
+    buffer.UpdateConnection(conn2, 300, false);
+    EXPECT_EQ(buffer.size(), 1);
+    buffer.UpdateConnection(conn3, 1300, false);
+    EXPECT_EQ(buffer.size(), 0);
+
+    buffer.UpdateConnection(conn1, 1400, true);
+    EXPECT_EQ(buffer.size(), 1);
+  }
+
+  // Destroying the buffer applies the remaining updates.
+  EXPECT_THAT(tracker->FetchConnState(), UnorderedElementsAre(std::make_pair(conn1, ConnStatus(1400, true)),
+                                                              std::make_pair(conn2, ConnStatus(300, false)),
+                                                              std::make_pair(conn3, ConnStatus(1300, false))));
+}
+
+TEST(ConnTrackerTest, TestStateSnapshots) {
+  ConnectionTracker tracker;
+  tracker.SetSnapshotMaxAge(3600000000);
+  Endpoint local(Address(10, 0, 0, 1), 80);
+  Connection conn1("xyz", local, Endpoint(Address(10, 0, 1, 1), 1234), L4Proto::TCP, true);
+  Connection conn2("xyz", local, Endpoint(Address(10, 0, 1, 2), 1234), L4Proto::TCP, true);
+  ContainerEndpoint cep("xyz", local, L4Proto::TCP, nullptr);
+
+  tracker.Update({conn1}, {cep}, 1000);
+  auto snapshot = tracker.GetConnStateSnapshot(false);
+  EXPECT_EQ(*snapshot, tracker.FetchConnState(false, false));
+  auto normalized_snapshot = tracker.GetConnStateSnapshot(true);
+  EXPECT_EQ(*normalized_snapshot, tracker.FetchConnState(true, false));
+  auto endpoint_snapshot = tracker.GetEndpointStateSnapshot(false);
+  EXPECT_EQ(*endpoint_snapshot, tracker.FetchEndpointState(false, false));
+
+  // Snapshots are reused while they are valid, even if the state changed.
+  tracker.UpdateConnection(conn2, 2000, true);
+  EXPECT_EQ(tracker.GetConnStateSnapshot(false), snapshot);
+  EXPECT_EQ(tracker.GetConnStateSnapshot(true), normalized_snapshot);
+  EXPECT_EQ(tracker.GetEndpointStateSnapshot(false), endpoint_snapshot);
+
+  // Removing inactive connections invalidates them.
+  tracker.Update({conn2}, {}, 3000);
+  tracker.FetchConnState(false, true);
+  auto new_snapshot = tracker.GetConnStateSnapshot(false);
+  EXPECT_NE(new_snapshot, snapshot);
+  EXPECT_THAT(*new_snapshot, UnorderedElementsAre(std::make_pair(conn2, ConnStatus(3000, true))));
+  EXPECT_NE(tracker.GetEndpointStateSnapshot(false), endpoint_snapshot);
+  // Previously returned snapshots are still valid.
+  EXPECT_THAT(*snapshot, UnorderedElementsAre(std::make_pair(conn1, ConnStatus(1000, true))));
+
+  // So does a configuration change.
+  snapshot = new_snapshot;
+  tracker.UpdateIgnoredNetworks({IPNet(Address(10, 0, 1, 2), 32)});
+  EXPECT_THAT(*tracker.GetConnStateSnapshot(false), IsEmpty());
+
+  // And so does age.
+  snapshot = tracker.GetConnStateSnapshot(false);
+  tracker.SetSnapshotMaxAge(0);
+  EXPECT_NE(tracker.GetConnStateSnapshot(false), snapshot);
+}
+
+TEST(ConnTrackerTest, TestConnectionLimitEvictsInactiveFirst) {
+  CollectorStats& stats = CollectorStats::GetOrCreate();
+  int64_t evicted_before = stats.GetCounter(CollectorStats::net_conn_evicted_inactive);
+
+  ConnectionTracker tracker;
+  tracker.SetMaxConnections(3200);
+  Endpoint local(Address(10, 0, 0, 1), 80);
+  auto make_conn = [&local](int i) {
+    return Connection("xyz", local, Endpoint(Address(10, 1, i >> 8, i & 0xff), 1234), L4Proto::TCP, true);
+  };
+
+  // Most connections are closed, the older ones having the smaller timestamps.
+  for (int i = 0; i < 10000; i++) {
+    tracker.UpdateConnection(make_conn(i), 1000 + i, i % 10 == 0);
+  }
+
+  // All active connections are kept, and only the most recent inactive ones are.
+  auto state = tracker.FetchConnState();
+  EXPECT_LE(state.size(), 3200);
+  size_t num_active = 0;
+  for (const auto& entry : state) {
+    if (entry.second.IsActive()) {
+      num_active++;
+    } else {
+      EXPECT_GE(entry.second.LastActiveTime(), 1000 + 5000);
+    }
+  }
+  EXPECT_EQ(num_active, 1000);
+  EXPECT_GT(stats.GetCounter(CollectorStats::net_conn_evicted_inactive) - evicted_before, 0);
+}
+
+TEST(ConnTrackerTest, TestConnectionLimitIsFairAcrossContainers) {
+  CollectorStats& stats = CollectorStats::GetOrCreate();
+  int64_t evicted_before = stats.GetCounter(CollectorStats::net_conn_evicted_active);
+
+  ConnectionTracker tracker;
+  tracker.SetMaxConnections(3200);
+  Endpoint local(Address(10, 0, 0, 1), 80);
+
+  // A quiet container, then a chatty one opening many more connections.
+  for (int i = 0; i < 500; i++) {
+    tracker.AddConnection(Connection("quiet", local, Endpoint(Address(10, 1, 0, i & 0xff), 1000 + i), L4Proto::TCP, true), 1000);
+  }
+  for (int i = 0; i < 20000; i++) {
+    tracker.AddConnection(Connection("chatty", local, Endpoint(Address(10, 2, i >> 8, i & 0xff), 1234), L4Proto::TCP, true), 2000 + i);
+  }
+
+  size_t quiet = 0, chatty = 0;
+  for (const auto& entry : tracker.FetchConnState()) {
+    (entry.first.container() == "quiet" ? quiet : chatty)++;
+  }
+  EXPECT_EQ(quiet, 500);
+  EXPECT_LE(quiet + chatty, 3200);
+  EXPECT_GT(chatty, 1000);
+  EXPECT_GT(stats.GetCounter(CollectorStats::net_conn_evicted_active) - evicted_before, 0);
+}
+
+TEST(ConnTrackerTest, TestConnectionLimitBytes) {
+  ConnectionTracker tracker;
+  tracker.SetMaxConnections(5000);
+  tracker.SetMaxConnectionBytes(64 * 1024);
+  Endpoint local(Address(10, 0, 0, 1), 80);
+
+  for (int i = 0; i < 5000; i++) {
+    tracker.AddConnection(Connection("xyz", local, Endpoint(Address(10, 1, i >> 8, i & 0xff), 1234), L4Proto::TCP, true), 1000 + i);
+  }
+
+  // The lowest of both limits applies.
+  size_t size = tracker.FetchConnState(false, false).size();
+  EXPECT_GT(size, 0);
+  EXPECT_LE(size, 64 * 1024 / sizeof(ConnMap::value_type));
+
+  tracker.SetMaxConnectionBytes(0);
+  for (int i = 0; i < 5000; i++) {
+    tracker.AddConnection(Connection("xyz", local, Endpoint(Address(10, 1, i >> 8, i & 0xff), 1234), L4Proto::TCP, true), 7000 + i);
+  }
+  EXPECT_EQ(tracker.FetchConnState(false, false).size(), 5000);
+}
+
+TEST(ConnTrackerTest, TestConnectionLimitKeepsEvictedActiveConnectionsOpen) {
+  ConnectionTracker tracker;
+  tracker.SetMaxConnections(100);
+  Endpoint local(Address(10, 0, 0, 1), 80);
+  auto make_conn = [&local](uint8_t i) {
+    return Connection("xyz", local, Endpoint(Address(10, 0, 1, i), 1234), L4Proto::TCP, true);
+  };
+  auto normalized = [](uint8_t i) {
+    return Connection("xyz", Endpoint(IPNet(Address()), 80), Endpoint(IPNet(Address(10, 0, 1, i), 0, true), 0), L4Proto::TCP, true);
+  };
+
+  tracker.Update({}, {}, 500);
+  for (int i = 0; i < 90; i++) {
+    tracker.AddConnection(make_conn(i), 1000 + i);
+  }
+  ConnMap state;
+  EXPECT_FALSE(tracker.FetchConnStateWithChanges(&state));
+  EXPECT_THAT(state, SizeIs(90));
+
+  // Going over the limit evicts the oldest active connections down to 7/8 of it, which are not reported as closed.
+  for (int i = 90; i < 101; i++) {
+    tracker.AddConnection(make_conn(i), 2000 + i);
+  }
+  state.clear();
+  EXPECT_TRUE(tracker.FetchConnStateWithChanges(&state));
+  EXPECT_THAT(state, SizeIs(11));
+  for (int i = 90; i < 101; i++) {
+    EXPECT_EQ(state[normalized(i)], ConnStatus(2000 + i, true));
+  }
+  state.clear();
+  EXPECT_TRUE(tracker.FetchConnStateWithChanges(&state));
+  EXPECT_THAT(state, IsEmpty());
+
+  // A scrape tells which of them are still open: these are not reported again, the others are closed.
+  std::vector<Connection> scraped;
+  for (int i = 0; i < 101; i++) {
+    if (i < 10 || i >= 13) {
+      scraped.push_back(make_conn(i));
+    }
+  }
+  tracker.Update(scraped, {}, 3000);
+  state.clear();
+  EXPECT_TRUE(tracker.FetchConnStateWithChanges(&state));
+  EXPECT_THAT(state, SizeIs(3));
+  for (int i = 10; i < 13; i++) {
+    EXPECT_EQ(state[normalized(i)], ConnStatus(1000 + i, false));
+  }
+}
+
+TEST(ConnTrackerTest, TestConnectionLimitPerContainer) {
+  CollectorStats& stats = CollectorStats::GetOrCreate();
+  int64_t limited_before = stats.GetCounter(CollectorStats::net_conn_container_limited);
+
+  ConnectionTracker tracker;
+  tracker.SetMaxConnectionsPerContainer(320);
+  Endpoint local(Address(10, 0, 0, 1), 80);
+  auto make_conn = [&local](const char* container, int i) {
+    return Connection(container, local, Endpoint(Address(10, 1, i >> 8, i & 0xff), 1234), L4Proto::TCP, true);
+  };
+
+  for (int i = 0; i < 5000; i++) {
+    tracker.AddConnection(make_conn("chatty", i), 1000);
+  }
+  for (int i = 0; i < 100; i++) {
+    tracker.AddConnection(make_conn("quiet", i), 1000);
+  }
+
+  auto count = [](const ConnMap& state, const std::string& container) {
+    return std::count_if(state.begin(), state.end(), [&container](const auto& entry) { return entry.first.container() == container; });
+  };
+  auto state = tracker.FetchConnState(false, false);
+  EXPECT_EQ(count(state, "chatty"), 320);
+  EXPECT_EQ(count(state, "quiet"), 100);
+  int64_t limited = stats.GetCounter(CollectorStats::net_conn_container_limited) - limited_before;
+  EXPECT_EQ(limited, 5000 - count(state, "chatty"));
+
+  // Connections that are already tracked can still be updated.
+  for (const auto& entry : state) {
+    tracker.RemoveConnection(entry.first, 2000);
+  }
+  EXPECT_EQ(stats.GetCounter(CollectorStats::net_conn_container_limited) - limited_before, limited);
+
+  // Removing inactive connections frees up room for new ones.
+  EXPECT_EQ(tracker.FetchConnState().size(), state.size());
+  for (int i = 0; i < 5000; i++) {
+    tracker.AddConnection(make_conn("chatty", 10000 + i), 3000);
+  }
+  EXPECT_EQ(count(tracker.FetchConnState(false, false), "chatty"), count(state, "chatty"));
+
+  // Lifting the limit lets all connections in.
+  tracker.SetMaxConnectionsPerContainer(0);
+  for (int i = 0; i < 5000; i++) {
+    tracker.AddConnection(make_conn("chatty", i), 4000);
+  }
+  EXPECT_EQ(count(tracker.FetchConnState(false, false), "chatty"), 5000 + count(state, "chatty"));
+}
+
+TEST(ConnTrackerTest, TestFetchConnStateWithChanges) {
+  CollectorStats& stats = CollectorStats::GetOrCreate();
+  auto address_lookups = [&stats]() {
+    return stats.GetCounter(CollectorStats::net_conn_address_cache_hit) + stats.GetCounter(CollectorStats::net_conn_address_cache_miss);
+  };
+
+  ConnectionTracker tracker;
+  Endpoint local(Address(10, 0, 0, 1), 80);
+  auto make_conn = [&local](uint8_t i, uint16_t port = 1234) {
+    return Connection("xyz", local, Endpoint(Address(10, 0, 1, i), port), L4Proto::TCP, true);
+  };
+  auto normalized = [](uint8_t i) {
+    return Connection("xyz", Endpoint(IPNet(Address()), 80), Endpoint(IPNet(Address(10, 0, 1, i), 0, true), 0), L4Proto::TCP, true);
+  };
+
+  // The full state is fetched the first time.
+  ConnMap state;
+  tracker.Update({make_conn(1), make_conn(2)}, {}, 1000);
+  EXPECT_FALSE(tracker.FetchConnStateWithChanges(&state));
+  EXPECT_THAT(state, UnorderedElementsAre(std::make_pair(normalized(1), ConnStatus(1000, true)),
+                                          std::make_pair(normalized(2), ConnStatus(1000, true))));
+
+  // Connections that stay active are left out, whatever their timestamps, and are not even normalized again.
+  state.clear();
+  tracker.Update({make_conn(1), make_conn(2)}, {}, 2000);
+  int64_t lookups_before = address_lookups();
+  EXPECT_TRUE(tracker.FetchConnStateWithChanges(&state));
+  EXPECT_THAT(state, IsEmpty());
+  EXPECT_EQ(address_lookups(), lookups_before);
+
+  // New and closed connections are not. Closed connections are only fetched once.
+  tracker.Update({make_conn(1), make_conn(3)}, {}, 3000);
+  EXPECT_TRUE(tracker.FetchConnStateWithChanges(&state));
+  EXPECT_THAT(state, UnorderedElementsAre(std::make_pair(normalized(2), ConnStatus(2000, false)),
+                                          std::make_pair(normalized(3), ConnStatus(3000, true))));
+  state.clear();
+  EXPECT_TRUE(tracker.FetchConnStateWithChanges(&state));
+  EXPECT_THAT(state, IsEmpty());
+
+  // A normalized connection is only closed once all the connections it is made of are, including the ones removed
+  // by other fetches.
+  tracker.AddConnection(make_conn(3, 4321), 4000);
+  tracker.RemoveConnection(make_conn(3), 4000);
+  EXPECT_TRUE(tracker.FetchConnStateWithChanges(&state));
+  EXPECT_THAT(state, IsEmpty());
+  tracker.RemoveConnection(make_conn(3, 4321), 5000);
+  EXPECT_THAT(tracker.FetchConnState(true, true), SizeIs(2));
+  EXPECT_TRUE(tracker.FetchConnStateWithChanges(&state));
+  EXPECT_THAT(state, UnorderedElementsAre(std::make_pair(normalized(3), ConnStatus(5000, false))));
+
+  // A configuration change gets the full state again, once.
+  state.clear();
+  tracker.UpdateKnownPublicIPs({Address(10, 0, 1, 1)});
+  EXPECT_FALSE(tracker.FetchConnStateWithChanges(&state));
+  EXPECT_THAT(state, SizeIs(1));
+  state.clear();
+  EXPECT_TRUE(tracker.FetchConnStateWithChanges(&state));
+  EXPECT_THAT(state, IsEmpty());
+}
+
+// Each stream to Sensor starts with an empty reported state, as the delta stage does, so the full state must be
+// fetched again for the connections which stayed active to be reported on the new stream.
+TEST(ConnTrackerTest, TestResetChangeTrackingReportsActiveConnectionsAgain) {
+  const int64_t afterglow_period = 2500;
+  ConnectionTracker tracker;
+  Connection conn("xyz", Endpoint(Address(10, 0, 0, 1), 80), Endpoint(Address(10, 0, 1, 1), 1234), L4Proto::TCP, true);
+  Connection normalized("xyz", Endpoint(IPNet(Address()), 80), Endpoint(IPNet(Address(10, 0, 1, 1), 0, true), 0), L4Proto::TCP, true);
+
+  // Fetches the changes as the delta stage does, returning the delta to report.
+  auto report = [&tracker](ReportedConnState* reported_state, int64_t now) {
+    ConnMap changes, delta;
+    if (tracker.FetchConnStateWithChanges(&changes)) {
+      reported_state->ComputeDeltaAfterglow(changes, &delta, now, now - 1000, afterglow_period);
+    } else {
+      ConnMap old_state = reported_state->Release();
+      CT::ComputeDeltaAfterglow(changes, old_state, delta, now, now - 1000, afterglow_period);
+      CT::UpdateOldState(&old_state, changes, now, afterglow_period);
+      reported_state->Reset(std::move(old_state), std::move(changes));
+    }
+    return delta;
+  };
+
+  ReportedConnState first_stream;
+  tracker.Update({conn}, {}, 1000);
+  EXPECT_THAT(report(&first_stream, 1000), UnorderedElementsAre(std::make_pair(normalized, ConnStatus(1000, true))));
+  tracker.Update({conn}, {}, 2000);
+  EXPECT_THAT(report(&first_stream, 2000), IsEmpty());
+
+  // Without a reset, the new stream would never hear about the connection.
+  ReportedConnState second_stream;
+  tracker.ResetChangeTracking();
+  tracker.Update({conn}, {}, 3000);
+  EXPECT_THAT(report(&second_stream, 3000), UnorderedElementsAre(std::make_pair(normalized, ConnStatus(3000, true))));
+  tracker.Update({conn}, {}, 4000);
+  EXPECT_THAT(report(&second_stream, 4000), IsEmpty());
+}
+
+// Checks that deltas computed by ReportedConnState from the changes only are the same as the ones computed from the
+// full states of a twin tracker, over a random sequence of connection updates and configuration changes.
+TEST(ConnTrackerTest, TestReportedConnStateMatchesFullDelta) {
+  std::mt19937 gen(1234);
+  auto rand = [&gen](int max) { return std::uniform_int_distribution<int>(0, max)(gen); };
+
+  const int64_t scrape_interval = 1000;
+  const int64_t afterglow_period = 2500;
+
+  std::vector<Connection> conns;
+  for (int i = 0; i < 200; i++) {
+    std::string container = "container" + std::to_string(i % 3);
+    Endpoint local(Address(10, 0, 0, 1 + i % 2), 80 + i % 4);
+    // Remote ports of server connections are normalized away, so several connections share a normalized form.
+    Address remote_addr = (i % 5 == 0) ? Address(35, 127, 0, i % 7) : Address(10, 1, 0, i % 11);
+    conns.emplace_back(container, local, Endpoint(remote_addr, 40000 + i), L4Proto::TCP, i % 3 != 0);
+  }
+
+  ConnectionTracker tracker, full_tracker;
+  ReportedConnState reported_state;
+  ConnMap full_old_state;
+  int64_t time_at_last_scrape = 0;
+  int incremental_ticks = 0;
+
+  for (int tick = 1; tick <= 300; tick++) {
+    int64_t now = tick * scrape_interval;
+
+    for (int i = 0, n = rand(30); i < n; i++) {
+      const Connection& conn = conns[rand(conns.size() - 1)];
+      int64_t timestamp = now - rand(2 * scrape_interval);
+      bool added = rand(1) == 0;
+      tracker.UpdateConnection(conn, timestamp, added);
+      full_tracker.UpdateConnection(conn, timestamp, added);
+    }
+    if (rand(3) == 0) {
+      std::vector<Connection> scraped;
+      for (const auto& conn : conns) {
+        if (rand(2) == 0) {
+          scraped.push_back(conn);
+        }
+      }
+      int64_t timestamp = now - rand(scrape_interval);
+      tracker.Update(scraped, {}, timestamp);
+      full_tracker.Update(scraped, {}, timestamp);
+    }
+    if (rand(20) == 0) {
+      Address public_ip(35, 127, 0, rand(6));
+      tracker.UpdateKnownPublicIPs({public_ip});
+      full_tracker.UpdateKnownPublicIPs({public_ip});
+    }
+    if (rand(30) == 0) {
+      bool enable = rand(1) == 0;
+      tracker.EnableExternalIPs(enable);
+      full_tracker.EnableExternalIPs(enable);
+    }
+
+    ConnMap new_state;
+    bool incremental = tracker.FetchConnStateWithChanges(&new_state);
+
+    ConnMap full_new_state = full_tracker.FetchConnState(true, true);
+    ConnMap expected_delta;
+    CT::ComputeDeltaAfterglow(full_new_state, full_old_state, expected_delta, now, time_at_last_scrape, afterglow_period);
+    ConnMap updated_old_state = full_old_state;
+    CT::UpdateOldState(&updated_old_state, full_new_state, now, afterglow_period);
+    if (incremental) {
+      // Connections which stay active keep the status they were first reported with.
+      for (auto& entry : updated_old_state) {
+        auto old_it = full_old_state.find(entry.first);
+        if (entry.second.IsActive() && old_it != full_old_state.end() && old_it->second.IsActive()) {
+          entry.second = old_it->second;
+        }
+      }
+    }
+    full_old_state = std::move(updated_old_state);
+
+    ConnMap delta;
+    if (incremental) {
+      EXPECT_LE(new_state.size(), full_new_state.size());
+      reported_state.ComputeDeltaAfterglow(new_state, &delta, now, time_at_last_scrape, afterglow_period);
+      incremental_ticks++;
+    } else {
+      EXPECT_EQ(new_state, full_new_state);
+      ConnMap old_state = reported_state.Release();
+      CT::ComputeDeltaAfterglow(new_state, old_state, delta, now, time_at_last_scrape, afterglow_period);
+      CT::UpdateOldState(&old_state, new_state, now, afterglow_period);
+      reported_state.Reset(std::move(old_state), std::move(new_state));
+    }
+
+    ASSERT_EQ(delta, expected_delta) << "at tick " << tick;
+    ASSERT_EQ(reported_state.size(), full_old_state.size()) << "at tick " << tick;
+    time_at_last_scrape = now;
+  }
+
+  EXPECT_GT(incremental_ticks, 200);
+  EXPECT_EQ(reported_state.Release(), full_old_state);
+}
+
 }  // namespace
 
 }  // namespace collector
@@ -0,0 +1,252 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ConnTracker.h"
+#include "Hash.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace collector {
+
+namespace {
+
+using ::testing::IsEmpty;
+using ::testing::UnorderedElementsAre;
+
+// Integer keys whose hash is the identity, which is the worst case for the slot distribution.
+using IntMap = FlatHashMap<uint64_t, int>;
+
+TEST(FlatHashMapTest, InsertFindErase) {
+  FlatHashMap<std::string, int> m;
+  EXPECT_TRUE(m.empty());
+  EXPECT_EQ(m.find("a"), m.end());
+
+  auto res = m.insert({"a", 1});
+  EXPECT_TRUE(res.second);
+  EXPECT_EQ(res.first->first, "a");
+  EXPECT_EQ(res.first->second, 1);
+
+  res = m.emplace("a", 2);
+  EXPECT_FALSE(res.second);
+  EXPECT_EQ(res.first->second, 1);
+
+  m["b"] = 2;
+  m.try_emplace("c", 3);
+  EXPECT_EQ(m.size(), 3);
+  EXPECT_EQ(m.count("b"), 1);
+  EXPECT_EQ(m.count("d"), 0);
+  EXPECT_EQ(m.at("c"), 3);
+  EXPECT_THROW(m.at("d"), std::out_of_range);
+  EXPECT_THAT(m, UnorderedElementsAre(std::make_pair("a", 1), std::make_pair("b", 2), std::make_pair("c", 3)));
+
+  EXPECT_EQ(m.erase("b"), 1);
+  EXPECT_EQ(m.erase("b"), 0);
+  EXPECT_EQ(m.find("b"), m.end());
+  EXPECT_EQ(m.size(), 2);
+
+  m.clear();
+  EXPECT_THAT(m, IsEmpty());
+  EXPECT_EQ(m.begin(), m.end());
+}
+
+TEST(FlatHashMapTest, EraseWhileIterating) {
+  IntMap m;
+  for (uint64_t i = 0; i < 1000; i++) {
+    m.emplace(i, static_cast<int>(i));
+  }
+
+  for (auto it = m.begin(); it != m.end();) {
+    if (it->first % 3 == 0) {
+      it = m.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  EXPECT_EQ(m.size(), 666);
+  for (uint64_t i = 0; i < 1000; i++) {
+    EXPECT_EQ(m.count(i), i % 3 == 0 ? 0 : 1) << i;
+  }
+}
+
+TEST(FlatHashMapTest, TombstonesAreReclaimed) {
+  IntMap m;
+  m.reserve(100);
+  size_t capacity = m.bucket_count();
+
+  // Keep the number of elements constant while churning through keys. The table must not grow.
+  for (uint64_t i = 0; i < 100000; i++) {
+    m.emplace(i, 0);
+    if (i >= 50) {
+      EXPECT_EQ(m.erase(i - 50), 1);
+    }
+  }
+  EXPECT_EQ(m.size(), 50);
+  EXPECT_EQ(m.bucket_count(), capacity);
+  for (uint64_t i = 100000 - 50; i < 100000; i++) {
+    EXPECT_EQ(m.count(i), 1);
+  }
+}
+
+TEST(FlatHashMapTest, CopyMoveAndCompare) {
+  FlatHashMap<std::string, std::string> m = {{"a", "1"}, {"b", "2"}};
+  auto copy = m;
+  EXPECT_EQ(copy, m);
+
+  copy["b"] = "3";
+  EXPECT_NE(copy, m);
+  EXPECT_EQ(m["b"], "2");
+
+  auto moved = std::move(copy);
+  EXPECT_EQ(moved["b"], "3");
+  EXPECT_THAT(copy, IsEmpty());
+
+  copy = m;
+  EXPECT_EQ(copy, m);
+  swap(copy, moved);
+  EXPECT_EQ(moved, m);
+  EXPECT_EQ(copy["b"], "3");
+}
+
+TEST(FlatHashMapTest, MatchesStdUnorderedMap) {
+  std::mt19937_64 gen(42);
+  std::uniform_int_distribution<uint64_t> key_distr(0, 5000);
+  std::uniform_int_distribution<int> op_distr(0, 3);
+
+  IntMap flat;
+  std::unordered_map<uint64_t, int> ref;
+
+  for (int i = 0; i < 200000; i++) {
+    uint64_t key = key_distr(gen);
+    switch (op_distr(gen)) {
+      case 0:
+      case 1: {
+        auto flat_res = flat.emplace(key, i);
+        auto ref_res = ref.emplace(key, i);
+        ASSERT_EQ(flat_res.second, ref_res.second);
+        ASSERT_EQ(flat_res.first->second, ref_res.first->second);
+        break;
+      }
+      case 2:
+        ASSERT_EQ(flat.erase(key), ref.erase(key));
+        break;
+      case 3: {
+        auto it = flat.find(key);
+        auto ref_it = ref.find(key);
+        ASSERT_EQ(it == flat.end(), ref_it == ref.end());
+        if (it != flat.end()) {
+          ASSERT_EQ(it->second, ref_it->second);
+        }
+        break;
+      }
+    }
+    ASSERT_EQ(flat.size(), ref.size());
+  }
+
+  size_t count = 0;
+  for (const auto& entry : flat) {
+    auto ref_it = ref.find(entry.first);
+    ASSERT_NE(ref_it, ref.end());
+    EXPECT_EQ(entry.second, ref_it->second);
+    count++;
+  }
+  EXPECT_EQ(count, ref.size());
+}
+
+TEST(FlatHashMapTest, ConnectionKeys) {
+  using FlatConnMap = FlatHashMap<Connection, ConnStatus>;
+  Endpoint local(Address(10, 0, 0, 1), 80);
+
+  FlatConnMap m;
+  for (uint16_t port = 1; port <= 1000; port++) {
+    m.emplace(Connection("xyz", local, Endpoint(Address(10, 0, 1, 1), port), L4Proto::TCP, true), ConnStatus(port, true));
+  }
+  EXPECT_EQ(m.size(), 1000);
+
+  Connection conn("xyz", local, Endpoint(Address(10, 0, 1, 1), 500), L4Proto::TCP, true);
+  auto it = m.find(conn);
+  ASSERT_NE(it, m.end());
+  EXPECT_EQ(it->second, ConnStatus(500, true));
+  EXPECT_EQ(m.find(Connection("abc", local, Endpoint(Address(10, 0, 1, 1), 500), L4Proto::TCP, true)), m.end());
+}
+
+std::vector<Connection> CreateConnections(size_t num_connections) {
+  std::vector<Connection> connections;
+  connections.reserve(num_connections);
+  Endpoint local(Address(10, 0, 0, 1), 443);
+  for (size_t i = 0; i < num_connections; i++) {
+    Endpoint remote(Address(10, (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff), static_cast<uint16_t>(1024 + (i >> 24)));
+    connections.emplace_back(std::to_string(i % 256), local, remote, L4Proto::TCP, true);
+  }
+  return connections;
+}
+
+template <typename Map>
+void BenchmarkMap(const std::string& name, const std::vector<Connection>& connections) {
+  using Clock = std::chrono::steady_clock;
+  std::chrono::duration<double, std::milli> dur;
+
+  // Lookups happen in an order unrelated to the insertion order, otherwise node-based maps would benefit from their
+  // nodes having been allocated sequentially.
+  std::vector<const Connection*> lookups;
+  lookups.reserve(connections.size());
+  for (const auto& conn : connections) {
+    lookups.push_back(&conn);
+  }
+  std::shuffle(lookups.begin(), lookups.end(), std::mt19937_64(42));
+
+  Map m;
+  auto t1 = Clock::now();
+  for (const auto& conn : connections) {
+    m.emplace(conn, ConnStatus(1000, true));
+  }
+  auto t2 = Clock::now();
+  dur = t2 - t1;
+  std::cout << name << ": insert " << connections.size() << " connections: " << dur.count() << " ms\n";
+
+  size_t found = 0;
+  t1 = Clock::now();
+  for (const auto* conn : lookups) {
+    found += m.count(*conn);
+  }
+  t2 = Clock::now();
+  dur = t2 - t1;
+  EXPECT_EQ(found, connections.size());
+  std::cout << name << ": find " << connections.size() << " connections: " << dur.count() << " ms\n";
+
+  int64_t sum = 0;
+  t1 = Clock::now();
+  for (const auto& entry : m) {
+    sum += entry.second.LastActiveTime();
+  }
+  t2 = Clock::now();
+  dur = t2 - t1;
+  EXPECT_EQ(sum, 1000 * static_cast<int64_t>(connections.size()));
+  std::cout << name << ": iterate " << connections.size() << " connections: " << dur.count() << " ms\n";
+
+  t1 = Clock::now();
+  for (const auto* conn : lookups) {
+    m.erase(*conn);
+  }
+  t2 = Clock::now();
+  dur = t2 - t1;
+  EXPECT_TRUE(m.empty());
+  std::cout << name << ": erase " << connections.size() << " connections: " << dur.count() << " ms\n";
+}
+
+TEST(FlatHashMapTest, Benchmark) {
+  for (size_t num_connections : {10000, 100000, 1000000}) {
+    auto connections = CreateConnections(num_connections);
+    BenchmarkMap<std::unordered_map<Connection, ConnStatus, Hasher>>("std::unordered_map", connections);
+    BenchmarkMap<FlatHashMap<Connection, ConnStatus>>("FlatHashMap", connections);
+  }
+}
+
+}  // namespace
+
+}  // namespace collector
@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <memory>
 #include <random>
 
 #include "Containers.h"
@@ -372,6 +374,257 @@ TEST(NRadixTest, BenchMarkNetworkLookup) {
   std::cout << "Avg time to lookup " << num_nets << " addresses without network radix tree (#networks:" << num_nets << "): " << (aggr_dur_without_tree / num_nets) << "ms\n";
 }
 
+// Uncompressed radix tree with one heap-allocated node per bit, the way NRadixTree used to be implemented. It serves as
+// a reference for lookup results and as a baseline for the benchmark below.
+class BitRadixTree {
+ public:
+  void Insert(const IPNet& network) {
+    Node* node = &roots_[network.family() == Address::Family::IPV6];
+    const Address address = network.address();
+    for (size_t i = 0; i < network.bits(); i++) {
+      auto& next = node->children[GetBit(address, i)];
+      if (!next) {
+        next = std::make_unique<Node>();
+      }
+      node = next.get();
+    }
+    node->value = std::make_unique<IPNet>(network);
+  }
+
+  IPNet Find(const Address& address) const {
+    const Node* node = &roots_[address.family() == Address::Family::IPV6];
+    IPNet ret;
+    for (size_t i = 0; node; i++) {
+      if (node->value) {
+        ret = *node->value;
+      }
+      if (i == Address::kMaxLen * 8) {
+        break;
+      }
+      node = node->children[GetBit(address, i)].get();
+    }
+    return ret;
+  }
+
+ private:
+  struct Node {
+    std::unique_ptr<Node> children[2];
+    std::unique_ptr<IPNet> value;
+  };
+
+  static int GetBit(const Address& address, size_t i) {
+    return (ntohll(address.u64_data()[i / 64]) >> (63 - i % 64)) & 1;
+  }
+
+  Node roots_[2];
+};
+
+// Returns a random address within the given network.
+Address RandomAddressIn(const IPNet& network, std::mt19937_64& gen) {
+  std::array<uint64_t, 2> addr = {ntohll(network.address().u64_data()[0]), ntohll(network.address().u64_data()[1])};
+  for (size_t i = network.bits(); i < 8 * network.address().length(); i++) {
+    uint64_t bit = 1ULL << (63 - i % 64);
+    addr[i / 64] = (gen() & 1) ? (addr[i / 64] | bit) : (addr[i / 64] & ~bit);
+  }
+  if (network.family() == Address::Family::IPV4) {
+    return Address(htonl(static_cast<uint32_t>(addr[0] >> 32)));
+  }
+  return Address(htonll(addr[0]), htonll(addr[1]));
+}
+
+// Returns distinct random networks. Half of them are IPv4 and half IPv6. A third of them are subnets of a previously
+// generated one, so that lookups have to find the smallest of several matching networks.
+std::vector<IPNet> RandomNetworks(size_t num_nets, std::mt19937_64& gen) {
+  std::uniform_int_distribution<int> ipv4_bits_distr(8, 32);
+  std::uniform_int_distribution<int> ipv6_bits_distr(32, 128);
+
+  UnorderedSet<IPNet> network_set;
+  std::vector<IPNet> networks;
+  while (networks.size() < num_nets) {
+    bool ipv6 = networks.size() % 2;
+    Address addr = ipv6 ? Address(gen(), gen()) : Address(static_cast<uint32_t>(gen()));
+    size_t bits = ipv6 ? ipv6_bits_distr(gen) : ipv4_bits_distr(gen);
+    if (networks.size() % 3 == 2) {
+      const IPNet& supernet = networks[gen() % networks.size()];
+      addr = RandomAddressIn(supernet, gen);
+      bits = std::min(supernet.bits() + 1 + gen() % 16, 8 * addr.length());
+    }
+    IPNet network(addr, bits);
+    if (network_set.insert(network).second) {
+      networks.push_back(network);
+    }
+  }
+  return networks;
+}
+
+TEST(NRadixTest, BenchmarkAgainstBitRadixTree) {
+  const size_t num_nets = 10000, num_lookups = 100000;
+  std::mt19937_64 gen(42);
+  std::vector<IPNet> networks = RandomNetworks(num_nets, gen);
+
+  // Most looked up addresses belong to a known network, as is the case for the cluster's own traffic.
+  std::vector<Address> lookups;
+  for (size_t i = 0; i < num_lookups; i++) {
+    if (i % 10 == 0) {
+      lookups.push_back(i % 20 ? Address(gen(), gen()) : Address(static_cast<uint32_t>(gen())));
+    } else {
+      lookups.push_back(RandomAddressIn(networks[gen() % networks.size()], gen));
+    }
+  }
+
+  using Clock = std::chrono::steady_clock;
+  auto t1 = Clock::now();
+  BitRadixTree bit_tree;
+  for (const auto& net : networks) {
+    bit_tree.Insert(net);
+  }
+  auto t2 = Clock::now();
+  std::chrono::duration<double, std::milli> bit_tree_insert_dur = t2 - t1;
+
+  t1 = Clock::now();
+  NRadixTree tree;
+  for (const auto& net : networks) {
+    EXPECT_TRUE(tree.Insert(net));
+  }
+  t2 = Clock::now();
+  std::chrono::duration<double, std::milli> tree_insert_dur = t2 - t1;
+
+  std::vector<IPNet> expected, actual;
+  expected.reserve(num_lookups);
+  actual.reserve(num_lookups);
+
+  t1 = Clock::now();
+  for (const auto& addr : lookups) {
+    expected.push_back(bit_tree.Find(addr));
+  }
+  t2 = Clock::now();
+  std::chrono::duration<double, std::milli> bit_tree_find_dur = t2 - t1;
+
+  t1 = Clock::now();
+  for (const auto& addr : lookups) {
+    actual.push_back(tree.Find(addr));
+  }
+  t2 = Clock::now();
+  std::chrono::duration<double, std::milli> tree_find_dur = t2 - t1;
+
+  for (size_t i = 0; i < num_lookups; i++) {
+    ASSERT_EQ(expected[i], actual[i]) << lookups[i];
+  }
+
+  std::cout << "Time to create tree with " << num_nets << " networks: " << tree_insert_dur.count() << "ms (bit radix tree: " << bit_tree_insert_dur.count() << "ms)\n";
+  std::cout << "Time to lookup " << num_lookups << " addresses: " << tree_find_dur.count() << "ms (bit radix tree: " << bit_tree_find_dur.count() << "ms)\n";
+}
+
+TEST(NRadixTest, TestBulkConstructor) {
+  std::mt19937_64 gen(42);
+  std::vector<IPNet> networks = RandomNetworks(5000, gen);
+  // Duplicates and networks which cannot be stored are skipped, as when inserting them one by one.
+  networks.push_back(networks[42]);
+  networks.push_back(IPNet());
+  networks.push_back(IPNet(Address(10, 0, 0, 0), 0));
+  networks.push_back(networks[4242]);
+
+  NRadixTree tree;
+  for (const auto& net : networks) {
+    tree.Insert(net);
+  }
+  NRadixTree bulk_tree(networks);
+  EXPECT_EQ(bulk_tree.GetAll(), tree.GetAll());
+
+  for (int i = 0; i < 100000; i++) {
+    const IPNet& network = networks[gen() % 5000];
+    Address address = i % 2 ? RandomAddressIn(network, gen) : Address(static_cast<uint32_t>(gen()));
+    ASSERT_EQ(bulk_tree.Find(address), tree.Find(address)) << address;
+    ASSERT_EQ(bulk_tree.Find(network), tree.Find(network)) << network;
+  }
+
+  // Networks can still be inserted afterwards.
+  EXPECT_TRUE(bulk_tree.Insert(IPNet(Address(10, 1, 2, 3), 32)));
+  EXPECT_FALSE(bulk_tree.Insert(networks[0]));
+  EXPECT_EQ(bulk_tree.Find(Address(10, 1, 2, 3)), IPNet(Address(10, 1, 2, 3), 32));
+
+  EXPECT_TRUE(NRadixTree(std::vector<IPNet>{}).IsEmpty());
+}
+
+TEST(NRadixTest, BenchmarkBulkConstructor) {
+  const size_t num_nets = 100000;
+  std::mt19937_64 gen(42);
+  std::vector<IPNet> networks = RandomNetworks(num_nets, gen);
+
+  using Clock = std::chrono::steady_clock;
+  auto t1 = Clock::now();
+  NRadixTree tree;
+  for (const auto& net : networks) {
+    tree.Insert(net);
+  }
+  auto t2 = Clock::now();
+  std::chrono::duration<double, std::milli> insert_dur = t2 - t1;
+
+  t1 = Clock::now();
+  NRadixTree bulk_tree(networks);
+  t2 = Clock::now();
+  std::chrono::duration<double, std::milli> bulk_dur = t2 - t1;
+
+  EXPECT_EQ(bulk_tree.GetAll().size(), num_nets);
+  std::cout << "Time to create tree with " << num_nets << " networks: " << bulk_dur.count() << "ms (one by one: " << insert_dur.count() << "ms)\n";
+}
+
+TEST(NRadixTest, TestFindIPv4Address) {
+  std::mt19937_64 gen(42);
+
+  // Nested networks of all lengths around a few prefixes, such that they span entries of all the IPv4 table levels,
+  // inserted in random order, such that shorter networks are also inserted after longer ones.
+  std::vector<uint32_t> prefixes = {0x0a000000, 0x0a0a0000, 0x0a0a0a00, 0xc0a80100, 0xffffffff};
+  UnorderedSet<IPNet> network_set;
+  for (int i = 0; i < 2000; i++) {
+    uint32_t addr = prefixes[gen() % prefixes.size()] ^ static_cast<uint32_t>((gen() & 0xffffffff) >> (gen() % 33));
+    network_set.insert(IPNet(Address(htonl(addr)), 1 + gen() % 32));
+  }
+  std::vector<IPNet> networks(network_set.begin(), network_set.end());
+  std::shuffle(networks.begin(), networks.end(), gen);
+
+  NRadixTree tree;
+  BitRadixTree bit_tree;
+  for (const auto& net : networks) {
+    EXPECT_TRUE(tree.Insert(net));
+    bit_tree.Insert(net);
+  }
+
+  for (int i = 0; i < 100000; i++) {
+    uint32_t addr = prefixes[gen() % prefixes.size()] ^ static_cast<uint32_t>((gen() & 0xffffffff) >> (gen() % 33));
+    Address address(htonl(addr));
+    ASSERT_EQ(tree.Find(address), bit_tree.Find(address)) << address;
+    ASSERT_EQ(tree.Find(address), tree.Find(IPNet(address))) << address;
+  }
+
+  NRadixTree ipv6_tree(std::vector<IPNet>{IPNet(Address(0ULL, 0ULL), 1)});
+  EXPECT_EQ(ipv6_tree.Find(Address(10, 0, 0, 1)), IPNet());
+}
+
+TEST(NRadixTest, TestCopies) {
+  NRadixTree tree(std::vector<IPNet>{IPNet(Address(10, 0, 0, 0), 8), IPNet(Address(0xfd00000000000000ULL, 0ULL), 8)});
+  NRadixTree copy = tree;
+  NRadixTree moved_to = std::move(copy);
+
+  // Modifying a copy does not affect the other ones.
+  EXPECT_TRUE(moved_to.Insert(IPNet(Address(10, 1, 0, 0), 16)));
+  EXPECT_TRUE(copy.Insert(IPNet(Address(10, 2, 0, 0), 16)));
+  EXPECT_EQ(tree.Find(Address(10, 1, 2, 3)), IPNet(Address(10, 0, 0, 0), 8));
+  EXPECT_EQ(tree.Find(Address(10, 2, 2, 3)), IPNet(Address(10, 0, 0, 0), 8));
+  EXPECT_EQ(moved_to.Find(Address(10, 1, 2, 3)), IPNet(Address(10, 1, 0, 0), 16));
+  EXPECT_EQ(moved_to.Find(Address(10, 2, 2, 3)), IPNet(Address(10, 0, 0, 0), 8));
+  EXPECT_EQ(copy.Find(Address(10, 1, 2, 3)), IPNet(Address(10, 0, 0, 0), 8));
+  EXPECT_EQ(copy.Find(Address(10, 2, 2, 3)), IPNet(Address(10, 2, 0, 0), 16));
+  EXPECT_EQ(tree.size(), 2);
+  EXPECT_EQ(moved_to.size(), 3);
+  EXPECT_EQ(copy.size(), 3);
+
+  tree = moved_to;
+  EXPECT_TRUE(tree.Insert(IPNet(Address(10, 1, 2, 0), 24)));
+  EXPECT_EQ(tree.Find(Address(10, 1, 2, 3)), IPNet(Address(10, 1, 2, 0), 24));
+  EXPECT_EQ(moved_to.Find(Address(10, 1, 2, 3)), IPNet(Address(10, 1, 0, 0), 16));
+}
+
 TEST(NRadixTest, IsEmpty) {
   NRadixTree tree;
 
@@ -1,3 +1,7 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
 #include <utility>
 
 #include "NetworkConnection.h"
@@ -80,6 +84,131 @@ TEST(TestAddress, TestLoopback) {
   EXPECT_TRUE(c.IsLocal());
 }
 
+TEST(TestAddress, TestClassifyAddresses) {
+  std::vector<std::pair<Address, AddressClass>> tests = {
+      {{8, 8, 8, 8}, AddressClass::PUBLIC},
+      {{10, 1, 2, 3}, AddressClass::PRIVATE},
+      {{100, 127, 0, 1}, AddressClass::PRIVATE},
+      {{100, 128, 0, 1}, AddressClass::PUBLIC},
+      {{172, 31, 255, 255}, AddressClass::PRIVATE},
+      {{172, 32, 0, 0}, AddressClass::PUBLIC},
+      {{127, 0, 0, 1}, AddressClass::LOCAL},
+      {{255, 255, 255, 255}, AddressClass::CANONICAL_EXTERNAL},
+      {{255, 255, 255, 254}, AddressClass::PUBLIC},
+      {Address(192, 168, 0, 1).ToV6(), AddressClass::PRIVATE},
+      {Address(127, 0, 10, 1).ToV6(), AddressClass::LOCAL},
+      {Address(8, 8, 8, 8).ToV6(), AddressClass::PUBLIC},
+      {{0ULL, htonll(1ULL)}, AddressClass::LOCAL},
+      {{htonll(0xfd00000000000000ULL), 0ULL}, AddressClass::PRIVATE},
+      {{htonll(0x2001db8000000000ULL), 0ULL}, AddressClass::PUBLIC},
+      {{0xffffffffffffffffULL, 0xffffffffffffffffULL}, AddressClass::CANONICAL_EXTERNAL},
+      {Address(), AddressClass::PUBLIC},
+  };
+
+  std::vector<Address> addresses;
+  for (const auto& test : tests) {
+    addresses.push_back(test.first);
+  }
+  std::vector<AddressClass> classes(addresses.size());
+  ClassifyAddresses(addresses.data(), addresses.size(), classes.data());
+  for (size_t i = 0; i < tests.size(); i++) {
+    EXPECT_EQ(classes[i], tests[i].second) << "Address under test: " << tests[i].first;
+    EXPECT_EQ(ClassifyAddress(tests[i].first), tests[i].second) << "Address under test: " << tests[i].first;
+  }
+
+  // Classes agree with the individual checks on random addresses, drawn from a few prefixes such that all classes
+  // are represented.
+  std::mt19937_64 gen(42);
+  std::vector<uint64_t> prefixes = {0x0a00000000000000ULL, 0x7f00000000000000ULL, 0xac10000000000000ULL, 0xc0a8000000000000ULL, 0xfd00000000000000ULL, 0xffffffffffffffffULL};
+  addresses.clear();
+  for (int i = 0; i < 10000; i++) {
+    uint64_t high = prefixes[gen() % prefixes.size()] | (gen() >> (8 + gen() % 56));
+    if (i % 2) {
+      addresses.emplace_back(htonl(static_cast<uint32_t>(high >> 32)));
+    } else if (i % 4) {
+      addresses.emplace_back(Address(htonl(static_cast<uint32_t>(high >> 32))).ToV6());
+    } else {
+      addresses.emplace_back(htonll(high), gen() % 2 ? gen() : ~0ULL);
+    }
+  }
+  classes.resize(addresses.size());
+  ClassifyAddresses(addresses.data(), addresses.size(), classes.data());
+  for (size_t i = 0; i < addresses.size(); i++) {
+    const Address& addr = addresses[i];
+    AddressClass expected = AddressClass::PUBLIC;
+    if (addr.IsLocal()) {
+      expected = AddressClass::LOCAL;
+    } else if (Address::IsCanonicalExternalIp(addr)) {
+      expected = AddressClass::CANONICAL_EXTERNAL;
+    } else {
+      for (const auto& net : PrivateNetworks(addr.family())) {
+        if (net.Contains(addr)) {
+          expected = AddressClass::PRIVATE;
+        }
+      }
+    }
+    ASSERT_EQ(classes[i], expected) << "Address under test: " << addr;
+  }
+}
+
+TEST(TestAddress, TestIsPrivateNetwork) {
+  EXPECT_TRUE(IsPrivateNetwork(IPNet(Address(10, 0, 0, 0), 8)));
+  EXPECT_TRUE(IsPrivateNetwork(IPNet(Address(10, 1, 0, 0), 16)));
+  EXPECT_TRUE(IsPrivateNetwork(IPNet(Address(172, 31, 0, 1), 32)));
+  EXPECT_FALSE(IsPrivateNetwork(IPNet(Address(10, 0, 0, 0), 7)));
+  EXPECT_FALSE(IsPrivateNetwork(IPNet(Address(172, 16, 0, 0), 11)));
+  EXPECT_FALSE(IsPrivateNetwork(IPNet(Address(127, 0, 0, 0), 8)));
+  EXPECT_FALSE(IsPrivateNetwork(IPNet(Address(8, 8, 8, 0), 24)));
+  EXPECT_TRUE(IsPrivateNetwork(IPNet(Address(192, 168, 0, 0).ToV6(), 112)));
+  EXPECT_FALSE(IsPrivateNetwork(IPNet(Address(192, 168, 0, 0).ToV6(), 104)));
+  EXPECT_TRUE(IsPrivateNetwork(IPNet(Address(htonll(0xfd12000000000000ULL), 0ULL), 16)));
+  EXPECT_FALSE(IsPrivateNetwork(IPNet(Address(htonll(0xfc00000000000000ULL), 0ULL), 7)));
+
+  // The compile-time ranges match PrivateNetworks().
+  for (const auto& network : PrivateNetworks()) {
+    EXPECT_TRUE(IsPrivateNetwork(network)) << network;
+    EXPECT_FALSE(IsPrivateNetwork(IPNet(network.address(), network.bits() - 1))) << network;
+  }
+}
+
+TEST(TestAddress, BenchmarkIsPublic) {
+  const size_t num_addresses = 1000000;
+  std::mt19937_64 gen(42);
+  std::vector<uint64_t> prefixes = {0x0a00000000000000ULL, 0x2300000000000000ULL, 0x6440000000000000ULL, 0xac10000000000000ULL, 0xc0a8000000000000ULL};
+  std::vector<Address> addresses;
+  addresses.reserve(num_addresses);
+  for (size_t i = 0; i < num_addresses; i++) {
+    uint64_t high = prefixes[gen() % prefixes.size()] | (gen() >> 16);
+    if (i % 4) {
+      addresses.emplace_back(htonl(static_cast<uint32_t>(high >> 32)));
+    } else {
+      addresses.push_back(Address(htonl(static_cast<uint32_t>(high >> 32))).ToV6());
+    }
+  }
+
+  using Clock = std::chrono::steady_clock;
+  size_t num_public = 0;
+  auto t1 = Clock::now();
+  for (const auto& addr : addresses) {
+    num_public += addr.IsPublic();
+  }
+  auto t2 = Clock::now();
+  std::chrono::duration<double, std::nano> dur = t2 - t1;
+
+  // Reference: compare each address with the private networks in turn.
+  size_t expected_public = 0;
+  t1 = Clock::now();
+  for (const auto& addr : addresses) {
+    const auto& networks = PrivateNetworks(addr.family());
+    expected_public += std::none_of(networks.begin(), networks.end(), [&addr](const IPNet& net) { return net.Contains(addr); });
+  }
+  t2 = Clock::now();
+  std::chrono::duration<double, std::nano> reference_dur = t2 - t1;
+
+  EXPECT_EQ(num_public, expected_public);
+  std::cout << "IsPublic: " << dur.count() / num_addresses << " ns per address (network by network: " << reference_dur.count() / num_addresses << " ns)\n";
+}
+
 TEST(TestAddress, Parse) {
   std::optional<Address> address;
 
@@ -176,6 +305,76 @@ TEST(TestIPNet, TestIsCanonicalExternalIp) {
   }
 }
 
+TEST(TestContainerId, TestInterning) {
+  std::string id = "0123456789ab";
+  ContainerId a(id);
+  ContainerId b("0123456789ab");
+  ContainerId c(std::string_view("ba9876543210"));
+
+  EXPECT_EQ(a, b);
+  EXPECT_NE(a, c);
+  EXPECT_EQ(&a.str(), &b.str());
+  EXPECT_EQ(a.str(), id);
+  EXPECT_EQ(a.Hash(), std::hash<std::string>()(id));
+
+  size_t count = ContainerId::InternedCount();
+  ContainerId d(id.substr(0));
+  EXPECT_EQ(d, a);
+  EXPECT_EQ(ContainerId::InternedCount(), count);
+
+  EXPECT_TRUE(ContainerId().empty());
+  EXPECT_EQ(ContainerId(), ContainerId(""));
+}
+
+TEST(TestContainerId, TestRelease) {
+  size_t count = ContainerId::InternedCount();
+  {
+    ContainerId a("released-container");
+    EXPECT_EQ(ContainerId::InternedCount(), count + 1);
+
+    ContainerId b(a);
+    ContainerId c(std::move(a));
+    EXPECT_TRUE(a.empty());
+    a = b;
+    EXPECT_EQ(a, c);
+    EXPECT_EQ(ContainerId::InternedCount(), count + 1);
+  }
+  EXPECT_EQ(ContainerId::InternedCount(), count);
+
+  // The ID is interned again once needed.
+  ContainerId d("released-container");
+  EXPECT_EQ(d.str(), "released-container");
+  EXPECT_EQ(ContainerId::InternedCount(), count + 1);
+
+  // The empty ID is never released.
+  { ContainerId empty(""); }
+  EXPECT_TRUE(ContainerId().empty());
+  EXPECT_EQ(ContainerId::InternedCount(), count + 1);
+}
+
+TEST(TestContainerId, TestConnectionContainer) {
+  Endpoint local(Address(10, 0, 0, 1), 80);
+  Endpoint remote(Address(10, 0, 0, 2), 1234);
+
+  std::string container = "container";
+  Connection conn1(container, local, remote, L4Proto::TCP, true);
+  Connection conn2("container", local, remote, L4Proto::TCP, true);
+  Connection conn3("other", local, remote, L4Proto::TCP, true);
+
+  EXPECT_EQ(conn1, conn2);
+  EXPECT_EQ(conn1.Hash(), conn2.Hash());
+  EXPECT_NE(conn1, conn3);
+  EXPECT_EQ(conn1.container(), "container");
+  EXPECT_EQ(conn1.container_id(), ContainerId(container));
+  EXPECT_EQ(Connection().container(), "");
+
+  ContainerEndpoint cep1(container, local, L4Proto::TCP, nullptr);
+  ContainerEndpoint cep2("container", local, L4Proto::TCP, nullptr);
+  EXPECT_EQ(cep1, cep2);
+  EXPECT_EQ(cep1.container(), "container");
+  EXPECT_EQ(cep1.container_id(), conn1.container_id());
+}
+
 }  // namespace
 
 }  // namespace collector
@@ -1,6 +1,11 @@
+#include <array>
 #include <chrono>
+#include <cstring>
+#include <functional>
+#include <memory>
 #include <mutex>
 #include <string>
+#include <vector>
 
 #include <google/protobuf/util/time_util.h>
 
@@ -19,7 +24,9 @@ namespace {
 
 using grpc_duplex_impl::Result;
 using grpc_duplex_impl::Status;
+using ::testing::ElementsAre;
 using ::testing::Invoke;
+using ::testing::Pair;
 using ::testing::Return;
 using ::testing::ReturnPointee;
 using ::testing::UnorderedElementsAre;
@@ -78,6 +85,33 @@ class MockCollectorConfig : public collector::CollectorConfig {
   void SetMaxConnectionsPerMinute(int64_t limit) {
     max_connections_per_minute_ = limit;
   }
+
+  void SetNetworkMessageLimits(size_t max_entries, size_t max_bytes) {
+    network_message_max_entries_ = max_entries;
+    network_message_max_bytes_ = max_bytes;
+  }
+
+  void EnableNetworkStringDictionary() {
+    network_string_dictionary_ = true;
+  }
+};
+
+class FakeProcess : public IProcess {
+ public:
+  FakeProcess(std::string comm, std::string exe_path, std::string args)
+      : comm_(std::move(comm)), exe_path_(std::move(exe_path)), args_(std::move(args)) {}
+
+  uint64_t pid() const override { return 0; }
+  std::string container_id() const override { return ""; }
+  std::string comm() const override { return comm_; }
+  std::string exe() const override { return exe_path_; }
+  std::string exe_path() const override { return exe_path_; }
+  std::string args() const override { return args_; }
+
+ private:
+  std::string comm_;
+  std::string exe_path_;
+  std::string args_;
 };
 
 class MockConnScraper : public IConnScraper {
@@ -108,6 +142,7 @@ class MockNetworkConnectionInfoServiceComm : public INetworkConnectionInfoServic
   MOCK_METHOD(void, TryCancel, (), (override));
   MOCK_METHOD(sensor::NetworkConnectionInfoService::StubInterface*, GetStub, (), (override));
   MOCK_METHOD(std::unique_ptr<IDuplexClientWriter<sensor::NetworkConnectionInfoMessage>>, PushNetworkConnectionInfoOpenStream, (std::function<void(const sensor::NetworkFlowsControlMessage*)> receive_func), (override));
+  MOCK_METHOD(bool, StringDictionaryAcknowledged, (), (override));
 };
 
 /* gRPC payload objects are not strictly the ones of our internal model.
@@ -185,6 +220,46 @@ class NetworkConnectionInfoMessageParser {
   }
 };
 
+/* Sensor's end of the string dictionary: decodes the strings of the messages of a stream, in the order
+   NetworkStatusNotifier::EncodeStrings encodes them. */
+class MockSensorStringDecoder {
+ public:
+  bool Decode(sensor::NetworkConnectionInfoMessage* msg) {
+    auto* info = msg->mutable_info();
+    for (auto& conn : *info->mutable_updated_connections()) {
+      if (!Decode(conn.mutable_container_id())) {
+        return false;
+      }
+    }
+    for (auto& endpoint : *info->mutable_updated_endpoints()) {
+      if (!Decode(endpoint.mutable_container_id())) {
+        return false;
+      }
+      if (endpoint.has_originator()) {
+        auto* originator = endpoint.mutable_originator();
+        if (!Decode(originator->mutable_process_name()) ||
+            !Decode(originator->mutable_process_exec_file_path()) ||
+            !Decode(originator->mutable_process_args())) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+ private:
+  bool Decode(std::string* str) {
+    auto decoded = decoder_.Decode(*str);
+    if (!decoded) {
+      return false;
+    }
+    *str = std::move(*decoded);
+    return true;
+  }
+
+  StringDictionaryDecoder decoder_;
+};
+
 }  // namespace
 
 class NetworkStatusNotifierTest : public testing::Test {
@@ -349,6 +424,51 @@ TEST_F(NetworkStatusNotifierTest, UpdateIPnoAfterglow) {
   net_status_notifier.Stop();
 }
 
+TEST_F(NetworkStatusNotifierTest, UnchangedKnownIPNetworks) {
+  Connection conn("containerId", Endpoint(Address(10, 0, 1, 32), 1024), Endpoint(Address(139, 45, 27, 4), 999), L4Proto::TCP, true);
+  Connection in_network("containerId", Endpoint(Address(), 1024), Endpoint(IPNet(Address(139, 45, 0, 0), 16), 0), L4Proto::TCP, true);
+  Connection external("containerId", Endpoint(Address(), 1024), Endpoint(IPNet(Address(255, 255, 255, 255), 0, true), 0), L4Proto::TCP, true);
+  conn_tracker->AddConnection(conn, 1234);
+
+  unsigned char content[] = {139, 45, 0, 0, 16};  // address in network order, plus prefix length
+  sensor::IPNetworkList networks;
+  networks.set_ipv4_networks(std::string((char*)content, sizeof(content)));
+
+  net_status_notifier.ReceiveIPNetworks(networks);
+  EXPECT_THAT(conn_tracker->FetchConnState(true), UnorderedElementsAre(std::make_pair(in_network, ConnStatus(1234, true))));
+
+  // The same list again does not update the tracker, which keeps networks set in the meantime.
+  conn_tracker->UpdateKnownIPNetworks(NRadixTree(), {Address::Family::IPV4});
+  net_status_notifier.ReceiveIPNetworks(networks);
+  EXPECT_THAT(conn_tracker->FetchConnState(true), UnorderedElementsAre(std::make_pair(external, ConnStatus(1234, true))));
+
+  // A different one does.
+  unsigned char ipv6_content[17] = {0x20, 0x01, 0x0d, 0xb8};  // 2001:db8::/32
+  ipv6_content[16] = 32;
+  networks.set_ipv6_networks(std::string((char*)ipv6_content, sizeof(ipv6_content)));
+  net_status_notifier.ReceiveIPNetworks(networks);
+  EXPECT_THAT(conn_tracker->FetchConnState(true), UnorderedElementsAre(std::make_pair(in_network, ConnStatus(1234, true))));
+}
+
+TEST_F(NetworkStatusNotifierTest, KnownIPv6NetworkFullLength) {
+  // 2001:db8::1/128, the prefix length not fitting in a signed byte.
+  unsigned char content[17] = {0x20, 0x01, 0x0d, 0xb8};
+  content[15] = 1;
+  content[16] = 128;
+  std::array<uint64_t, Address::kU64MaxLen> data = {};
+  std::memcpy(data.data(), content, 16);
+  Address address(Address::Family::IPV6, data);
+
+  Connection conn("containerId", Endpoint(Address(10, 0, 1, 32), 1024), Endpoint(address, 999), L4Proto::TCP, true);
+  Connection in_network("containerId", Endpoint(Address(), 1024), Endpoint(IPNet(address, 128), 0), L4Proto::TCP, true);
+  conn_tracker->AddConnection(conn, 1234);
+
+  sensor::IPNetworkList networks;
+  networks.set_ipv6_networks(std::string((char*)content, sizeof(content)));
+  net_status_notifier.ReceiveIPNetworks(networks);
+  EXPECT_THAT(conn_tracker->FetchConnState(true), UnorderedElementsAre(std::make_pair(in_network, ConnStatus(1234, true))));
+}
+
 TEST_F(NetworkStatusNotifierTest, RateLimitedConnections) {
   // maximum of 2 connections per scrape interval
   // if we throw four connections from the same container into the conn
@@ -414,4 +534,187 @@ TEST_F(NetworkStatusNotifierTest, RateLimitedConnections) {
   EXPECT_TRUE(updatesClose.size() == 4);
 }
 
+TEST_F(NetworkStatusNotifierTest, ChunkedMessages) {
+  ConnMap conn_delta;
+  for (uint16_t port = 1; port <= 5; port++) {
+    Connection conn("containerId", Endpoint(Address(10, 0, 1, 32), 1024), Endpoint(Address(192, 168, 0, 1), port), L4Proto::TCP, true);
+    conn_delta.emplace(conn, ConnStatus(1234, port % 2 == 0));
+  }
+  AdvertisedEndpointMap cep_delta;
+  for (uint16_t port = 1; port <= 2; port++) {
+    cep_delta.emplace(ContainerEndpoint("containerId", Endpoint(Address(), port), L4Proto::TCP, nullptr), ConnStatus(1234, true));
+  }
+
+  NetworkStatusNotifier::MessageAllocator allocator;
+
+  // Returns the number of connections and endpoints in each of the messages reporting the delta.
+  auto create_messages = [&](const std::function<void(const sensor::NetworkConnectionInfoMessage&)>& check) {
+    std::vector<std::pair<int, int>> sizes;
+    auto delta = net_status_notifier.GetDeltaEntries(conn_delta, cep_delta);
+    while (!delta.Done()) {
+      const auto* msg = net_status_notifier.CreateInfoMessage(&allocator, &delta);
+      check(*msg);
+      sizes.emplace_back(msg->info().updated_connections_size(), msg->info().updated_endpoints_size());
+    }
+    return sizes;
+  };
+
+  // Without limits, the whole delta is sent at once.
+  config.SetNetworkMessageLimits(0, 0);
+  EXPECT_THAT(create_messages([](const auto&) {}), ElementsAre(Pair(5, 2)));
+
+  config.SetNetworkMessageLimits(3, 0);
+  EXPECT_THAT(create_messages([](const auto&) {}), ElementsAre(Pair(3, 0), Pair(2, 1), Pair(0, 1)));
+
+  // Closed connections come with a timestamp, so entries differ in size. Check that each message stays within the limit,
+  // and that all entries get sent.
+  size_t max_bytes = 100;
+  config.SetNetworkMessageLimits(0, max_bytes);
+  size_t num_connections = 0;
+  size_t num_endpoints = 0;
+  auto sizes = create_messages([&](const sensor::NetworkConnectionInfoMessage& msg) {
+    size_t num_bytes = 0;
+    for (const auto& conn : msg.info().updated_connections()) {
+      num_bytes += conn.ByteSizeLong() + 2;
+      num_connections++;
+    }
+    for (const auto& cep : msg.info().updated_endpoints()) {
+      num_bytes += cep.ByteSizeLong() + 2;
+      num_endpoints++;
+    }
+    EXPECT_LE(num_bytes, max_bytes);
+  });
+  EXPECT_GT(sizes.size(), 1);
+  EXPECT_EQ(num_connections, 5);
+  EXPECT_EQ(num_endpoints, 2);
+}
+
+TEST_F(NetworkStatusNotifierTest, CachedSubMessages) {
+  Connection conn("containerId", Endpoint(Address(), 1024), Endpoint(IPNet(Address(139, 45, 0, 0), 16), 0), L4Proto::TCP, true);
+  ConnMap conn_delta = {{conn, ConnStatus(1234, true)}};
+  AdvertisedEndpointMap cep_delta;
+
+  NetworkStatusNotifier::MessageAllocator allocator;
+  auto delta = net_status_notifier.GetDeltaEntries(conn_delta, cep_delta);
+  const auto* msg = net_status_notifier.CreateInfoMessage(&allocator, &delta);
+  [[maybe_unused]] const auto* remote_address = &msg->info().updated_connections(0).remote_address();
+
+  // The same connection is reported again from the same address sub-messages.
+  delta = net_status_notifier.GetDeltaEntries(conn_delta, cep_delta);
+  msg = net_status_notifier.CreateInfoMessage(&allocator, &delta);
+#ifdef USE_PROTO_ARENAS
+  EXPECT_EQ(&msg->info().updated_connections(0).remote_address(), remote_address);
+#endif
+  EXPECT_THAT(NetworkConnectionInfoMessageParser(*msg).get_updated_connections(), UnorderedElementsAre(std::make_pair(conn, true)));
+}
+
+TEST_F(NetworkStatusNotifierTest, StringDictionary) {
+  // A few containers with many connections each, and processes listening in each of them.
+  std::vector<std::shared_ptr<IProcess>> processes = {
+      std::make_shared<FakeProcess>("nginx", "/usr/sbin/nginx", "-g daemon off;"),
+      std::make_shared<FakeProcess>("postgres", "/usr/lib/postgresql/bin/postgres", "-D /var/lib/postgresql/data"),
+  };
+  ConnMap conn_delta;
+  AdvertisedEndpointMap cep_delta;
+  for (uint8_t container = 0; container < 10; container++) {
+    std::string container_id = "0123456789a" + std::to_string(container);
+    for (uint16_t port = 1; port <= 20; port++) {
+      Connection conn(container_id, Endpoint(Address(10, 0, container, 1), 8080), Endpoint(Address(10, 1, 0, port), 40000 + port), L4Proto::TCP, true);
+      conn_delta.emplace(conn, ConnStatus(1234, true));
+    }
+    for (size_t i = 0; i < processes.size(); i++) {
+      ContainerEndpoint cep(container_id, Endpoint(Address(), 8000 + i), L4Proto::TCP, processes[i]);
+      cep_delta.emplace(cep, ConnStatus(1234, true));
+    }
+  }
+
+  NetworkStatusNotifier::MessageAllocator allocator;
+
+  // Returns the messages reporting the delta in a few scrapes in a row, serialized as they are sent to Sensor.
+  auto create_messages = [&]() {
+    std::vector<std::string> messages;
+    for (int scrape = 0; scrape < 3; scrape++) {
+      auto delta = net_status_notifier.GetDeltaEntries(conn_delta, cep_delta);
+      while (!delta.Done()) {
+        messages.push_back(net_status_notifier.CreateInfoMessage(&allocator, &delta)->SerializeAsString());
+      }
+    }
+    return messages;
+  };
+  auto total_bytes = [](const std::vector<std::string>& messages) {
+    size_t num_bytes = 0;
+    for (const auto& msg : messages) {
+      num_bytes += msg.size();
+    }
+    return num_bytes;
+  };
+
+  auto plain = create_messages();
+  config.EnableNetworkStringDictionary();
+  net_status_notifier.string_dictionary_acked_ = true;
+  net_status_notifier.ResetStringDictionary();
+  auto encoded = create_messages();
+
+  size_t plain_bytes = total_bytes(plain);
+  size_t encoded_bytes = total_bytes(encoded);
+  std::cout << "Bytes on the wire: " << plain_bytes << " without string dictionary, " << encoded_bytes << " with" << std::endl;
+  EXPECT_LT(encoded_bytes, plain_bytes * 9 / 10);
+
+  // Sensor gets the same messages back, but for their time.
+  MockSensorStringDecoder sensor;
+  ASSERT_EQ(encoded.size(), plain.size());
+  for (size_t i = 0; i < encoded.size(); i++) {
+    sensor::NetworkConnectionInfoMessage expected;
+    sensor::NetworkConnectionInfoMessage received;
+    ASSERT_TRUE(expected.ParseFromString(plain[i]));
+    ASSERT_TRUE(received.ParseFromString(encoded[i]));
+    ASSERT_TRUE(sensor.Decode(&received));
+    expected.mutable_info()->clear_time();
+    received.mutable_info()->clear_time();
+    EXPECT_EQ(received.SerializeAsString(), expected.SerializeAsString());
+  }
+}
+
+TEST_F(NetworkStatusNotifierTest, StringDictionaryNotAcknowledged) {
+  auto process = std::make_shared<FakeProcess>("nginx", "/usr/sbin/nginx", "-g daemon off;");
+  ConnMap conn_delta = {{Connection("0123456789ab", Endpoint(Address(10, 0, 0, 1), 8080), Endpoint(Address(10, 1, 0, 1), 40000), L4Proto::TCP, true), ConnStatus(1234, true)}};
+  AdvertisedEndpointMap cep_delta = {{ContainerEndpoint("0123456789ab", Endpoint(Address(), 8080), L4Proto::TCP, process), ConnStatus(1234, true)}};
+
+  NetworkStatusNotifier::MessageAllocator allocator;
+  auto create_message = [&]() {
+    auto delta = net_status_notifier.GetDeltaEntries(conn_delta, cep_delta);
+    auto* msg = net_status_notifier.CreateInfoMessage(&allocator, &delta);
+    msg->mutable_info()->clear_time();
+    return msg->SerializeAsString();
+  };
+
+  auto plain = create_message();
+
+  // Sensor acknowledges the string dictionary with its first control message.
+  EXPECT_CALL(*comm, StringDictionaryAcknowledged).WillOnce(Return(false)).WillOnce(Return(true));
+  net_status_notifier.ReplaceComm(std::move(comm));
+  config.EnableNetworkStringDictionary();
+  net_status_notifier.ResetStringDictionary();
+
+  // Without the acknowledgement, the strings of the stream are sent as is.
+  sensor::NetworkFlowsControlMessage control;
+  net_status_notifier.OnRecvControlMessage(&control);
+  EXPECT_EQ(create_message(), plain);
+  EXPECT_EQ(create_message(), plain);
+
+  // Nor are they encoded once Sensor acknowledges it in the middle of the stream, as it would not know the strings
+  // referenced.
+  net_status_notifier.OnRecvControlMessage(&control);
+  EXPECT_TRUE(net_status_notifier.string_dictionary_acked_);
+  EXPECT_EQ(create_message(), plain);
+
+  // They are from the next stream on. The container ID is a reference from the endpoint of the first message on, and the
+  // process strings from the second one, after which the encoded originator comes from the cache.
+  net_status_notifier.ResetStringDictionary();
+  for (int i = 0; i < 3; i++) {
+    EXPECT_LT(create_message().size(), plain.size());
+  }
+  EXPECT_EQ(net_status_notifier.string_dictionary_.hits(), 1 + 5 + 2);
+}
+
 }  // namespace collector
@@ -1,3 +1,5 @@
+#include <memory>
+
 #include "internalapi/sensor/network_connection_iservice.grpc.pb.h"
 
 #include "ProtoAllocator.h"
@@ -18,6 +20,31 @@ TEST(ProtoAllocator, OverflowDefaultPool) {
   allocator.Reset();
 }
 
+TEST(ProtoAllocator, OverflowWithoutPoolGrowth) {
+  ProtoAllocator<sensor::NetworkConnectionInfoMessage> allocator;
+  allocator.EnablePoolGrowth(false);
+
+  // Messages which do not fit in the pool are still built, every time.
+  for (int round = 0; round < 2; round++) {
+    for (unsigned int i = 0; i <= ProtoAllocator<sensor::NetworkConnectionInfoMessage>::kDefaultPoolSize / sizeof(sensor::NetworkConnectionInfoMessage); i++) {
+      ASSERT_NE(allocator.AllocateRoot(), nullptr);
+    }
+    allocator.Reset();
+  }
+}
+
+TEST(ProtoAllocator, KeepUntilReset) {
+  ProtoAllocator<sensor::NetworkConnectionInfoMessage> allocator;
+  auto address = std::make_shared<sensor::NetworkAddress>();
+  std::weak_ptr<sensor::NetworkAddress> weak_address = address;
+
+  allocator.KeepUntilReset(std::move(address));
+  EXPECT_FALSE(weak_address.expired());
+
+  allocator.Reset();
+  EXPECT_TRUE(weak_address.expired());
+}
+
 }  // namespace
 
 }  // namespace collector
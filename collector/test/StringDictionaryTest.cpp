@@ -0,0 +1,116 @@
+#include <string>
+#include <vector>
+
+#include "StringDictionary.h"
+#include "gtest/gtest.h"
+
+namespace collector {
+
+namespace {
+
+TEST(StringDictionaryTest, RepeatedStringsAreReferences) {
+  StringDictionaryEncoder encoder;
+  StringDictionaryDecoder decoder;
+
+  std::vector<std::string> strings = {"0123456789ab", "nginx", "0123456789ab", "/usr/sbin/nginx", "nginx", "0123456789ab"};
+  std::vector<std::string> encoded;
+  for (const auto& str : strings) {
+    encoded.push_back(encoder.Encode(str));
+  }
+
+  EXPECT_EQ(encoded[0], "0123456789ab");
+  EXPECT_EQ(encoded[1], "nginx");
+  EXPECT_EQ(encoded[2], std::string("\0\0", 2));
+  EXPECT_EQ(encoded[3], "/usr/sbin/nginx");
+  EXPECT_EQ(encoded[4], std::string("\0\1", 2));
+  EXPECT_EQ(encoded[5], std::string("\0\0", 2));
+  EXPECT_EQ(encoder.size(), 3);
+  EXPECT_EQ(encoder.hits(), 3);
+
+  for (size_t i = 0; i < encoded.size(); i++) {
+    EXPECT_EQ(decoder.Decode(encoded[i]), strings[i]);
+  }
+  EXPECT_EQ(decoder.size(), 3);
+}
+
+TEST(StringDictionaryTest, ShortStringsArePlain) {
+  StringDictionaryEncoder encoder;
+  StringDictionaryDecoder decoder;
+
+  for (int i = 0; i < 3; i++) {
+    EXPECT_EQ(encoder.Encode(""), "");
+    EXPECT_EQ(encoder.Encode("sh"), "sh");
+    EXPECT_EQ(decoder.Decode("sh"), "sh");
+  }
+  EXPECT_EQ(encoder.size(), 0);
+  EXPECT_EQ(decoder.size(), 0);
+}
+
+TEST(StringDictionaryTest, Capacity) {
+  StringDictionaryEncoder encoder(2);
+  StringDictionaryDecoder decoder(2);
+
+  std::vector<std::string> strings = {"first", "second", "third", "third", "second"};
+  std::vector<std::string> encoded;
+  for (const auto& str : strings) {
+    encoded.push_back(encoder.Encode(str));
+  }
+
+  // Strings past the capacity are always sent as is.
+  EXPECT_EQ(encoded[2], "third");
+  EXPECT_EQ(encoded[3], "third");
+  EXPECT_EQ(encoded[4], std::string("\0\1", 2));
+
+  for (size_t i = 0; i < encoded.size(); i++) {
+    EXPECT_EQ(decoder.Decode(encoded[i]), strings[i]);
+  }
+}
+
+TEST(StringDictionaryTest, LargeIndices) {
+  StringDictionaryEncoder encoder;
+  StringDictionaryDecoder decoder;
+
+  std::vector<std::string> strings;
+  for (size_t i = 0; i < string_dictionary::kMaxCapacity + 10; i++) {
+    strings.push_back("string-" + std::to_string(i));
+  }
+  for (const auto& str : strings) {
+    ASSERT_EQ(decoder.Decode(encoder.Encode(str)), str);
+  }
+  EXPECT_EQ(encoder.size(), string_dictionary::kMaxCapacity);
+
+  for (size_t i = 0; i < strings.size(); i++) {
+    auto encoded = encoder.Encode(strings[i]);
+    if (i < string_dictionary::kMaxCapacity) {
+      EXPECT_LE(encoded.size(), 3);
+    } else {
+      EXPECT_EQ(encoded, strings[i]);
+    }
+    ASSERT_EQ(decoder.Decode(encoded), strings[i]);
+  }
+}
+
+TEST(StringDictionaryTest, InvalidReferences) {
+  StringDictionaryDecoder decoder;
+  EXPECT_EQ(decoder.Decode("first"), "first");
+
+  EXPECT_EQ(decoder.Decode(std::string("\0", 1)), std::nullopt);
+  EXPECT_EQ(decoder.Decode(std::string("\0\1", 2)), std::nullopt);
+  EXPECT_EQ(decoder.Decode(std::string("\0\0\0\0", 4)), std::nullopt);
+  EXPECT_EQ(decoder.Decode(std::string("\0\x80", 2)), std::nullopt);
+  EXPECT_EQ(decoder.Decode(std::string("\0\0", 2)), "first");
+}
+
+TEST(StringDictionaryTest, Clear) {
+  StringDictionaryEncoder encoder;
+  EXPECT_EQ(encoder.Encode("first"), "first");
+  EXPECT_EQ(encoder.Encode("first"), std::string("\0\0", 2));
+
+  encoder.Clear();
+  EXPECT_EQ(encoder.size(), 0);
+  EXPECT_EQ(encoder.Encode("first"), "first");
+}
+
+}  // namespace
+
+}  // namespace collector